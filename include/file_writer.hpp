@@ -0,0 +1,236 @@
+#ifndef _FILE_WRITER_
+#define _FILE_WRITER_
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace jpeg
+{
+
+/* Size of the blocks the files are written in, a multiple of the O_DIRECT alignment */
+#define WRITER_BLOCK_SIZE 0x40000
+#define WRITER_ALIGNMENT 0x1000
+
+struct writer_file;
+
+struct writer_request
+{
+	/* File the block belongs to and the aligned block itself */
+	struct writer_file *file;
+	char *data;
+
+	/* Part of the block not yet written and its position in the file */
+	struct iovec iov;
+	off_t offset;
+};
+typedef struct writer_request writer_request_t;
+
+struct writer_file
+{
+	int fd;
+	char *name;
+
+	/* Flag whether the file is opened with O_DIRECT, the last block is padded then */
+	bool direct;
+
+	/* Block currently filled, the bytes in it and the bytes passed in total */
+	writer_request_t *block;
+	size_t fill;
+	size_t size;
+
+	/* Blocks submitted but not yet written, the file is closed once none are left */
+	size_t pending;
+	bool closed;
+
+	/* First error returned by a write, 0 if none */
+	int error;
+};
+typedef struct writer_file writer_file_t;
+
+class FileWriter
+{
+private:
+	/* Lock for the blocks, the files and the submission queue */
+	std::mutex m_lock;
+	std::condition_variable m_changed;
+
+	/* Blocks not in use and all blocks, a block is added for each file filling one if none is free */
+	std::vector<writer_request_t*> m_free_blocks;
+	std::deque<writer_request_t> m_blocks;
+
+	/* Blocks submitted but not yet written and the maximum number of them */
+	size_t m_in_flight;
+	size_t m_max_in_flight;
+
+	/* Files not yet closed and the number of files that failed since the last wait */
+	size_t m_open_files;
+	size_t m_failed;
+
+	/* Flag whether O_DIRECT is requested */
+	bool m_direct;
+
+	/* io_uring instance, -1 if the thread backend is used */
+	int m_ring_fd;
+	void *m_sq_ring;
+	void *m_cq_ring;
+	void *m_sqes;
+	size_t m_sq_ring_size;
+	size_t m_cq_ring_size;
+	size_t m_sqes_size;
+	unsigned *m_sq_tail;
+	unsigned *m_sq_mask;
+	unsigned *m_sq_array;
+	unsigned *m_cq_head;
+	unsigned *m_cq_tail;
+	unsigned *m_cq_mask;
+	void *m_cqes;
+
+	/* Requests submitted to the ring and not yet completed, and the flag whether the ring
+	 * failed, the thread backend writes the requests then */
+	std::vector<writer_request_t*> m_ring_requests;
+	bool m_ring_failed;
+
+	/* Requests for the thread backend */
+	std::deque<writer_request_t*> m_queue;
+	bool m_stop;
+
+	/* Thread reaping the completions or doing the writes */
+	std::thread m_worker;
+
+	/**
+	 * Set up the io_uring instance
+	 *
+	 * @param entries the number of submission queue entries
+	 * @return true on success
+	 */
+	bool setup_ring(unsigned int entries);
+
+	/**
+	 * Submit the given request, the lock needs to be held. If the ring does not take
+	 * the request, all requests are written by the thread backend from then on.
+	 *
+	 * @param request the request to submit
+	 */
+	void submit(writer_request_t *request);
+
+	/**
+	 * Get a free block, a new one is allocated if none is free
+	 *
+	 * @return the block, NULL if no memory is left
+	 */
+	writer_request_t *acquire_block(void);
+
+	/**
+	 * Submit the block currently filled of the given file
+	 *
+	 * @param file the file
+	 * @param length the number of bytes to write
+	 */
+	void submit_block(writer_file_t *file, size_t length);
+
+	/**
+	 * Handle the completion of the given request
+	 *
+	 * @param request the request
+	 * @param result the number of bytes written or the negated error
+	 */
+	void complete(writer_request_t *request, ssize_t result);
+
+	/**
+	 * Return the block of the given finished request, the lock needs to be held
+	 *
+	 * @param request the request
+	 * @param result the number of bytes written or the negated error
+	 */
+	void release(writer_request_t *request, ssize_t result);
+
+	/**
+	 * Fail all requests in the ring after waiting for their completions failed
+	 *
+	 * @param error the error
+	 */
+	void fail_ring(int error);
+
+	/**
+	 * Close the given file once all its blocks are written, the lock needs to be held
+	 *
+	 * @param file the file
+	 */
+	void finish_file(writer_file_t *file);
+
+	/**
+	 * Reap the completions of the io_uring instance until the writer is destroyed,
+	 * continues as the thread backend if the ring failed
+	 */
+	void reap_completions();
+
+	/**
+	 * Do the writes queued for the thread backend until the writer is destroyed
+	 */
+	void write_requests();
+
+public:
+	/**
+	 * Create a writer. io_uring is used if the kernel supports it, otherwise the
+	 * writes are done on a thread of their own.
+	 *
+	 * @param direct flag whether to open the files with O_DIRECT, bypassing the page cache
+	 * @param blocks the number of blocks in flight, writing waits once all are in flight
+	 */
+	FileWriter(bool direct = false, size_t blocks = 0x20);
+
+	/**
+	 * Wait for all files to be written
+	 */
+	~FileWriter();
+
+	/**
+	 * Open the given file for writing
+	 *
+	 * @param file the path of the file
+	 * @return the file, NULL if it could not be opened
+	 */
+	writer_file_t *open(const char * const file);
+
+	/**
+	 * Append to the given file, full blocks are submitted right away
+	 *
+	 * @param file the file
+	 * @param data the bytes to append
+	 * @param size the number of bytes
+	 * @return 0 on success, the error of a previous write or ENOMEM otherwise
+	 */
+	int write(writer_file_t *file, const char *data, size_t size);
+
+	/**
+	 * Submit the rest of the given file, it is closed once all blocks are written.
+	 * The file must not be used afterwards.
+	 *
+	 * @param file the file
+	 */
+	void close(writer_file_t *file);
+
+	/**
+	 * Wait for all open files to be closed and written
+	 *
+	 * @return 0 if all files were written, 1 if a write failed
+	 */
+	int wait(void);
+
+	/**
+	 * Get whether io_uring is used
+	 *
+	 * @return true if io_uring is used, false for the thread backend
+	 */
+	bool uses_io_uring(void) const;
+};
+}
+
+#endif
@@ -1,289 +1,1112 @@
-#ifndef _JPEG_ENCODER_
-#define _JPEG_ENCODER_
-
-#include <CL/cl.hpp>
-#include <string>
-#include <fstream>
-#include <streambuf>
-#include <vector>
-#include <cstdio>
-#include "tables.h"
-
-namespace jpeg
-{
-
-struct derived_huffman_table
-{
-	unsigned int code[0x100];
-	unsigned char length[0x100];
-};
-typedef derived_huffman_table derived_huffman_table_t;
-
-struct huffman_table
-{
-	unsigned char bits[0x11];
-	unsigned char value[0x100];
-};
-typedef struct huffman_table huffman_table_t;
-
-struct entropy_state
-{
-	size_t buffer;
-	int bits;
-	int last_dc_val[0x3];
-};
-typedef struct entropy_state entropy_state_t;
-
-struct quantification_table
-{
-	unsigned char value[0x40];
-};
-typedef struct quantification_table quantification_table_t;
-
-
-
-class JPEGEncoder
-{
-private:
-	/* Quantification Table, one for luminance, one for chrominance */
-	quantification_table_t m_quant_tbls[0x2];
-
-	/* Division Lookup table for DCT, one for luminance, one for chrominance */
-	short m_fdct_divisors[0x2][0x100];
-
-	/* entropy encoding */
-	derived_huffman_table_t m_dc_derived_tbls[0x2];
-	derived_huffman_table_t m_ac_derived_tbls[0x2];
-	huffman_table_t m_dc_huff_tbls[0x2];
-	huffman_table_t m_ac_huff_tbls[0x2];
-
-	/* OpenCL Context used in this class */
-	cl::Context m_context;
-
-	/* OpenCL device to use */
-	cl::Device m_device;
-
-	/* OpenCL command queue to use */
-	cl::CommandQueue m_queue;
-
-	/* Program containing the kernels */
-	cl::Program m_program;
-
-	/* Kernels */
-	cl::Kernel m_transformation_kernel;
-	cl::Kernel m_downsample_full_kernel;
-	cl::Kernel m_downsample_2v2_kernel;
-	cl::Kernel m_dct_quant;
-	cl::Kernel m_zero_out_right;
-	cl::Kernel m_zero_out_bottom;
-
-	/*
-	   Look up tables
-	   	with size of 3 * 3 * 256
-
-	   	the partial tables are in the following ranges
-	   	   0 <= x <  768: red
-		 768 <= x < 1536: green
-		1536 <= x < 2304: blue
-
-	 	each of the following tables consists of 256 elements,
-	 	where each element is a structure as the follows
-			struct {
-				unsigned int y;
-				unsigned int cr;
-				unsigned int cb;
-			};
-
-	   The values are stored as integers since they are shifted by 16
-	   to not lose precision. After summing up all the elements for
-	   a channel the result needs to be right-shifted again
-	   and then fits into a single unsigned char (1 Byte) value
-	*/
-	cl::Buffer md_color_conversion_table;
-
-	/* Divisor table for the quantification */
-	cl::Buffer md_fdct_divisors;
-	cl::Buffer md_fdct_multiplier;
-	cl::Buffer md_fdct_sign;
-	cl::Buffer md_fdct_indices;
-	cl::Buffer md_fdct_descaler;
-	cl::Buffer md_fdct_descaler_offset;
-
-
-	/**
-	 * Encode the given image
-	 *
-	 * @param image pointer to the image data in flat row major layout
-	 * @param width of the image
-	 * @param height of the image
-	 * @param file the output file to store the image at
-	 * @param cpu 0 iff cpu shall not be used to compare and validate
-	 * @return 0 on success
-	 */
-	int encode_image(unsigned char* image, size_t width, size_t height, const char * const file, int cpu);
-
-	/**
-	 * Prepare the device that runs the encoding process by uploading
-	 * the color conversion table and preparing dct, huffman, ...
-	 */
-	void prepare_device(void);
-
-
-	/**
-	 * Create the encoder
-	 *
-	 * @param quality the quality to use (clamped between 1 and 100)
-	 */
-	void create_encoder(unsigned char);
-
-	/**
-	 * Set the quality in the quantification tables
-	 *
-	 * @param quality quality the quality to use (clamped between 1 and 100)
-	 */
-	void set_quality_setting(unsigned char);
-
-	/**
-	 * Create the huffman tables for the given encoder
-	 */
-	void create_huffman_tables(void);
-
-	/**
-	 * Create the dct divisor tables
-	 */
-	void create_dct_division_tables(void);
-
-	/**
-	 * Create the derived huffman tables
-	 */
-	void create_derived_huffman_tables(void);
-
-	/**
-	 * Create the quantification tables for the encoder based on the given scale factor
-	 *
-	 * @param table_id the id of the quantification table in the encoder
-	 * @param scale the scale to use (quality setting)
-	 * @param base_table the base table to scale
-	 */
-	void create_quant_table(int, unsigned char, const unsigned int *);
-
-	/**
-	 * Add the huffman table to the encoder, count the number of bits
-	 * and copy the number of values accordingly to the huffman table
-	 *
-	 * @param tblptr huffman table to use
-	 * @param bits length
-	 * @param values the values
-	 */
-	void add_huffman_table(huffman_table_t *, const unsigned char *, const unsigned char *);
-
-	/**
-	 * Derive the huffman tables
-	 *
-	 * @param is_dc flag whether current table is dc or ac
-	 * @param table_idx table index to use
-	 * @param pointer to the derived huffman table to be filled
-	 */
-	void derive_huffman_table(unsigned char, huffman_table_t *, derived_huffman_table_t *);
-
-	/**
-	 * Encode the entropy of a single block
-	 *
-	 * @param block the block
-	 * @param table_index the table index for the huffman tables to use
-	 * @param last_dc_val the last dc value from the previous block
-	 * @param outputbuf the output buffer to use
-	 * @param state current bits to be exported from the entropy
-	 */
-	void encode_entropy_single_block(short *, int, int, std::vector<char>&, entropy_state_t&);
-
-	/**
-	 * Do a entropy encoding for a super block containing of four luminance blocks and
-	 * for the cb/cr one chrominance block each
-	 *
-	 * @param mcu_buffer pointer to the blocks
-	 * @param outputbuf the output buffer
-	 * @param state the entropy state
-	 */
-	void encode_entropy(short *mcu_buffer[0x6], std::vector<char>&, entropy_state_t&);
-
-	/**
-	 * Write the file header
-	 *
-	 * @param output_buf the output buffer to use
-	 */
-	void write_file_header(std::vector<char>&);
-
-	/**
-	 * Write the frame header containing the quantification tables used
-	 *
-	 * @param output_buf the output buffer
-	 * @param w the width of the image
-	 * @param h the height of the image
-	 */
-	void write_frame_header(std::vector<char>& output_buf, size_t w, size_t h);
-
-	/**
-	 * Export the quantification table
-	 *
-	 * @param output_buf the output buffer
-	 * @param index the index of the quantification table
-	 */
-	void write_quant_table(std::vector<char>& output_buf, int index);
-
-	/**
-	 * Export the huffman tables
-	 *
-	 * @param output_buf the output buffer
-	 * @param index the index of the quantification table
-	 * @param is_ac flag, true if ac table shall be exported, false if dc
-	 */
-	void write_huffman_table(std::vector<char>& output_buf, int index, unsigned char is_ac);
-
-	/**
-	 * Write the sos marker
-	 *
-	 * @param output_buf the output buffer to use
-	 */
-	void write_sos(std::vector<char>& output_buf);
-
-	/**
-	 * Write the scan header containing the huffman tables
-	 *
-	 * @param output_buf the output buffer to use
-	 */
-	void write_scan_header(std::vector<char>& output_buf);
-
-	/**
-	 * Write the SOF Part containing the sampling parameters and image size
-	 *
-	 * @param output_buf the output buffer to use
-	 * @param w image width
-	 * @param h image height
-	 */
-	void write_sof(std::vector<char>& outputbuf, size_t w, size_t h);
-
-public:
-
-	/**
-	 * Create a new encoder
-	 *
-	 * @param type the device type to use
-	 * @param quality the quality setting to use (clamped between 1 and 100)
-	 */
-	JPEGEncoder(cl_device_type type, unsigned char quality);
-
-	/**
-	 * Encode the given image
-	 *
-	 * @param image pointer to the image data in flat row major layout
-	 * @param width of the image
-	 * @param height of the image
-	 * @param file the output file to store the image at
-	 * @return 0 on success
-	 */
-	int encode_image(unsigned char* image, size_t width, size_t height, const char * const file);
-};
-}
-
-#endif
+#ifndef _JPEG_ENCODER_
+#define _JPEG_ENCODER_
+
+#include <CL/cl.hpp>
+#include <string>
+#include <fstream>
+#include <streambuf>
+#include <vector>
+#include <deque>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include "tables.h"
+#include "file_writer.hpp"
+
+namespace jpeg
+{
+
+struct derived_huffman_table
+{
+	unsigned int code[0x100];
+	unsigned char length[0x100];
+};
+typedef derived_huffman_table derived_huffman_table_t;
+
+struct huffman_table
+{
+	unsigned char bits[0x11];
+	unsigned char value[0x100];
+};
+typedef struct huffman_table huffman_table_t;
+
+struct entropy_state
+{
+	/* Bits not yet written, flushed in whole words, and the number of bits still free */
+	uint64_t buffer;
+	int free_bits;
+	int last_dc_val[0x3];
+
+	/* MCUs left in the current restart interval and number of the next restart marker */
+	unsigned int restarts_to_go;
+	int next_restart_num;
+
+	/* Flag whether 0xFF bytes are stuffed, false while chunks are coded or stitched and stuffed afterwards */
+	bool stuffing;
+};
+typedef struct entropy_state entropy_state_t;
+
+struct quantification_table
+{
+	unsigned char value[0x40];
+};
+typedef struct quantification_table quantification_table_t;
+
+/* Number of images that can be in flight at the same time */
+#define ENCODE_SLOTS 0x2
+
+/* Instruction sets the entropy coder can use, detected at runtime */
+#define ENTROPY_SCALAR 0x0
+#define ENTROPY_AVX2 0x1
+#define ENTROPY_AVX512 0x2
+
+/* Upper bound of the entropy coded bytes per super block: six blocks of at most 209 bytes,
+ * doubled for the byte stuffing, plus the flush and marker ending a restart interval */
+#define MCU_OUTPUT_BOUND (0x6 * 0xD1 * 0x2 + 0x4)
+
+/* Upper bound of the headers and the trailer */
+#define HEADER_OUTPUT_BOUND 0x400
+
+/* Number of MCU rows per chunk when an image is split across the devices */
+#define DEVICE_CHUNK_MCU_ROWS 0x8
+
+/* Least number of MCU rows a thread encoding on the host gets, fewer do not pay for starting it */
+#define HOST_THREAD_MCU_ROWS 0x4
+
+/* Options the kernels are built with */
+#define KERNEL_BUILD_OPTIONS ""
+
+/* Environment variable naming the directory compiled programs are cached in, an empty value disables the cache */
+#define PROGRAM_CACHE_ENV "JPEG_ENCODER_CACHE_DIR"
+#define PROGRAM_CACHE_MAGIC "JPEGCLB1"
+
+/* Side length of the square images the host and device path are timed with to place the threshold between them */
+#define CALIBRATION_SMALL_SIZE 0x20
+#define CALIBRATION_LARGE_SIZE 0x100
+
+struct output_arena
+{
+	/* Memory allocated for the output, only grows */
+	std::unique_ptr<char[]> data;
+	size_t capacity;
+
+	/* Next byte to write to */
+	char *next;
+};
+typedef struct output_arena output_arena_t;
+
+struct device_context;
+
+struct encode_buffers
+{
+	/* Device buffers for the RGB image and the coefficient planes */
+	cl::Buffer image;
+	cl::Buffer y_blocks;
+	cl::Buffer cb_blocks;
+	cl::Buffer cr_blocks;
+
+	/* Device buffer for the Y, Cb and Cr planes written by the separate color kernel */
+	cl::Buffer planes;
+
+	/* Number of pixels, super blocks and plane bytes the buffers can hold */
+	size_t pixels;
+	size_t super_blocks;
+	size_t plane_bytes;
+
+	/* Host copies of the coefficient planes and the output */
+	std::vector<short> y;
+	std::vector<short> cb;
+	std::vector<short> cr;
+	output_arena_t output;
+
+	/* Output of the chunks coded in parallel */
+	std::vector<output_arena_t> chunks;
+
+	/* Host view of the coefficient planes, either the vectors above or the mapped device buffers */
+	short *y_host;
+	short *cb_host;
+	short *cr_host;
+
+	/* Flag whether the host view is mapped and the device it is mapped from */
+	bool mapped;
+	struct device_context *device;
+
+	/* Flag whether the dc values of the blocks below the image are set, the fused kernel does so on its own */
+	bool bottom_fixed;
+
+	/* Flag whether an image in flight uses the buffers */
+	bool busy;
+};
+typedef struct encode_buffers encode_buffers_t;
+
+struct device_context
+{
+	/* OpenCL device, its command queue and the program built for it */
+	cl::Device device;
+	cl::CommandQueue queue;
+	cl::Program program;
+
+	/* Kernels, their arguments are shared so they are enqueued holding the lock */
+	cl::Kernel transformation_kernel;
+	cl::Kernel downsample_full_kernel;
+	cl::Kernel downsample_2v2_kernel;
+	cl::Kernel dct_quant;
+	cl::Kernel zero_out_right;
+	cl::Kernel zero_out_bottom;
+	cl::Kernel color_dct_quant;
+	cl::Kernel dct_quant_subgroup;
+	std::mutex lock;
+
+	/*
+	   Look up tables
+	   	with size of 3 * 3 * 256
+
+	   	the partial tables are in the following ranges
+	   	   0 <= x <  768: red
+		 768 <= x < 1536: green
+		1536 <= x < 2304: blue
+
+	 	each of the following tables consists of 256 elements,
+	 	where each element is a structure as the follows
+			struct {
+				unsigned int y;
+				unsigned int cr;
+				unsigned int cb;
+			};
+
+	   The values are stored as integers since they are shifted by 16
+	   to not lose precision. After summing up all the elements for
+	   a channel the result needs to be right-shifted again
+	   and then fits into a single unsigned char (1 Byte) value
+	*/
+	cl::Buffer color_conversion_table;
+
+	/* Divisor table for the quantification */
+	cl::Buffer fdct_divisors;
+	cl::Buffer fdct_multiplier;
+	cl::Buffer fdct_sign;
+	cl::Buffer fdct_indices;
+	cl::Buffer fdct_descaler;
+	cl::Buffer fdct_descaler_offset;
+
+	/* Flag whether the fused kernel is run on the device, not used together with the sub-group DCT */
+	bool use_fused_kernel;
+
+	/* Flag whether the separate kernels use the sub-group shuffles for the DCT */
+	bool use_subgroup_dct;
+
+	/* Flag whether the device shares the memory with the host, buffers are mapped instead of copied then */
+	bool zero_copy;
+
+	/* Alignment in bytes host pointers need to be used by the device without a copy */
+	size_t host_ptr_alignment;
+
+	/* Double buffered chunks of the images split across the devices, per image in flight */
+	encode_buffers_t chunks[ENCODE_SLOTS][0x2];
+};
+typedef struct device_context device_context_t;
+
+struct chunk_range
+{
+	/* Chunks not yet taken, the owning device takes them from the front, the others steal from the back */
+	size_t next;
+	size_t end;
+};
+typedef struct chunk_range chunk_range_t;
+
+struct chunk_schedule
+{
+	std::mutex lock;
+	std::vector<chunk_range_t> ranges;
+};
+typedef struct chunk_schedule chunk_schedule_t;
+
+/* Receives the output in chunks, returning non-zero aborts the encoding */
+typedef std::function<int(const char *data, size_t size)> output_sink_t;
+
+struct encode_target
+{
+	/* File to write to, NULL when writing to memory */
+	FILE *fp;
+
+	/* Caller provided buffer and its capacity */
+	char *buffer;
+	size_t capacity;
+
+	/* Vector resized to the image instead of the buffer, if not NULL */
+	std::vector<char> *owned;
+
+	/* Receives the size of the image, if not NULL */
+	size_t *size;
+
+	/* Receives the output as it is produced instead, if not empty */
+	output_sink_t sink;
+
+	/* File opened through the writer, closed once the image is passed on, if not NULL */
+	FileWriter *writer;
+	writer_file_t *wfile;
+
+	/* Flag whether the coefficients of the device are compared with those of the host */
+	bool validate;
+};
+typedef struct encode_target encode_target_t;
+
+struct encode_stream
+{
+	/* Flag whether an image is started and the file it is written to, opened
+	 * through the file writer if one is set */
+	bool started;
+	encode_target_t target;
+
+	/* First error writing the file, 0 if none */
+	int error;
+
+	/* Image size and the number of rows per strip */
+	size_t width;
+	size_t height;
+	size_t strip_height;
+
+	/* Rows received in total and in the strip currently filled */
+	size_t rows;
+	size_t strip_rows;
+
+	/* Double buffered strips, one is filled while the other one is processed */
+	encode_buffers_t buffers[0x2];
+	std::vector<unsigned char> staging[0x2];
+	size_t slot;
+
+	/* Strip enqueued to the device but not yet entropy coded */
+	bool pending;
+	size_t pending_height;
+	cl::Event pending_done;
+
+	/* Entropy state carried across the strips and output not yet written */
+	entropy_state_t state;
+	output_arena_t output;
+};
+typedef struct encode_stream encode_stream_t;
+
+
+
+class JPEGEncoder
+{
+private:
+	/* Quantification Table, one for luminance, one for chrominance */
+	quantification_table_t m_quant_tbls[0x2];
+
+	/* Division Lookup table for DCT, one for luminance, one for chrominance */
+	short m_fdct_divisors[0x2][0x100];
+
+	/* entropy encoding */
+	derived_huffman_table_t m_dc_derived_tbls[0x2];
+	derived_huffman_table_t m_ac_derived_tbls[0x2];
+	huffman_table_t m_dc_huff_tbls[0x2];
+	huffman_table_t m_ac_huff_tbls[0x2];
+
+	/* OpenCL Context used in this class */
+	cl::Context m_context;
+
+	/* Devices of the context the kernels could be built for, the first one encodes
+	 * the images on its own, large images are split across all of them */
+	std::deque<device_context_t> m_devices;
+
+	/* Flag whether large images are split across the devices */
+	bool m_multi_device;
+
+	/* Images with fewer pixels are encoded on the host, the device's fixed cost outweighs its speed for them */
+	size_t m_host_threshold;
+
+	/* Measured fixed and per pixel time of the device and per pixel time of a single host thread,
+	 * the threshold follows from them for the number of host threads unless it was overridden */
+	double m_calibration[0x3];
+	bool m_host_threshold_measured;
+
+	/* Number of threads used to encode on the host */
+	unsigned int m_host_threads;
+
+	/* Flag whether the host backend uses AVX2, detected at runtime */
+	bool m_host_avx2;
+
+	/* Number of MCUs per restart interval, 0 if disabled */
+	unsigned int m_restart_interval;
+
+	/* Number of threads used for the entropy coding */
+	unsigned int m_entropy_threads;
+
+	/* Instruction set used to entropy code the blocks */
+	unsigned char m_entropy_isa;
+
+	/* Writer for the output files, NULL to write them with fwrite */
+	FileWriter *m_file_writer;
+
+	/* Buffers kept across the calls to encode_image, one set per image in flight */
+	encode_buffers_t m_buffers[ENCODE_SLOTS];
+
+	/* The slot to be used by the next image */
+	size_t m_next_slot;
+
+	/* Thread doing the entropy coding of the image in each slot, joined before the slot is reused */
+	std::thread m_workers[ENCODE_SLOTS];
+
+	/* Lock for the slots and the kernel arguments, signaled when a slot gets released */
+	std::mutex m_lock;
+	std::condition_variable m_slot_released;
+
+	/* Image passed in row by row */
+	encode_stream_t m_stream;
+
+
+	/**
+	 * Make sure the given buffers can hold an image of the given size.
+	 * The buffers are only replaced if they are too small.
+	 *
+	 * @param device the device the buffers are used on
+	 * @param buffers the buffers to grow
+	 * @param width of the image
+	 * @param height of the image
+	 */
+	void allocate_buffers(device_context_t& device, encode_buffers_t& buffers, size_t width, size_t height);
+
+	/**
+	 * Make sure the host planes of the given buffers can hold the coefficients of an
+	 * image of the given size, used to merge the chunks processed by the devices
+	 *
+	 * @param buffers the buffers to grow
+	 * @param width of the image
+	 * @param height of the image
+	 */
+	void allocate_host_buffers(encode_buffers_t& buffers, size_t width, size_t height);
+
+	/**
+	 * Enqueue uploading the image, the kernels and reading back the coefficients.
+	 * Nothing is waited for.
+	 *
+	 * @param device the device to run on
+	 * @param buffers the buffers to use, large enough for the image
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param done event set when the coefficients are on the host
+	 */
+	void enqueue_image(device_context_t& device, encode_buffers_t& buffers, unsigned char* image, size_t width, size_t height, cl::Event& done);
+
+	/**
+	 * Process the given image in chunks of MCU rows on all devices and merge the
+	 * coefficients into the host planes of the given buffers. Each device starts on
+	 * an even share of the chunks and steals from the others once it is done.
+	 *
+	 * @param buffers the buffers of the image, the host planes need to fit the image
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 */
+	void encode_on_devices(encode_buffers_t& buffers, unsigned char* image, size_t width, size_t height);
+
+	/**
+	 * Process chunks on the given device until none are left, the next chunk is
+	 * enqueued before the previous one is merged
+	 *
+	 * @param index the index of the device
+	 * @param schedule the chunks left per device
+	 * @param buffers the buffers of the image
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 */
+	void encode_chunks(size_t index, chunk_schedule_t& schedule, encode_buffers_t& buffers, unsigned char* image, size_t width, size_t height);
+
+	/**
+	 * Encode the given image on the host instead of the device. The coefficients are
+	 * written to the host planes in the same super block layout the kernels use,
+	 * including the blocks exceeding the image. The rows of super blocks are split
+	 * across the host threads.
+	 *
+	 * @param buffers the buffers, the host planes need to fit the image
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 */
+	void encode_on_host(encode_buffers_t& buffers, const unsigned char* image, size_t width, size_t height);
+
+	/**
+	 * Perform color space transformation, downsampling, DCT and quantification for
+	 * the given rows of super blocks on the host, mirroring the fused kernel
+	 *
+	 * @param buffers the buffers, the host planes need to fit the image
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param first the first row of super blocks
+	 * @param last the row of super blocks after the last one to process
+	 */
+	void transform_rows(encode_buffers_t& buffers, const unsigned char* image, size_t width, size_t height, size_t first, size_t last);
+
+	/**
+	 * Convert a super block into YCbCr and downsample it, with AVX2 if available
+	 *
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param super_block_x the x position of the super block
+	 * @param super_block_y the y position of the super block
+	 * @param y receives the four level shifted luminance blocks
+	 * @param cb receives the level shifted cb block
+	 * @param cr receives the level shifted cr block
+	 */
+	void convert_super_block(const unsigned char* image, size_t width, size_t height, size_t super_block_x, size_t super_block_y,
+							 short* y, short* cb, short* cr);
+
+	/**
+	 * Split the given rows of super blocks into contiguous shares, one per host thread,
+	 * and process them in parallel. Threads get at least HOST_THREAD_MCU_ROWS rows.
+	 *
+	 * @param rows the number of rows of super blocks
+	 * @param work processes the rows from its first argument up to the second one
+	 */
+	void run_host_threads(size_t rows, const std::function<void(size_t, size_t)>& work);
+
+	/**
+	 * Time the host and the device path on a small and a large image and compute the
+	 * number of pixels up to which the host is faster. The times are cached on disk
+	 * next to the compiled program, keyed by the device and the host CPU.
+	 *
+	 * @return the number of pixels below which images are encoded on the host
+	 */
+	size_t calibrate_host_threshold(void);
+
+	/**
+	 * Compute the threshold from the measured times for the number of host threads,
+	 * assuming the host scales linearly up to one thread per hardware thread
+	 *
+	 * @return the number of pixels below which images are encoded on the host
+	 */
+	size_t measured_host_threshold(void) const;
+
+	/**
+	 * Compare the coefficients of the device in the given buffers with those
+	 * computed on the host and report the first mismatching super block
+	 *
+	 * @param buffers the buffers holding the coefficients of the device
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @return the number of mismatching super blocks
+	 */
+	size_t validate_coefficients(encode_buffers_t& buffers, const unsigned char* image, size_t width, size_t height);
+
+	/**
+	 * Hand the coefficient planes back to the device after the entropy coding,
+	 * only needed if they are mapped
+	 *
+	 * @param buffers the buffers holding the coefficients
+	 */
+	void release_coefficients(encode_buffers_t& buffers);
+
+	/**
+	 * Enqueue the device part of encoding the given image and start the entropy coding
+	 * on its own thread once the coefficients are read back
+	 *
+	 * @param image pointer to the image data in flat row major layout, needs to stay valid until the future is ready
+	 * @param width of the image
+	 * @param height of the image
+	 * @param target where to write the image to
+	 * @return future holding 0 on success
+	 */
+	std::future<int> enqueue_encode(unsigned char* image, size_t width, size_t height, encode_target_t target);
+
+	/**
+	 * Open the given file as the target of an image, files opened through the file
+	 * writer are passed on as they are produced
+	 *
+	 * @param file the output file
+	 * @param target the target receiving the file
+	 * @return 0 on success, 1 if the file could not be opened
+	 */
+	int open_file_target(const char * const file, encode_target_t& target);
+
+	/**
+	 * Entropy code the coefficients in the host buffers and write the
+	 * image to the target. A target file is closed afterwards.
+	 *
+	 * @param buffers the buffers holding the coefficients
+	 * @param width of the image
+	 * @param height of the image
+	 * @param target where to write the image to
+	 * @return 0 on success, 5 if the target buffer is too small
+	 */
+	int write_image(encode_buffers_t& buffers, size_t width, size_t height, const encode_target_t& target);
+
+	/**
+	 * Entropy code all super blocks in the host buffers
+	 *
+	 * @param buffers the buffers holding the coefficients
+	 * @param width of the image (or strip)
+	 * @param height of the image (or strip)
+	 * @param output_buffer the output buffer
+	 * @param state the entropy state, carried on from previous strips
+	 */
+	void encode_coefficients(encode_buffers_t& buffers, size_t width, size_t height, output_arena_t& output_buffer, entropy_state_t& state);
+
+	/**
+	 * Set the dc values of the blocks below the image, which are zeroed by the separate kernels
+	 *
+	 * @param buffers the buffers holding the coefficients
+	 * @param width of the image (or strip)
+	 * @param height of the image (or strip)
+	 */
+	void fix_bottom_blocks(encode_buffers_t& buffers, size_t width, size_t height);
+
+	/**
+	 * Entropy code the given range of super blocks, emitting restart markers if enabled
+	 *
+	 * @param buffers the buffers holding the coefficients
+	 * @param first the first super block
+	 * @param last the super block after the last one to code
+	 * @param output_buffer the output buffer
+	 * @param state the entropy state
+	 */
+	void encode_mcus(encode_buffers_t& buffers, size_t first, size_t last, output_arena_t& output_buffer, entropy_state_t& state);
+
+	/**
+	 * Code the given number of chunks on multiple threads and pass them on in order.
+	 * The calling thread codes chunks as well and passes on each chunk as soon as it
+	 * and all chunks before it are coded. Once passing a chunk on fails no further
+	 * chunks are coded.
+	 *
+	 * @param chunks the number of chunks
+	 * @param threads the number of threads, including the calling one
+	 * @param code codes the chunk of the given index
+	 * @param pass passes on the chunk of the given index, returning non-zero on failure
+	 * @return 0 on success, the result of pass otherwise
+	 */
+	int code_chunks(size_t chunks, size_t threads, const std::function<void(size_t)>& code, const std::function<int(size_t)>& pass);
+
+	/**
+	 * Entropy code the super blocks with restart markers enabled, the restart intervals
+	 * are independent and are therefore distributed over multiple threads. Each thread
+	 * codes consecutive intervals into a buffer of its own, which are concatenated in
+	 * order as they are done, so the output does not depend on the number of threads.
+	 *
+	 * @param buffers the buffers holding the coefficients
+	 * @param width of the image
+	 * @param height of the image
+	 * @param output_buffer the output buffer
+	 * @param sink receives the output after each chunk of intervals, if not empty
+	 * @return 0 on success, 6 if the sink aborted the encoding
+	 */
+	int encode_restart_intervals(encode_buffers_t& buffers, size_t width, size_t height, output_arena_t& output_buffer, const output_sink_t& sink);
+
+	/**
+	 * Entropy code the super blocks on multiple threads without restart markers.
+	 * The super blocks are split into chunks, each starting with the dc values of the
+	 * super block before it. The chunks are coded into separate buffers without byte
+	 * stuffing, shifted into place in the output and stuffed as they are done.
+	 * The output is identical to coding all super blocks on a single thread.
+	 *
+	 * @param buffers the buffers holding the coefficients
+	 * @param width of the image
+	 * @param height of the image
+	 * @param output_buffer the output buffer
+	 * @param state the entropy state, the remaining bits are left in it
+	 * @param sink receives the output after each chunk, if not empty
+	 * @return 0 on success, 6 if the sink aborted the encoding
+	 */
+	int encode_stitched(encode_buffers_t& buffers, size_t width, size_t height, output_arena_t& output_buffer, entropy_state_t& state,
+						const output_sink_t& sink);
+
+	/**
+	 * Terminate the current restart interval, write the restart marker
+	 * and reset the dc prediction
+	 *
+	 * @param output_buffer the output buffer
+	 * @param state the entropy state
+	 */
+	void emit_restart(output_arena_t& output_buffer, entropy_state_t& state);
+
+	/**
+	 * Reset the entropy state to the beginning of the scan
+	 *
+	 * @param state the entropy state
+	 */
+	void reset_entropy_state(entropy_state_t& state);
+
+	/**
+	 * Flush the bits remaining in the entropy state, filling up the last byte with ones
+	 *
+	 * @param output_buffer the output buffer
+	 * @param state the entropy state
+	 */
+	void flush_entropy(output_arena_t& output_buffer, entropy_state_t& state);
+
+	/**
+	 * Enqueue the strip currently filled to the device and entropy code the previous
+	 * strip while the device works on this one. The output is written to the file
+	 * after each strip.
+	 *
+	 * @param stream the stream the strip belongs to
+	 */
+	void submit_strip(encode_stream_t& stream);
+
+	/**
+	 * Pass the output of the stream produced so far on to its file. After a write
+	 * failed nothing is written anymore.
+	 *
+	 * @param stream the stream
+	 * @return 0 on success, 6 if writing the file failed now or before
+	 */
+	int write_stream_output(encode_stream_t& stream);
+
+	/**
+	 * Close the file of the stream, a file of the file writer is closed once
+	 * its blocks are written, FileWriter::wait reports whether that succeeded
+	 *
+	 * @param stream the stream
+	 * @return 0 on success, 6 if writing the file failed
+	 */
+	int close_stream(encode_stream_t& stream);
+
+	/**
+	 * Prepare the given device to run the encoding process by uploading
+	 * the color conversion table and preparing dct, huffman, ...
+	 *
+	 * @param device the device, its program needs to be built
+	 * @return true if all kernels could be created
+	 */
+	bool prepare_device(device_context_t& device);
+
+	/**
+	 * Enqueue the fused kernel performing color space transformation, downsampling,
+	 * DCT and quantification with a single pass over the image
+	 *
+	 * @param device the device to run on
+	 * @param image_buffer the device buffer containing the RGB image
+	 * @param y_block_buffer the device buffer the luminance super blocks are stored at
+	 * @param cb_block_buffer the device buffer the cb blocks are stored at
+	 * @param cr_block_buffer the device buffer the cr blocks are stored at
+	 * @param width of the image
+	 * @param height of the image
+	 */
+	void enqueue_fused_kernel(device_context_t& device, cl::Buffer& image_buffer, cl::Buffer& y_block_buffer, cl::Buffer& cb_block_buffer,
+							  cl::Buffer& cr_block_buffer, size_t width, size_t height);
+
+	/**
+	 * Enqueue the separate kernels for color space transformation, downsampling,
+	 * DCT and quantification. The YCbCr image is stored as separate planes in between.
+	 *
+	 * @param device the device to run on
+	 * @param image_buffer the device buffer containing the RGB image
+	 * @param plane_buffer the device buffer the Y, Cb and Cr planes are stored at
+	 * @param y_block_buffer the device buffer the luminance super blocks are stored at
+	 * @param cb_block_buffer the device buffer the cb blocks are stored at
+	 * @param cr_block_buffer the device buffer the cr blocks are stored at
+	 * @param width of the image
+	 * @param height of the image
+	 */
+	void enqueue_separate_kernels(device_context_t& device, cl::Buffer& image_buffer, cl::Buffer& plane_buffer, cl::Buffer& y_block_buffer,
+								  cl::Buffer& cb_block_buffer, cl::Buffer& cr_block_buffer, size_t width, size_t height);
+
+	/**
+	 * Enqueue the DCT and quantification of the blocks of one plane, using the sub-group
+	 * variant of the kernel if the device supports it
+	 *
+	 * @param device the device to run on
+	 * @param block_buffer the device buffer containing the blocks
+	 * @param divisor_offset the offset of the divisors of the plane
+	 * @param coefficients the number of coefficients in the buffer
+	 */
+	void enqueue_dct_quant(device_context_t& device, cl::Buffer& block_buffer, cl_uint divisor_offset, size_t coefficients);
+
+
+	/**
+	 * Create the encoder
+	 *
+	 * @param quality the quality to use (clamped between 1 and 100)
+	 */
+	void create_encoder(unsigned char);
+
+	/**
+	 * Set the quality in the quantification tables
+	 *
+	 * @param quality quality the quality to use (clamped between 1 and 100)
+	 */
+	void set_quality_setting(unsigned char);
+
+	/**
+	 * Create the huffman tables for the given encoder
+	 */
+	void create_huffman_tables(void);
+
+	/**
+	 * Create the dct divisor tables
+	 */
+	void create_dct_division_tables(void);
+
+	/**
+	 * Create the derived huffman tables
+	 */
+	void create_derived_huffman_tables(void);
+
+	/**
+	 * Create the quantification tables for the encoder based on the given scale factor
+	 *
+	 * @param table_id the id of the quantification table in the encoder
+	 * @param scale the scale to use (quality setting)
+	 * @param base_table the base table to scale
+	 */
+	void create_quant_table(int, unsigned char, const unsigned int *);
+
+	/**
+	 * Add the huffman table to the encoder, count the number of bits
+	 * and copy the number of values accordingly to the huffman table
+	 *
+	 * @param tblptr huffman table to use
+	 * @param bits length
+	 * @param values the values
+	 */
+	void add_huffman_table(huffman_table_t *, const unsigned char *, const unsigned char *);
+
+	/**
+	 * Derive the huffman tables
+	 *
+	 * @param is_dc flag whether current table is dc or ac
+	 * @param table_idx table index to use
+	 * @param pointer to the derived huffman table to be filled
+	 */
+	void derive_huffman_table(unsigned char, huffman_table_t *, derived_huffman_table_t *);
+
+	/**
+	 * Encode the entropy of a single block
+	 *
+	 * @param block the block
+	 * @param table_index the table index for the huffman tables to use
+	 * @param last_dc_val the last dc value from the previous block
+	 * @param outputbuf the output buffer to use
+	 * @param state current bits to be exported from the entropy
+	 */
+	void encode_entropy_single_block(short *, int, int, output_arena_t&, entropy_state_t&);
+
+	/**
+	 * Do a entropy encoding for a super block containing of four luminance blocks and
+	 * for the cb/cr one chrominance block each
+	 *
+	 * @param mcu_buffer pointer to the blocks
+	 * @param outputbuf the output buffer
+	 * @param state the entropy state
+	 */
+	void encode_entropy(short *mcu_buffer[0x6], output_arena_t&, entropy_state_t&);
+
+	/**
+	 * Write the file header
+	 *
+	 * @param output_buf the output buffer to use
+	 */
+	void write_file_header(output_arena_t&);
+
+	/**
+	 * Write the frame header containing the quantification tables used
+	 *
+	 * @param output_buf the output buffer
+	 * @param w the width of the image
+	 * @param h the height of the image
+	 */
+	void write_frame_header(output_arena_t& output_buf, size_t w, size_t h);
+
+	/**
+	 * Export the quantification table
+	 *
+	 * @param output_buf the output buffer
+	 * @param index the index of the quantification table
+	 */
+	void write_quant_table(output_arena_t& output_buf, int index);
+
+	/**
+	 * Export the huffman tables
+	 *
+	 * @param output_buf the output buffer
+	 * @param index the index of the quantification table
+	 * @param is_ac flag, true if ac table shall be exported, false if dc
+	 */
+	void write_huffman_table(output_arena_t& output_buf, int index, unsigned char is_ac);
+
+	/**
+	 * Write the sos marker
+	 *
+	 * @param output_buf the output buffer to use
+	 */
+	void write_sos(output_arena_t& output_buf);
+
+	/**
+	 * Write the scan header containing the huffman tables
+	 *
+	 * @param output_buf the output buffer to use
+	 */
+	void write_scan_header(output_arena_t& output_buf);
+
+	/**
+	 * Write the dri marker defining the restart interval
+	 *
+	 * @param output_buf the output buffer to use
+	 */
+	void write_dri(output_arena_t& output_buf);
+
+	/**
+	 * Write the SOF Part containing the sampling parameters and image size
+	 *
+	 * @param output_buf the output buffer to use
+	 * @param w image width
+	 * @param h image height
+	 */
+	void write_sof(output_arena_t& outputbuf, size_t w, size_t h);
+
+public:
+
+	/**
+	 * Create a new encoder, the kernels are built for all devices of the given type
+	 *
+	 * @param type the device type to use
+	 * @param quality the quality setting to use (clamped between 1 and 100)
+	 */
+	JPEGEncoder(cl_device_type type, unsigned char quality);
+
+	/**
+	 * Wait for all images in flight before releasing the buffers
+	 */
+	~JPEGEncoder();
+
+	/**
+	 * Encode the given image
+	 *
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param file the output file to store the image at
+	 * @return 0 on success
+	 */
+	int encode_image(unsigned char* image, size_t width, size_t height, const char * const file);
+
+	/**
+	 * Encode the given image on the device and, unless cpu is 0, compare the coefficients
+	 * with those computed on the host before writing it. Without a device it is encoded
+	 * on the host and there is nothing to compare with.
+	 *
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param file the output file to store the image at
+	 * @param cpu 0 iff cpu shall not be used to compare and validate
+	 * @return 0 on success, 7 if the coefficients differ
+	 */
+	int encode_image(unsigned char* image, size_t width, size_t height, const char * const file, int cpu);
+
+	/**
+	 * Encode the given image into the given buffer. Passing no buffer with a capacity
+	 * of 0 only determines the size.
+	 *
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param output the buffer to store the image at
+	 * @param capacity the size of the buffer in bytes
+	 * @param size receives the size of the image in bytes, also if the buffer is too small, may be NULL
+	 * @return 0 on success, 5 if the buffer is too small
+	 */
+	int encode_image(unsigned char* image, size_t width, size_t height, char *output, size_t capacity, size_t *size);
+
+	/**
+	 * Encode the given image into the given vector, which is resized to the size of the image
+	 *
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param output the vector to store the image in
+	 * @return 0 on success
+	 */
+	int encode_image(unsigned char* image, size_t width, size_t height, std::vector<char>& output);
+
+	/**
+	 * Encode the given image and pass the output to the sink as it is produced. The headers
+	 * are passed at once, the entropy coded data after each row of super blocks, so only a
+	 * single row of output is held. With multiple entropy threads the data is passed after
+	 * each chunk coded in parallel, in order as the chunks are done. The chunks coded ahead
+	 * are held until they are passed on, which can add up to the coded size of the image.
+	 *
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param sink receives the output, called on the thread doing the entropy coding
+	 * @return 0 on success, 6 if the sink aborted the encoding
+	 */
+	int encode_image(unsigned char* image, size_t width, size_t height, const output_sink_t& sink);
+
+	/**
+	 * Get the largest size an image of the given size can be encoded to,
+	 * a buffer of this size is never too small
+	 *
+	 * @param width of the image
+	 * @param height of the image
+	 * @return the size in bytes
+	 */
+	static size_t output_bound(size_t width, size_t height);
+
+	/**
+	 * Start encoding the given image. Uploading and running the kernels is enqueued
+	 * to the device, the entropy coding runs on its own thread as soon as the
+	 * coefficients are read back. Up to ENCODE_SLOTS images are in flight, further
+	 * calls block until the oldest image is done. The returned future does not block
+	 * when it is destroyed, the encoder waits for all images to be done on destruction.
+	 *
+	 * @param image pointer to the image data in flat row major layout, needs to stay valid until the future is ready
+	 * @param width of the image
+	 * @param height of the image
+	 * @param file the output file to store the image at
+	 * @return future holding 0 on success
+	 */
+	std::future<int> encode_async(unsigned char* image, size_t width, size_t height, const char * const file);
+
+	/**
+	 * Start encoding the given image, the output is passed to the sink as it is produced.
+	 * See encode_image and encode_async.
+	 *
+	 * @param image pointer to the image data in flat row major layout, needs to stay valid until the future is ready
+	 * @param width of the image
+	 * @param height of the image
+	 * @param sink receives the output, called on the thread doing the entropy coding
+	 * @return future holding 0 on success, 6 if the sink aborted the encoding
+	 */
+	std::future<int> encode_async(unsigned char* image, size_t width, size_t height, const output_sink_t& sink);
+
+	/**
+	 * Write the files through the given writer instead of a blocking fwrite. The output
+	 * is passed to the writer as it is produced and the next image is encoded while the
+	 * writes complete, FileWriter::wait tells whether all of them succeeded. Passing NULL
+	 * switches back to fwrite. Must not be changed while images are in flight.
+	 *
+	 * @param writer the writer, needs to outlive the images written through it
+	 */
+	void set_file_writer(FileWriter *writer);
+
+	/**
+	 * Allocate the device and host buffers for images up to the given size in advance,
+	 * encoding images that fit into them does not allocate any memory. The buffers
+	 * only grow, they are never shrunk.
+	 *
+	 * @param max_width the largest width expected
+	 * @param max_height the largest height expected
+	 */
+	void reserve(size_t max_width, size_t max_height);
+
+	/**
+	 * Set the number of MCUs between two restart markers, must not be
+	 * changed while images are in flight
+	 *
+	 * @param mcus the restart interval, 0 to disable restart markers (clamped to 65535)
+	 */
+	void set_restart_interval(unsigned int mcus);
+
+	/**
+	 * Set the number of threads used for the entropy coding, must not be
+	 * changed while images are in flight. With restart markers the restart
+	 * intervals are coded in parallel, without the output of the threads
+	 * is stitched together bitwise
+	 *
+	 * @param threads the number of threads, 0 to use one per hardware thread
+	 */
+	void set_entropy_threads(unsigned int threads);
+
+	/**
+	 * Set whether images taller than a chunk of DEVICE_CHUNK_MCU_ROWS are split across
+	 * all devices, enabled by default. The chunks are scheduled with work stealing,
+	 * so faster devices process more of them. Must not be changed while images are in flight.
+	 *
+	 * @param enabled flag whether to use all devices
+	 */
+	void set_multi_device(bool enabled);
+
+	/**
+	 * Get the number of devices the kernels were built for
+	 *
+	 * @return the number of devices
+	 */
+	size_t device_count(void) const;
+
+	/**
+	 * Set the number of pixels below which images are encoded on the host instead of
+	 * the device. It is measured when the encoder is created, this overrides it.
+	 * Must not be changed while images are in flight.
+	 *
+	 * @param pixels the threshold, 0 to always use the device
+	 */
+	void set_host_threshold(size_t pixels);
+
+	/**
+	 * Get the number of pixels below which images are encoded on the host
+	 *
+	 * @return the threshold
+	 */
+	size_t host_threshold(void) const;
+
+	/**
+	 * Set the number of threads encoding an image on the host, each one takes a share
+	 * of the rows of MCUs. A measured threshold is scaled to the number of threads,
+	 * one set with set_host_threshold is kept. Must not be changed while images are in flight.
+	 *
+	 * @param threads the number of threads, 0 to use one per hardware thread
+	 */
+	void set_host_threads(unsigned int threads);
+
+	/**
+	 * Perform the color space transformation and the downsampling of the given image on the host.
+	 * The planes receive the level shifted samples in the super block layout the downsample
+	 * kernels produce. The rows of super blocks are split across the host threads.
+	 *
+	 * @param image pointer to the image data in flat row major layout
+	 * @param width of the image
+	 * @param height of the image
+	 * @param y the luminance plane, 256 samples per super block
+	 * @param cb the cb plane, 64 samples per super block
+	 * @param cr the cr plane, 64 samples per super block
+	 */
+	void color_transform(const unsigned char* image, size_t width, size_t height, short* y, short* cb, short* cr);
+
+	/**
+	 * Start encoding an image that is passed in row by row. The rows are collected
+	 * in strips of the given number of MCU rows, which are processed on the device
+	 * and entropy coded while the next strip is filled. Two strips are kept on the
+	 * device and on the host, independent of the image height. The file is written
+	 * through the file writer if one is set.
+	 *
+	 * @param width of the image
+	 * @param height of the image
+	 * @param file the output file to store the image at
+	 * @param strip_mcu_rows number of MCU rows (16 pixel rows) per strip, 0 to derive it from the device limits
+	 * @return 0 on success
+	 */
+	int start_stream(size_t width, size_t height, const char * const file, size_t strip_mcu_rows = 0);
+
+	/**
+	 * Pass the next rows of the image started with start_stream
+	 *
+	 * @param rows pointer to the RGB rows in flat row major layout, can be reused after returning
+	 * @param count the number of rows
+	 * @return 0 on success, 6 if writing the file failed
+	 */
+	int write_scanlines(const unsigned char* rows, size_t count);
+
+	/**
+	 * Finish the image started with start_stream, all rows need to be passed before.
+	 * The file is closed in any case.
+	 *
+	 * @return 0 on success, 6 if writing the file failed
+	 */
+	int finish_stream(void);
+};
+}
+
+#endif
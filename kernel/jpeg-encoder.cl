@@ -2,45 +2,74 @@
 #define GREEN_OFFSET 0x300
 #define BLUE_OFFSET 0x600
 
-__kernel void color_space_transform(__global unsigned int *color_conversion_table,
-									__global unsigned char *image, unsigned int sz)
+/* The color conversion table is linear in each channel, its sums are computed directly
+ * with these fixed point multiply-adds, which give identical results */
+#define Y_FIXED(r, g, b) ((19595 * (r) + 38470 * (g) + 7471 * (b) + 0x8000) >> 0x10)
+#define CB_FIXED(r, g, b) ((-11059 * (r) - 21709 * (g) + 32768 * (b) + 0x807FFF) >> 0x10)
+#define CR_FIXED(r, g, b) ((32768 * (r) - 27439 * (g) - 5329 * (b) + 0x807FFF) >> 0x10)
+
+/**
+ * Convert four pixels per work item into YCbCr without the color conversion table and
+ * store them as separate Y, Cb and Cr planes of pitch bytes per row, plane_size bytes apart.
+ * The planes are padded to multiples of 16 rows and columns by repeating the last row and
+ * column of the image, so the downsampling kernels need no clamping.
+ */
+__kernel void color_space_transform_planar(__global unsigned char *image, __global unsigned char *planes,
+										   unsigned int width, unsigned int height,
+										   unsigned int pitch, unsigned int plane_size)
 {
 	size_t gx = get_global_id(0);
 
-	/* only execute inside of the image range */
-	if(gx < sz)
+	/* groups of four pixels per padded row */
+	size_t groups = ((width + 0xF) >> 0x4) << 0x2;
+	size_t plane_x = (gx % groups) << 0x2;
+	size_t plane_y = gx / groups;
+
+	/* only execute inside of the padded planes */
+	if(plane_y < (((height + 0xF) >> 0x4) << 0x4))
 	{
-		gx *= 3;
+		/* Clamp */
+		size_t image_y = plane_y < height ? plane_y : height - 1;
+		__global unsigned char *row = image + image_y * width * 3;
 
 		/* read RGB values */
-		unsigned char r = image[gx + 0];
-		unsigned char g = image[gx + 1];
-		unsigned char b = image[gx + 2];
-
-		/* convert them into yCbCr */
-		unsigned int ry = color_conversion_table[0 + r * 3 + 0];
-		unsigned int rcr = color_conversion_table[0 + r * 3 + 1];
-		unsigned int rcb = color_conversion_table[0 + r * 3 + 2];
-
-		unsigned int gy = color_conversion_table[GREEN_OFFSET + g * 3 + 0];
-		unsigned int gcr = color_conversion_table[GREEN_OFFSET + g * 3 + 1];
-		unsigned int gcb = color_conversion_table[GREEN_OFFSET + g * 3 + 2];
-
-		unsigned int by = color_conversion_table[BLUE_OFFSET + b * 3 + 0];
-		unsigned int bcr = color_conversion_table[BLUE_OFFSET + b * 3 + 1];
-		unsigned int bcb = color_conversion_table[BLUE_OFFSET + b * 3 + 2];
-
-		/* store them back */
-		image[gx + 0] = ((unsigned char)((ry + gy + by) >> 0x10));
-		image[gx + 1] = ((unsigned char)((rcb + gcb + bcb) >> 0x10));
-		image[gx + 2] = ((unsigned char)((rcr + gcr + bcr) >> 0x10));
+		uchar4 p0, p1, p2;
+		if(plane_x + 0x4 <= width)
+		{
+			p0 = vload4(0, row + plane_x * 3);
+			p1 = vload4(1, row + plane_x * 3);
+			p2 = vload4(2, row + plane_x * 3);
+		}
+		else
+		{
+			/* the pixels right of the image repeat the last one */
+			unsigned char edge[0xC];
+			for(size_t i = 0; i < 0x4; ++i)
+			{
+				size_t image_x = plane_x + i < width ? plane_x + i : width - 1;
+				edge[i * 3 + 0] = row[image_x * 3 + 0];
+				edge[i * 3 + 1] = row[image_x * 3 + 1];
+				edge[i * 3 + 2] = row[image_x * 3 + 2];
+			}
+			p0 = vload4(0, edge);
+			p1 = vload4(1, edge);
+			p2 = vload4(2, edge);
+		}
+		int4 r = convert_int4((uchar4)(p0.s0, p0.s3, p1.s2, p2.s1));
+		int4 g = convert_int4((uchar4)(p0.s1, p1.s0, p1.s3, p2.s2));
+		int4 b = convert_int4((uchar4)(p0.s2, p1.s1, p2.s0, p2.s3));
+
+		/* convert them into yCbCr and store them in the planes */
+		__global unsigned char *out = planes + plane_y * pitch + plane_x;
+		vstore4(convert_uchar4(Y_FIXED(r, g, b)), 0, out);
+		vstore4(convert_uchar4(CB_FIXED(r, g, b)), 0, out + plane_size);
+		vstore4(convert_uchar4(CR_FIXED(r, g, b)), 0, out + 2 * (size_t)plane_size);
 	}
 }
 
 
-__kernel void downsample_full(__global short *buffer, __global unsigned char *image,
-							  unsigned int nsbw, unsigned int nbw,
-							  unsigned int nbh, unsigned int width, unsigned int height)
+__kernel void downsample_full(__global short *buffer, __global unsigned char *planes,
+							  unsigned int nsbw, unsigned int pitch)
 {
 	size_t gx = get_global_id(0);
 
@@ -65,18 +94,13 @@ __kernel void downsample_full(__global short *buffer, __global unsigned char *im
 	size_t image_x = (super_block_x << 0x4) | (sub_block_x << 0x3) | field_x;
 	size_t image_y = (super_block_y << 0x4) | (sub_block_y << 0x3) | field_y;
 
-	/* Clamp */
-	if(image_x >= width) image_x = width - 1;
-	if(image_y >= height) image_y = height - 1;
-
-	/* Copy the pixel */
-	buffer[gx] = (short)image[(image_x + (image_y * width)) * 3] - (short)0x80;
+	/* Copy the pixel, the plane is padded to whole super blocks */
+	buffer[gx] = (short)planes[image_x + image_y * pitch] - (short)0x80;
 }
 
 __kernel void downsample_2v2(__global short *cb, __global short *cr,
-							 __global unsigned char *image, unsigned int nsbw,
-							 unsigned int nbw, unsigned int nbh,
-							 unsigned int width, unsigned int height)
+							 __global unsigned char *planes, unsigned int nsbw,
+							 unsigned int pitch, unsigned int plane_size)
 {
 	size_t gx = get_global_id(0);
 
@@ -100,43 +124,13 @@ __kernel void downsample_2v2(__global short *cb, __global short *cr,
 	size_t image_x = (super_block_x << 0x4) | (sub_block_x << 0x3) | field_x;
 	size_t image_y = (super_block_y << 0x4) | (sub_block_y << 0x3) | field_y;
 
-	/* Compute pixels x and y values */
-	size_t pixel_x0 = image_x;
-	size_t pixel_x1 = image_x + 1;
-	size_t pixel_y0 = image_y;
-	size_t pixel_y1 = image_y + 1;
-
-	/* Clamp */
-	if(pixel_x0 >= width) pixel_x0 = width - 1;
-	if(pixel_x1 >= width) pixel_x1 = width - 1;
-	if(pixel_y0 >= height) pixel_y0 = height - 1;
-	if(pixel_y1 >= height) pixel_y1 = height - 1;
-
-	/* compute pixel ids */
-	size_t pixel00 = (pixel_x0 + (pixel_y0 * width));
-	size_t pixel10 = (pixel_x1 + (pixel_y0 * width));
-	size_t pixel01 = (pixel_x0 + (pixel_y1 * width));
-	size_t pixel11 = (pixel_x1 + (pixel_y1 * width));
-
-	/* Sum up the components */
-	long cb_sum = 0;
-	long cr_sum = 0;
-
-	size_t pixel = pixel00 * 3;
-	cb_sum += (long)image[pixel + 1];
-	cr_sum += (long)image[pixel + 2];
-
-	pixel = pixel10 * 3;
-	cb_sum += (long)image[pixel + 1];
-	cr_sum += (long)image[pixel + 2];
+	/* The Cb and Cr planes follow the Y plane, padded to whole super blocks */
+	__global unsigned char *cb_plane = planes + plane_size + image_x + image_y * pitch;
+	__global unsigned char *cr_plane = cb_plane + plane_size;
 
-	pixel = pixel01 * 3;
-	cb_sum += (long)image[pixel + 1];
-	cr_sum += (long)image[pixel + 2];
-
-	pixel = pixel11 * 3;
-	cb_sum += (long)image[pixel + 1];
-	cr_sum += (long)image[pixel + 2];
+	/* Sum up the components of the two neighbouring pixels of both rows */
+	long cb_sum = (long)cb_plane[0] + (long)cb_plane[1] + (long)cb_plane[pitch] + (long)cb_plane[pitch + 1];
+	long cr_sum = (long)cr_plane[0] + (long)cr_plane[1] + (long)cr_plane[pitch] + (long)cr_plane[pitch + 1];
 
 	int bias = 0x1 << (gx & 0x1);
 	cb_sum += bias;
@@ -156,9 +150,18 @@ __kernel void downsample_2v2(__global short *cb, __global short *cr,
 #define LEFT_SHIFT(a, b) ((int)((unsigned int)(a) << (b)))
 #define DESCALE(x,n)  RIGHT_SHIFT((x) + (1 << ((n)-1)), n)
 #define RIGHT_SHIFT(x,shft)     ((x) >> (shft))
-__kernel void dct_quant(__global short *block, __global short *divisors, unsigned int divisor_offset,
-						__global short *multiplier, __global int *sign, __global int *indices,
-						__global char *descaler, __global short *descaler_offset)
+/**
+ * Perform the forward DCT and the quantification of a single 8x8 block that already
+ * resides in local memory. Needs to be called by all work items of the work group,
+ * since it contains barriers. The block content is overwritten with intermediate values.
+ *
+ * @param lblock the block in local memory
+ * @param lx the index of the coefficient in the block computed by this work item
+ * @return the quantified coefficient
+ */
+short dct_quant_block(__local short *lblock, size_t lx, __global short *divisors, unsigned int divisor_offset,
+					  __global short *multiplier, __global int *sign, __global int *indices,
+					  __global char *descaler, __global short *descaler_offset)
 {
 	unsigned int product;
 	unsigned short recip, corr;
@@ -168,16 +171,10 @@ __kernel void dct_quant(__global short *block, __global short *divisors, unsigne
 	__local short *dataptr;
 	int shift;
 
-	size_t gx = get_global_id(0);
-	size_t lx = get_local_id(0);
-
 	short row = lx >> 0x3;
 	short row_offset = (row) << 0x3;
 	short column = lx & 0x7;
 
-	__local short lblock[0x40];
-	lblock[lx] = block[gx];
-	barrier(CLK_LOCAL_MEM_FENCE);
 	dataptr = &lblock[row_offset];
 
 	/* Pass 1: process rows. */
@@ -222,7 +219,293 @@ __kernel void dct_quant(__global short *block, __global short *divisors, unsigne
 	product >>= shift + sizeof(short) * 8;
 	res = (short) product;
 	res *= neg;
-	block[gx] = (short)res;
+	return res;
+}
+
+__kernel void dct_quant(__global short *block, __global short *divisors, unsigned int divisor_offset,
+						__global short *multiplier, __global int *sign, __global int *indices,
+						__global char *descaler, __global short *descaler_offset)
+{
+	size_t gx = get_global_id(0);
+	size_t lx = get_local_id(0);
+
+	__local short lblock[0x40];
+	lblock[lx] = block[gx];
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	block[gx] = dct_quant_block(lblock, lx, divisors, divisor_offset, multiplier, sign, indices, descaler, descaler_offset);
+}
+
+#if defined(cl_intel_subgroups)
+#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+#define SUB_GROUP_SHUFFLE(value, lane) intel_sub_group_shuffle(value, lane)
+#elif defined(cl_khr_subgroups) && defined(cl_khr_subgroup_shuffle)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#pragma OPENCL EXTENSION cl_khr_subgroup_shuffle : enable
+#define SUB_GROUP_SHUFFLE(value, lane) sub_group_shuffle(value, lane)
+#endif
+
+#ifdef SUB_GROUP_SHUFFLE
+/* Expand the given macro for each of the eight indices of a row or column */
+#define DCT_UNROLL(M) M(0) M(1) M(2) M(3) M(4) M(5) M(6) M(7)
+
+/* The DCT of coefficient k with its rows of INDICES, SIGN and MULTIPLIER in tables.h
+ * baked in, so that the private arrays are only ever indexed with constants */
+#define DCT_PRODUCT_SUM(d, i0, i1, i2, i3, i4, i5, i6, i7, s0, s1, m0, m1, m2, m3) \
+	dct_product_sum((d)[i0], (d)[i1], (d)[i2], (d)[i3], (d)[i4], (d)[i5], (d)[i6], (d)[i7], s0, s1, m0, m1, m2, m3)
+#define DCT_SUM_0(d) DCT_PRODUCT_SUM(d, 2, 5, 0, 7, 1, 6, 3, 4, 1, 1, 0, 0, 0, 1)
+#define DCT_SUM_1(d) DCT_PRODUCT_SUM(d, 0, 7, 3, 4, 2, 5, 1, 6, -1, 1, 12299, -7373, -3196, 9633)
+#define DCT_SUM_2(d) DCT_PRODUCT_SUM(d, 7, 4, 0, 3, 1, 2, 6, 5, -1, 1, 0, 6270, 0, 4433)
+#define DCT_SUM_3(d) DCT_PRODUCT_SUM(d, 1, 6, 2, 5, 3, 4, 0, 7, -1, 1, 25172, -20995, -16069, 9633)
+#define DCT_SUM_4(d) DCT_PRODUCT_SUM(d, 0, 7, 3, 4, 1, 6, 2, 5, 1, -1, 0, 0, 0, 1)
+#define DCT_SUM_5(d) DCT_PRODUCT_SUM(d, 2, 5, 1, 6, 0, 7, 3, 4, -1, 1, 16819, -20995, -3196, 9633)
+#define DCT_SUM_6(d) DCT_PRODUCT_SUM(d, 6, 5, 1, 2, 0, 3, 7, 4, -1, 1, 0, -15137, 0, 4433)
+#define DCT_SUM_7(d) DCT_PRODUCT_SUM(d, 3, 4, 0, 7, 1, 6, 2, 5, -1, 1, 2446, -7373, -16069, 9633)
+
+/* Pass 1 for all columns of row into pass, pass 2 and 3 for all rows of column into the block */
+#define DCT_ROW_PASS(k) pass[k] = dct_row_pass(DCT_SUM_##k(row), k, descaler);
+#define DCT_COLUMN_PASS(r) \
+	if(active) \
+		first[(r << 0x3) | item] = dct_column_quant(DCT_SUM_##r(column), r, item, divisors, divisor_offset, descaler_offset);
+
+/**
+ * Sum of the products of the one dimensional DCT of eight values, computed the same way
+ * as in dct_quant_block with the values already gathered in the order of INDICES
+ *
+ * @return the unscaled coefficient
+ */
+int dct_product_sum(short d0, short d1, short d2, short d3, short d4, short d5, short d6, short d7,
+					int s0, int s1, int m0, int m1, int m2, int m3)
+{
+	short t0 = d0 + (d1 * s0);
+	short t1 = d2 + (d3 * s0);
+	short t2 = d4 + (d5 * s0);
+	short t3 = d6 + (d7 * s0);
+	return t0 * m0 + (t1 + t0) * m1 + (t2 + t0) * m2 + ((t0 + t1) + ((t2 + t3) * s1)) * m3;
+}
+
+/**
+ * Scale the result of the first pass of the DCT over a row for the second pass
+ *
+ * @param value the unscaled coefficient
+ * @param column the index of the coefficient
+ * @return the coefficient scaled for the second pass
+ */
+short dct_row_pass(int value, unsigned int column, __constant char *descaler)
+{
+	return (short)DESCALE(value, 0xB) * descaler[(column << 0x1) + 0] + LEFT_SHIFT(value, 0x2) * descaler[(column << 0x1) + 1];
+}
+
+/**
+ * Scale the result of the second pass of the DCT over a column and quantize it
+ *
+ * @param value the unscaled coefficient
+ * @param row the row of the coefficient
+ * @param column the column of the coefficient
+ * @return the quantified coefficient
+ */
+short dct_column_quant(int value, unsigned int row, unsigned int column, __constant short *divisors,
+					   unsigned int divisor_offset, __constant short *descaler_offset)
+{
+	short res = DESCALE(value, 0x2 + descaler_offset[row]);
+
+	unsigned int index = (row << 0x3) | column;
+	unsigned short recip = divisors[divisor_offset + index + 0x40 * 0];
+	unsigned short corr = divisors[divisor_offset + index + 0x40 * 1];
+	int shift = divisors[divisor_offset + index + 0x40 * 3];
+	short neg = res < 0 ? -1 : 1;
+	res *= neg;
+	unsigned int product = (unsigned int) (res + corr) * recip;
+	product >>= shift + sizeof(short) * 8;
+	return (short) product * neg;
+}
+
+/**
+ * Get one of eight values in private memory by an index only known at run time,
+ * selecting it instead of indexing the array
+ *
+ * @param values the eight values
+ * @param index the index of the value
+ * @return the value
+ */
+short select_private(const short *values, unsigned int index)
+{
+	short value = values[0];
+#define DCT_SELECT(k) value = index == k ? values[k] : value;
+	DCT_UNROLL(DCT_SELECT)
+#undef DCT_SELECT
+	return value;
+}
+
+/**
+ * Set one of eight values in private memory by an index only known at run time,
+ * selecting it instead of indexing the array
+ *
+ * @param values the eight values
+ * @param index the index of the value
+ * @param value the new value
+ */
+void store_private(short *values, unsigned int index, short value)
+{
+#define DCT_STORE(k) values[k] = index == k ? value : values[k];
+	DCT_UNROLL(DCT_STORE)
+#undef DCT_STORE
+}
+
+/**
+ * Forward DCT and quantification with one work item per row of a block instead of one per
+ * coefficient. The rows are exchanged for the columns with sub-group shuffles instead of
+ * local memory and barriers. The DCT tables are baked in and all loops over the values of
+ * a row or column are unrolled, so the private arrays are only indexed with constants and
+ * can be kept in registers. The results are identical to dct_quant.
+ *
+ * @param rows the number of rows of all blocks, the work items beyond only take part in the shuffles
+ */
+__kernel void dct_quant_subgroup(__global short *block, __constant short *divisors, unsigned int divisor_offset,
+								 __constant char *descaler, __constant short *descaler_offset, unsigned int rows)
+{
+	size_t gx = get_global_id(0);
+	unsigned int item = gx & 0x7;
+	bool active = gx < rows;
+	__global short *first = block + ((gx >> 0x3) << 0x6);
+
+	short row[0x8];
+	short pass[0x8];
+	short column[0x8];
+
+	/* Pass 1: process the row of the work item */
+#define DCT_LOAD(i) row[i] = active ? first[(r << 0x3) + i] : 0;
+	unsigned int r = item;
+	DCT_UNROLL(DCT_LOAD)
+	DCT_UNROLL(DCT_ROW_PASS)
+
+	/* Exchange the rows for the columns, the work item afterwards holds the column of its index.
+	 * In step k it receives the value of work item item + k, which sends its value of column
+	 * item. The eight work items of a block share a sub-group if its size is a multiple of 8,
+	 * otherwise the column is computed from the rows in global memory instead, which the
+	 * work group has to finish reading before the coefficients are written back. */
+	if((get_max_sub_group_size() & 0x7) == 0)
+	{
+		unsigned int lane = get_sub_group_local_id() & ~0x7;
+#define DCT_EXCHANGE(k) \
+		store_private(column, (item + k) & 0x7, \
+					  (short)SUB_GROUP_SHUFFLE((int)select_private(pass, (item - k) & 0x7), lane | ((item + k) & 0x7)));
+		DCT_UNROLL(DCT_EXCHANGE)
+#undef DCT_EXCHANGE
+	}
+	else
+	{
+		for(r = 0; r < 0x8; ++r)
+		{
+			DCT_UNROLL(DCT_LOAD)
+			DCT_UNROLL(DCT_ROW_PASS)
+			store_private(column, r, select_private(pass, item));
+		}
+		barrier(CLK_GLOBAL_MEM_FENCE);
+	}
+#undef DCT_LOAD
+
+	/* Pass 2: process the column, pass 3: quantize, the work items store one row together */
+	DCT_UNROLL(DCT_COLUMN_PASS)
+}
+#endif
+
+/*
+ * Fused color space transformation, downsampling, DCT and quantification.
+ *
+ * Each work group of 256 work items processes a single super block (16x16 pixel MCU).
+ * Every work item reads exactly one pixel from global memory, all intermediate values
+ * are kept in local memory and only the quantified coefficients are written back.
+ * The blocks exceeding the image on the right and the bottom are filled in the same
+ * way zero_out_right, zero_out_bottom and the host would do for the separate kernels.
+ */
+__kernel void color_dct_quant(__constant unsigned int *color_conversion_table, __global unsigned char *image,
+							  __global short *y, __global short *cb, __global short *cr,
+							  __global short *divisors, __global short *multiplier, __global int *sign,
+							  __global int *indices, __global char *descaler, __global short *descaler_offset,
+							  unsigned int nsbw, unsigned int nbw, unsigned int nbh,
+							  unsigned int width, unsigned int height)
+{
+	size_t lx = get_local_id(0);
+
+	/* compute id and x and y of super block */
+	size_t super_block_id = get_group_id(0);
+	size_t super_block_x = super_block_id % nsbw;
+	size_t super_block_y = super_block_id / nsbw;
+
+	/* x and y position inside of the super block */
+	size_t tile_x = lx & 0xF;
+	size_t tile_y = lx >> 0x4;
+
+	/* four luminance blocks, cb, cr and two scratch blocks for the idle work items */
+	__local short lblocks[0x200];
+	__local unsigned char lcb[0x100];
+	__local unsigned char lcr[0x100];
+
+	/* Global x and y image position */
+	size_t image_x = (super_block_x << 0x4) | tile_x;
+	size_t image_y = (super_block_y << 0x4) | tile_y;
+
+	/* Clamp */
+	if(image_x >= width) image_x = width - 1;
+	if(image_y >= height) image_y = height - 1;
+
+	/* read RGB values */
+	size_t pixel = (image_x + (image_y * width)) * 3;
+	unsigned char r = image[pixel + 0];
+	unsigned char g = image[pixel + 1];
+	unsigned char b = image[pixel + 2];
+
+	/* convert them into yCbCr */
+	unsigned int yv = color_conversion_table[RED_OFFSET + r * 3 + 0] + color_conversion_table[GREEN_OFFSET + g * 3 + 0]
+					+ color_conversion_table[BLUE_OFFSET + b * 3 + 0];
+	unsigned int crv = color_conversion_table[RED_OFFSET + r * 3 + 1] + color_conversion_table[GREEN_OFFSET + g * 3 + 1]
+					 + color_conversion_table[BLUE_OFFSET + b * 3 + 1];
+	unsigned int cbv = color_conversion_table[RED_OFFSET + r * 3 + 2] + color_conversion_table[GREEN_OFFSET + g * 3 + 2]
+					 + color_conversion_table[BLUE_OFFSET + b * 3 + 2];
+
+	/* store luminance in sub block layout, chrominance in tile layout for the downsampling */
+	size_t sub_block_id = ((tile_y >> 0x3) << 0x1) | (tile_x >> 0x3);
+	size_t field_id = ((tile_y & 0x7) << 0x3) | (tile_x & 0x7);
+	lblocks[(sub_block_id << 0x6) | field_id] = (short)((unsigned char)(yv >> 0x10)) - (short)0x80;
+	lcb[lx] = (unsigned char)(cbv >> 0x10);
+	lcr[lx] = (unsigned char)(crv >> 0x10);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	/* 2v2 downsampling, the first 64 work items compute cb, the next 64 work items cr */
+	if(lx < 0x80)
+	{
+		__local unsigned char *plane = lx < 0x40 ? lcb : lcr;
+		size_t field = lx & 0x3F;
+		size_t tile = ((field >> 0x3) << 0x5) | ((field & 0x7) << 0x1);
+		long sum = (long)plane[tile] + (long)plane[tile + 0x1] + (long)plane[tile + 0x10] + (long)plane[tile + 0x11];
+		sum += 0x1 << (lx & 0x1);
+		lblocks[0x100 | lx] = (short)(sum >> 0x2) - (short)0x80;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	/* DCT and quantification, luminance first, then chrominance */
+	short res = dct_quant_block(&lblocks[lx & 0xC0], lx & 0x3F, divisors, 0, multiplier, sign, indices, descaler, descaler_offset);
+	short cres = dct_quant_block(&lblocks[0x100 | (lx & 0xC0)], lx & 0x3F, divisors, 0x100, multiplier, sign, indices, descaler, descaler_offset);
+
+	if(lx < 0x40)
+		cb[(super_block_id << 0x6) | lx] = cres;
+	else if(lx < 0x80)
+		cr[(super_block_id << 0x6) | (lx & 0x3F)] = cres;
+
+	/* Fill the blocks outside of the image, those on the right get the dc value from their left
+	 * neighbor, those on the bottom the one of the top right block */
+	lblocks[lx] = res;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	size_t local_block_id = lx >> 0x6;
+	size_t pad_right = (super_block_x << 0x1) + 1 >= nbw;
+	size_t pad_bottom = (super_block_y << 0x1) + 1 >= nbh;
+	if(pad_bottom && local_block_id >= 0x2)
+		res = (lx & 0x3F) ? 0 : lblocks[pad_right ? 0x0 : 0x40];
+	else if(pad_right && (local_block_id & 0x1))
+		res = (lx & 0x3F) ? 0 : lblocks[(local_block_id - 1) << 0x6];
+	y[(super_block_id << 0x8) | lx] = res;
 }
 
 __kernel void zero_out_right(__global short *buffer, unsigned int nsbw, unsigned int nsbh, unsigned int nbw)
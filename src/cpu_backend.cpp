@@ -0,0 +1,646 @@
+#include "../include/jpeg_encoder.hpp"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HOST_X86
+#include <immintrin.h>
+#endif
+
+namespace jpeg
+{
+
+#define RED_OFFSET 0x0
+#define GREEN_OFFSET 0x300
+#define BLUE_OFFSET 0x600
+
+#define LEFT_SHIFT(a, b) ((int)((unsigned int)(a) << (b)))
+#define DESCALE(x,n)  RIGHT_SHIFT((x) + (1 << ((n)-1)), n)
+#define RIGHT_SHIFT(x,shft)     ((x) >> (shft))
+
+/**
+ * Perform the forward DCT and the quantification of a single 8x8 block the same
+ * way the dct_quant_block function of the kernels does, the results are identical.
+ *
+ * @param block the block, overwritten with the quantified coefficients
+ * @param divisors the divisor table of the channel
+ */
+static void dct_quant_block(short *block, const short *divisors)
+{
+	short workspace[0x40];
+	short t0, t1, t2, t3, res, neg;
+	unsigned int product;
+	unsigned short recip, corr;
+	int value, shift;
+
+	/* Pass 1: process rows. */
+	for(size_t lx = 0; lx < 0x40; ++lx)
+	{
+		size_t column = lx & 0x7;
+		const short *dataptr = &block[lx & 0x38];
+		const int *indices = &INDICES[column << 0x3];
+		const short *multiplier = &MULTIPLIER[column << 0x2];
+		const int *sign = &SIGN[column << 0x1];
+		const char *descaler = &DESCALER[column << 0x1];
+
+		t0 = dataptr[indices[0]] + (dataptr[indices[1]] * sign[0]);
+		t1 = dataptr[indices[2]] + (dataptr[indices[3]] * sign[0]);
+		t2 = dataptr[indices[4]] + (dataptr[indices[5]] * sign[0]);
+		t3 = dataptr[indices[6]] + (dataptr[indices[7]] * sign[0]);
+		value = t0 * multiplier[0] + (t1 + t0) * multiplier[1] + (t2 + t0)
+				   * multiplier[2] + ((t0 + t1) + ((t2 + t3) * sign[1])) * multiplier[3];
+		workspace[lx] = (short)DESCALE(value, 0xB) * descaler[0] + LEFT_SHIFT(value, 0x2) * descaler[1];
+	}
+
+	/* Pass 2: process columns, Pass 3: quantize */
+	for(size_t lx = 0; lx < 0x40; ++lx)
+	{
+		size_t row = lx >> 0x3;
+		const short *dataptr = &workspace[lx & 0x7];
+		const int *indices = &INDICES[row << 0x3];
+		const short *multiplier = &MULTIPLIER[row << 0x2];
+		const int *sign = &SIGN[row << 0x1];
+
+		t0 = dataptr[indices[0] << 0x3] + (dataptr[indices[1] << 0x3] * sign[0]);
+		t1 = dataptr[indices[2] << 0x3] + (dataptr[indices[3] << 0x3] * sign[0]);
+		t2 = dataptr[indices[4] << 0x3] + (dataptr[indices[5] << 0x3] * sign[0]);
+		t3 = dataptr[indices[6] << 0x3] + (dataptr[indices[7] << 0x3] * sign[0]);
+		value = t0 * multiplier[0] + (t1 + t0) * multiplier[1] + (t2 + t0)
+				   * multiplier[2] + ((t0 + t1) + ((t2 + t3) * sign[1])) * multiplier[3];
+		res = DESCALE(value, 0x2 + DESCALER_OFFSET[row]);
+
+		recip = divisors[lx + 0x40 * 0];
+		corr = divisors[lx + 0x40 * 1];
+		shift = divisors[lx + 0x40 * 3];
+		neg = res < 0 ? -1 : 1;
+		res *= neg;
+		product = (unsigned int) (res + corr) * recip;
+		product >>= shift + sizeof(short) * 8;
+		res = (short) product;
+		res *= neg;
+		block[lx] = res;
+	}
+}
+
+/**
+ * Convert a super block of the image into YCbCr with the color conversion table and
+ * downsample the chrominance, the same way the color_space_transform_planar, downsample_full
+ * and downsample_2v2 kernels do. Pixels outside of the image are clamped to the edge.
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param super_block_x the x position of the super block
+ * @param super_block_y the y position of the super block
+ * @param y receives the four level shifted luminance blocks
+ * @param cb receives the level shifted cb block
+ * @param cr receives the level shifted cr block
+ */
+static void convert_super_block_lut(const unsigned char *image, size_t width, size_t height, size_t super_block_x, size_t super_block_y,
+									short *y, short *cb, short *cr)
+{
+	/* chrominance in tile layout for the downsampling */
+	unsigned char tile_cb[0x100];
+	unsigned char tile_cr[0x100];
+
+	for(size_t tile_y = 0; tile_y < 0x10; ++tile_y)
+	{
+		/* Clamp */
+		size_t image_y = (super_block_y << 0x4) | tile_y;
+		if(image_y >= height) image_y = height - 1;
+
+		for(size_t tile_x = 0; tile_x < 0x10; ++tile_x)
+		{
+			size_t image_x = (super_block_x << 0x4) | tile_x;
+			if(image_x >= width) image_x = width - 1;
+
+			/* read RGB values and convert them into yCbCr */
+			const unsigned char *pixel = &image[(image_x + (image_y * width)) * 3];
+			const unsigned int *r = &color_conversion_table[RED_OFFSET + pixel[0] * 3];
+			const unsigned int *g = &color_conversion_table[GREEN_OFFSET + pixel[1] * 3];
+			const unsigned int *b = &color_conversion_table[BLUE_OFFSET + pixel[2] * 3];
+			unsigned int yv = r[0] + g[0] + b[0];
+			unsigned int crv = r[1] + g[1] + b[1];
+			unsigned int cbv = r[2] + g[2] + b[2];
+
+			size_t sub_block_id = ((tile_y >> 0x3) << 0x1) | (tile_x >> 0x3);
+			size_t field_id = ((tile_y & 0x7) << 0x3) | (tile_x & 0x7);
+			y[(sub_block_id << 0x6) | field_id] = (short)((unsigned char)(yv >> 0x10)) - (short)0x80;
+			tile_cb[(tile_y << 0x4) | tile_x] = (unsigned char)(cbv >> 0x10);
+			tile_cr[(tile_y << 0x4) | tile_x] = (unsigned char)(crv >> 0x10);
+		}
+	}
+
+	/* 2v2 downsampling */
+	for(size_t field = 0; field < 0x40; ++field)
+	{
+		size_t tile = ((field >> 0x3) << 0x5) | ((field & 0x7) << 0x1);
+		long bias = 0x1 << (field & 0x1);
+		long cb_sum = (long)tile_cb[tile] + (long)tile_cb[tile + 0x1] + (long)tile_cb[tile + 0x10] + (long)tile_cb[tile + 0x11] + bias;
+		long cr_sum = (long)tile_cr[tile] + (long)tile_cr[tile + 0x1] + (long)tile_cr[tile + 0x10] + (long)tile_cr[tile + 0x11] + bias;
+		cb[field] = (short)(cb_sum >> 0x2) - (short)0x80;
+		cr[field] = (short)(cr_sum >> 0x2) - (short)0x80;
+	}
+}
+
+#ifdef HOST_X86
+/**
+ * Transpose the 8x8 blocks held in the two 128 bit lanes of the given rows
+ *
+ * @param rows the rows of both blocks, replaced with their columns
+ */
+__attribute__((target("avx2")))
+static inline void transpose_blocks(__m256i rows[0x8])
+{
+	__m256i t[0x8], u[0x8];
+
+	for(size_t i = 0; i < 0x4; ++i)
+	{
+		t[i << 0x1] = _mm256_unpacklo_epi16(rows[i << 0x1], rows[(i << 0x1) + 1]);
+		t[(i << 0x1) + 1] = _mm256_unpackhi_epi16(rows[i << 0x1], rows[(i << 0x1) + 1]);
+	}
+	for(size_t i = 0; i < 0x2; ++i)
+	{
+		u[(i << 0x2) + 0] = _mm256_unpacklo_epi32(t[(i << 0x2) + 0], t[(i << 0x2) + 2]);
+		u[(i << 0x2) + 1] = _mm256_unpackhi_epi32(t[(i << 0x2) + 0], t[(i << 0x2) + 2]);
+		u[(i << 0x2) + 2] = _mm256_unpacklo_epi32(t[(i << 0x2) + 1], t[(i << 0x2) + 3]);
+		u[(i << 0x2) + 3] = _mm256_unpackhi_epi32(t[(i << 0x2) + 1], t[(i << 0x2) + 3]);
+	}
+	for(size_t i = 0; i < 0x4; ++i)
+	{
+		rows[i << 0x1] = _mm256_unpacklo_epi64(u[i], u[i + 4]);
+		rows[(i << 0x1) + 1] = _mm256_unpackhi_epi64(u[i], u[i + 4]);
+	}
+}
+
+/* Constant pair multiplied with interleaved 16 bit values by _mm256_madd_epi16 */
+#define MADD_PAIR(even, odd) _mm256_set1_epi32((int)(((unsigned int)(unsigned short)(odd) << 0x10) | (unsigned short)(even)))
+
+/**
+ * Descale the exact 32 bit results of the low and high interleaved elements
+ * and pack them back to 16 bit in their original order
+ *
+ * @param lo the results of the low elements of each lane
+ * @param hi the results of the high elements of each lane
+ * @param shift the number of bits to descale by, rounding to nearest
+ * @return the descaled values
+ */
+__attribute__((target("avx2")))
+static inline __m256i descale_pack(__m256i lo, __m256i hi, int shift)
+{
+	const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+	lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), shift);
+	hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), shift);
+	return _mm256_packs_epi32(lo, hi);
+}
+
+/**
+ * One pass of the DCT over the columns held in the given vectors, computing the same
+ * sums the MULTIPLIER, SIGN and INDICES tables of the kernels spell out. The products
+ * are summed in 32 bit with _mm256_madd_epi16, so the results are identical.
+ *
+ * @param data the eight inputs of each lane element, replaced with the eight outputs
+ * @param first flag whether this is the pass over the rows, which scales the outputs up
+ */
+__attribute__((target("avx2")))
+static inline void dct_pass_avx2(__m256i data[0x8], bool first)
+{
+	const int shift = first ? 0xB : 0xF;
+
+	__m256i tmp0 = _mm256_add_epi16(data[0], data[7]);
+	__m256i tmp7 = _mm256_sub_epi16(data[0], data[7]);
+	__m256i tmp1 = _mm256_add_epi16(data[1], data[6]);
+	__m256i tmp6 = _mm256_sub_epi16(data[1], data[6]);
+	__m256i tmp2 = _mm256_add_epi16(data[2], data[5]);
+	__m256i tmp5 = _mm256_sub_epi16(data[2], data[5]);
+	__m256i tmp3 = _mm256_add_epi16(data[3], data[4]);
+	__m256i tmp4 = _mm256_sub_epi16(data[3], data[4]);
+
+	/* Even part */
+	__m256i tmp10 = _mm256_add_epi16(tmp0, tmp3);
+	__m256i tmp13 = _mm256_sub_epi16(tmp0, tmp3);
+	__m256i tmp11 = _mm256_add_epi16(tmp1, tmp2);
+	__m256i tmp12 = _mm256_sub_epi16(tmp1, tmp2);
+	if(first)
+	{
+		data[0] = _mm256_slli_epi16(_mm256_add_epi16(tmp10, tmp11), 0x2);
+		data[4] = _mm256_slli_epi16(_mm256_sub_epi16(tmp10, tmp11), 0x2);
+	}
+	else
+	{
+		const __m256i two = _mm256_set1_epi16(0x2);
+		data[0] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(tmp10, tmp11), two), 0x2);
+		data[4] = _mm256_srai_epi16(_mm256_add_epi16(_mm256_sub_epi16(tmp10, tmp11), two), 0x2);
+	}
+
+	/* (tmp12 + tmp13) * 4433 plus tmp13 * 6270 or tmp12 * -15137 */
+	__m256i lo = _mm256_unpacklo_epi16(tmp13, tmp12);
+	__m256i hi = _mm256_unpackhi_epi16(tmp13, tmp12);
+	data[2] = descale_pack(_mm256_madd_epi16(lo, MADD_PAIR(6270 + 4433, 4433)), _mm256_madd_epi16(hi, MADD_PAIR(6270 + 4433, 4433)), shift);
+	data[6] = descale_pack(_mm256_madd_epi16(lo, MADD_PAIR(4433, 4433 - 15137)), _mm256_madd_epi16(hi, MADD_PAIR(4433, 4433 - 15137)), shift);
+
+	/* Odd part, z5 = (z3 + z4) * 9633 is folded into z3 * -16069 and z4 * -3196 */
+	__m256i z3 = _mm256_add_epi16(tmp4, tmp6);
+	__m256i z4 = _mm256_add_epi16(tmp5, tmp7);
+	lo = _mm256_unpacklo_epi16(z3, z4);
+	hi = _mm256_unpackhi_epi16(z3, z4);
+	__m256i z3_lo = _mm256_madd_epi16(lo, MADD_PAIR(9633 - 16069, 9633));
+	__m256i z3_hi = _mm256_madd_epi16(hi, MADD_PAIR(9633 - 16069, 9633));
+	__m256i z4_lo = _mm256_madd_epi16(lo, MADD_PAIR(9633, 9633 - 3196));
+	__m256i z4_hi = _mm256_madd_epi16(hi, MADD_PAIR(9633, 9633 - 3196));
+
+	/* z1 = (tmp4 + tmp7) * -7373 is folded into tmp4 * 2446 and tmp7 * 12299 */
+	lo = _mm256_unpacklo_epi16(tmp4, tmp7);
+	hi = _mm256_unpackhi_epi16(tmp4, tmp7);
+	data[7] = descale_pack(_mm256_add_epi32(_mm256_madd_epi16(lo, MADD_PAIR(2446 - 7373, -7373)), z3_lo),
+						   _mm256_add_epi32(_mm256_madd_epi16(hi, MADD_PAIR(2446 - 7373, -7373)), z3_hi), shift);
+	data[1] = descale_pack(_mm256_add_epi32(_mm256_madd_epi16(lo, MADD_PAIR(-7373, 12299 - 7373)), z4_lo),
+						   _mm256_add_epi32(_mm256_madd_epi16(hi, MADD_PAIR(-7373, 12299 - 7373)), z4_hi), shift);
+
+	/* z2 = (tmp5 + tmp6) * -20995 is folded into tmp5 * 16819 and tmp6 * 25172 */
+	lo = _mm256_unpacklo_epi16(tmp5, tmp6);
+	hi = _mm256_unpackhi_epi16(tmp5, tmp6);
+	data[5] = descale_pack(_mm256_add_epi32(_mm256_madd_epi16(lo, MADD_PAIR(16819 - 20995, -20995)), z4_lo),
+						   _mm256_add_epi32(_mm256_madd_epi16(hi, MADD_PAIR(16819 - 20995, -20995)), z4_hi), shift);
+	data[3] = descale_pack(_mm256_add_epi32(_mm256_madd_epi16(lo, MADD_PAIR(-20995, 25172 - 20995)), z3_lo),
+						   _mm256_add_epi32(_mm256_madd_epi16(hi, MADD_PAIR(-20995, 25172 - 20995)), z3_hi), shift);
+}
+
+/**
+ * Perform the forward DCT and the quantification of two 8x8 blocks at once with AVX2,
+ * one per 128 bit lane. The results are identical to dct_quant_block.
+ *
+ * @param first the first block, overwritten with the quantified coefficients
+ * @param second the second block, overwritten with the quantified coefficients
+ * @param first_divisors the divisor table of the channel of the first block
+ * @param second_divisors the divisor table of the channel of the second block
+ */
+__attribute__((target("avx2")))
+static void dct_quant_blocks_avx2(short *first, short *second, const short *first_divisors, const short *second_divisors)
+{
+	__m256i data[0x8];
+
+	for(size_t row = 0; row < 0x8; ++row)
+		data[row] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(first + (row << 0x3)))),
+											_mm_loadu_si128((const __m128i*)(second + (row << 0x3))), 0x1);
+
+	/* Pass 1: process rows, Pass 2: process columns */
+	transpose_blocks(data);
+	dct_pass_avx2(data, true);
+	transpose_blocks(data);
+	dct_pass_avx2(data, false);
+
+	/* Pass 3: quantize the magnitudes with the reciprocals, the scale applies the shift */
+	for(size_t row = 0; row < 0x8; ++row)
+	{
+		__m256i divisors[0x3];
+		for(size_t i = 0; i < 0x3; ++i)
+			divisors[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(first_divisors + (row << 0x3) + 0x40 * i))),
+												  _mm_loadu_si128((const __m128i*)(second_divisors + (row << 0x3) + 0x40 * i)), 0x1);
+
+		__m256i neg = _mm256_cmpgt_epi16(_mm256_setzero_si256(), data[row]);
+		__m256i res = _mm256_add_epi16(_mm256_abs_epi16(data[row]), divisors[1]);
+		res = _mm256_mulhi_epu16(_mm256_mulhi_epu16(res, divisors[0]), divisors[2]);
+		res = _mm256_sub_epi16(_mm256_xor_si256(res, neg), neg);
+
+		_mm_storeu_si128((__m128i*)(first + (row << 0x3)), _mm256_castsi256_si128(res));
+		_mm_storeu_si128((__m128i*)(second + (row << 0x3)), _mm256_extracti128_si256(res, 0x1));
+	}
+}
+
+/* Shuffles picking the red, green and blue bytes of 16 pixels out of their three 16 byte loads */
+struct deinterleave_shuffle
+{
+	alignas(0x10) unsigned char mask[0x3][0x3][0x10];
+
+	deinterleave_shuffle()
+	{
+		for(size_t load = 0; load < 0x3; ++load)
+			for(size_t channel = 0; channel < 0x3; ++channel)
+				for(size_t i = 0; i < 0x10; ++i)
+				{
+					size_t byte = i * 3 + channel;
+					this->mask[load][channel][i] = (byte >> 0x4) == load ? (byte & 0xF) : 0x80;
+				}
+	}
+};
+
+/**
+ * Convert a row of 16 pixels of a tile into YCbCr. The color conversion table is
+ * linear in each channel, so its sums are computed directly in 32 bit fixed point:
+ * y = 19595 r + 38470 g + 7471 b + 0x8000, cr = 32768 r - 27439 g - 5329 b + 0x807FFF,
+ * cb = -11059 r - 21709 g + 32768 b + 0x807FFF, each shifted right by 16. The
+ * coefficients above 32767 are split into a multiply and a shift by 16.
+ *
+ * @param row the 48 bytes of the pixels
+ * @param y receives the luminance
+ * @param cb receives the cb values
+ * @param cr receives the cr values
+ */
+__attribute__((target("avx2")))
+static inline void convert_row_avx2(const unsigned char *row, __m256i& y, __m256i& cb, __m256i& cr)
+{
+	static const deinterleave_shuffle shuffle;
+	const __m256i zero = _mm256_setzero_si256();
+	__m128i in[0x3], channels[0x3];
+
+	for(size_t i = 0; i < 0x3; ++i)
+		in[i] = _mm_loadu_si128((const __m128i*)(row + (i << 0x4)));
+	for(size_t c = 0; c < 0x3; ++c)
+		channels[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], _mm_load_si128((const __m128i*)shuffle.mask[0][c])),
+												_mm_shuffle_epi8(in[1], _mm_load_si128((const __m128i*)shuffle.mask[1][c]))),
+								   _mm_shuffle_epi8(in[2], _mm_load_si128((const __m128i*)shuffle.mask[2][c])));
+
+	/* r and g interleaved, b extended to 32 bit */
+	__m256i r = _mm256_cvtepu8_epi16(channels[0]);
+	__m256i g = _mm256_cvtepu8_epi16(channels[1]);
+	__m256i b = _mm256_cvtepu8_epi16(channels[2]);
+	__m256i rg[0x2] = { _mm256_unpacklo_epi16(r, g), _mm256_unpackhi_epi16(r, g) };
+	__m256i b0[0x2] = { _mm256_unpacklo_epi16(b, zero), _mm256_unpackhi_epi16(b, zero) };
+	__m256i yv[0x2], cbv[0x2], crv[0x2];
+
+	for(size_t i = 0; i < 0x2; ++i)
+	{
+		/* g << 16 is the high half of the pair, r << 16 and b << 16 the pair shifted */
+		yv[i] = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg[i], MADD_PAIR(19595, 38470 - 0x10000)), _mm256_madd_epi16(b0[i], MADD_PAIR(7471, 0))),
+								 _mm256_add_epi32(_mm256_and_si256(rg[i], _mm256_set1_epi32(0xFFFF0000)), _mm256_set1_epi32(0x8000)));
+		crv[i] = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg[i], MADD_PAIR(32768 - 0x10000, -27439)), _mm256_madd_epi16(b0[i], MADD_PAIR(-5329, 0))),
+								  _mm256_add_epi32(_mm256_slli_epi32(rg[i], 0x10), _mm256_set1_epi32(0x807FFF)));
+		cbv[i] = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(rg[i], MADD_PAIR(-11059, -21709)), _mm256_madd_epi16(b0[i], MADD_PAIR(32768 - 0x10000, 0))),
+								  _mm256_add_epi32(_mm256_slli_epi32(b0[i], 0x10), _mm256_set1_epi32(0x807FFF)));
+	}
+
+	/* The sums are positive and below 1 << 24, packing restores the pixel order */
+	y = _mm256_packs_epi32(_mm256_srli_epi32(yv[0], 0x10), _mm256_srli_epi32(yv[1], 0x10));
+	cb = _mm256_packs_epi32(_mm256_srli_epi32(cbv[0], 0x10), _mm256_srli_epi32(cbv[1], 0x10));
+	cr = _mm256_packs_epi32(_mm256_srli_epi32(crv[0], 0x10), _mm256_srli_epi32(crv[1], 0x10));
+}
+
+/**
+ * Convert a super block of the image into YCbCr and downsample the chrominance with
+ * AVX2, without gathering from the color conversion table. The results are identical
+ * to convert_super_block_lut.
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param super_block_x the x position of the super block
+ * @param super_block_y the y position of the super block
+ * @param y receives the four level shifted luminance blocks
+ * @param cb receives the level shifted cb block
+ * @param cr receives the level shifted cr block
+ */
+__attribute__((target("avx2")))
+static void convert_super_block_avx2(const unsigned char *image, size_t width, size_t height, size_t super_block_x, size_t super_block_y,
+									 short *y, short *cb, short *cr)
+{
+	const __m256i level = _mm256_set1_epi16(0x80);
+	const __m256i ones = _mm256_set1_epi16(0x1);
+	const __m256i bias = _mm256_set_epi32(0x2, 0x1, 0x2, 0x1, 0x2, 0x1, 0x2, 0x1);
+	unsigned char padded[0x30];
+	__m256i yv[0x2], cbv[0x2], crv[0x2];
+
+	for(size_t tile_y = 0; tile_y < 0x10; ++tile_y)
+	{
+		/* Clamp, rows reaching over the right edge repeat the last pixel */
+		size_t image_y = (super_block_y << 0x4) | tile_y;
+		if(image_y >= height) image_y = height - 1;
+		const unsigned char *row = &image[((super_block_x << 0x4) + image_y * width) * 3];
+		if((super_block_x << 0x4) + 0x10 > width)
+		{
+			for(size_t tile_x = 0; tile_x < 0x10; ++tile_x)
+			{
+				size_t image_x = (super_block_x << 0x4) | tile_x;
+				if(image_x >= width) image_x = width - 1;
+				memcpy(&padded[tile_x * 3], &image[(image_x + image_y * width) * 3], 3);
+			}
+			row = padded;
+		}
+
+		size_t pair = tile_y & 0x1;
+		convert_row_avx2(row, yv[pair], cbv[pair], crv[pair]);
+
+		/* Left half of the row goes to the left block, right half to the right one */
+		short *y_row = &y[((tile_y >> 0x3) << 0x7) | ((tile_y & 0x7) << 0x3)];
+		__m256i shifted = _mm256_sub_epi16(yv[pair], level);
+		_mm_storeu_si128((__m128i*)y_row, _mm256_castsi256_si128(shifted));
+		_mm_storeu_si128((__m128i*)(y_row + 0x40), _mm256_extracti128_si256(shifted, 0x1));
+
+		/* 2v2 downsampling once both rows are converted, sums of horizontal pairs with the alternating bias */
+		if(pair)
+		{
+			__m256i cb_sum = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_add_epi16(cbv[0], cbv[1]), ones), bias), 0x2);
+			__m256i cr_sum = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_add_epi16(crv[0], crv[1]), ones), bias), 0x2);
+			__m256i packed = _mm256_sub_epi16(_mm256_permute4x64_epi64(_mm256_packs_epi32(cb_sum, cr_sum), 0xD8), level);
+			_mm_storeu_si128((__m128i*)(cb + ((tile_y >> 0x1) << 0x3)), _mm256_castsi256_si128(packed));
+			_mm_storeu_si128((__m128i*)(cr + ((tile_y >> 0x1) << 0x3)), _mm256_extracti128_si256(packed, 0x1));
+		}
+	}
+}
+#endif
+
+/**
+ * Encode the given image on the host instead of the device. The coefficients are
+ * written to the host planes in the same super block layout the kernels use,
+ * including the blocks exceeding the image. The rows of super blocks are split
+ * across the host threads.
+ *
+ * @param buffers the buffers, the host planes need to fit the image
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ */
+void JPEGEncoder::encode_on_host(encode_buffers_t& buffers, const unsigned char *image, size_t width, size_t height)
+{
+	this->run_host_threads((height + 0xF) >> 0x4, [&](size_t first, size_t last)
+	{
+		this->transform_rows(buffers, image, width, height, first, last);
+	});
+
+	/* The blocks below the image are filled like the fused kernel does */
+	buffers.bottom_fixed = true;
+}
+
+/**
+ * Compare the coefficients of the device in the given buffers with those
+ * computed on the host and report the first mismatching super block
+ *
+ * @param buffers the buffers holding the coefficients of the device
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @return the number of mismatching super blocks
+ */
+size_t JPEGEncoder::validate_coefficients(encode_buffers_t& buffers, const unsigned char *image, size_t width, size_t height)
+{
+	size_t nsbw = (width + 0xF) >> 0x4;
+	size_t super_blocks = nsbw * ((height + 0xF) >> 0x4);
+	size_t mismatches = 0;
+
+	/* Only the host planes of the reference are used */
+	encode_buffers_t reference;
+	reference.y.resize(super_blocks << 0x8);
+	reference.cb.resize(super_blocks << 0x6);
+	reference.cr.resize(super_blocks << 0x6);
+	reference.y_host = reference.y.data();
+	reference.cb_host = reference.cb.data();
+	reference.cr_host = reference.cr.data();
+	this->encode_on_host(reference, image, width, height);
+
+	/* The separate kernels leave the blocks below the image to the host */
+	this->fix_bottom_blocks(buffers, width, height);
+
+	for(size_t i = 0; i < super_blocks; ++i)
+	{
+		if(memcmp(&buffers.y_host[i << 0x8], &reference.y_host[i << 0x8], sizeof(short) * 0x100) == 0 &&
+		   memcmp(&buffers.cb_host[i << 0x6], &reference.cb_host[i << 0x6], sizeof(short) * 0x40) == 0 &&
+		   memcmp(&buffers.cr_host[i << 0x6], &reference.cr_host[i << 0x6], sizeof(short) * 0x40) == 0)
+			continue;
+		if(mismatches++ == 0)
+			fprintf(stderr, "The coefficients of super block %zu (%zu, %zu) differ between the device and the host\n", i, i % nsbw, i / nsbw);
+	}
+	if(mismatches > 0)
+		fprintf(stderr, "%zu of %zu super blocks differ\n", mismatches, super_blocks);
+	return mismatches;
+}
+
+/**
+ * Perform the color space transformation and the downsampling of the given image on the host.
+ * The planes receive the level shifted samples in the super block layout the downsample
+ * kernels produce. The rows of super blocks are split across the host threads.
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param y the luminance plane, 256 samples per super block
+ * @param cb the cb plane, 64 samples per super block
+ * @param cr the cr plane, 64 samples per super block
+ */
+void JPEGEncoder::color_transform(const unsigned char *image, size_t width, size_t height, short *y, short *cb, short *cr)
+{
+	this->run_host_threads((height + 0xF) >> 0x4, [&](size_t first, size_t last)
+	{
+		size_t nsbw = (width + 0xF) >> 0x4;
+		for(size_t super_block_y = first; super_block_y < last; ++super_block_y)
+		{
+			for(size_t super_block_x = 0; super_block_x < nsbw; ++super_block_x)
+			{
+				size_t super_block_id = super_block_y * nsbw + super_block_x;
+				this->convert_super_block(image, width, height, super_block_x, super_block_y,
+										  &y[super_block_id << 0x8], &cb[super_block_id << 0x6], &cr[super_block_id << 0x6]);
+			}
+		}
+	});
+}
+
+/**
+ * Split the given rows of super blocks into contiguous shares, one per host thread,
+ * and process them in parallel. Threads get at least HOST_THREAD_MCU_ROWS rows.
+ *
+ * @param rows the number of rows of super blocks
+ * @param work processes the rows from its first argument up to the second one
+ */
+void JPEGEncoder::run_host_threads(size_t rows, const std::function<void(size_t, size_t)>& work)
+{
+	size_t max_threads = (rows + HOST_THREAD_MCU_ROWS - 1) / HOST_THREAD_MCU_ROWS;
+	size_t threads = this->m_host_threads < max_threads ? this->m_host_threads : max_threads;
+	if(threads == 0)
+		threads = 1;
+
+	/* The super blocks do not depend on each other */
+	std::vector<std::thread> pool;
+	for(size_t i = 1; i < threads; ++i)
+		pool.emplace_back(work, rows * i / threads, rows * (i + 1) / threads);
+	work(0, rows / threads);
+	for(size_t i = 0; i < pool.size(); ++i)
+		pool[i].join();
+}
+
+/**
+ * Convert a super block into YCbCr and downsample it, with AVX2 if available
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param super_block_x the x position of the super block
+ * @param super_block_y the y position of the super block
+ * @param y receives the four level shifted luminance blocks
+ * @param cb receives the level shifted cb block
+ * @param cr receives the level shifted cr block
+ */
+void JPEGEncoder::convert_super_block(const unsigned char *image, size_t width, size_t height, size_t super_block_x, size_t super_block_y,
+									  short *y, short *cb, short *cr)
+{
+#ifdef HOST_X86
+	if(this->m_host_avx2)
+		convert_super_block_avx2(image, width, height, super_block_x, super_block_y, y, cb, cr);
+	else
+#endif
+	convert_super_block_lut(image, width, height, super_block_x, super_block_y, y, cb, cr);
+}
+
+/**
+ * Perform color space transformation, downsampling, DCT and quantification for
+ * the given rows of super blocks on the host, mirroring the fused kernel
+ *
+ * @param buffers the buffers, the host planes need to fit the image
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param first the first row of super blocks
+ * @param last the row of super blocks after the last one to process
+ */
+void JPEGEncoder::transform_rows(encode_buffers_t& buffers, const unsigned char *image, size_t width, size_t height, size_t first, size_t last)
+{
+	size_t nbw = (width + 0x7) >> 0x3;
+	size_t nbh = (height + 0x7) >> 0x3;
+	size_t nsbw = (width + 0xF) >> 0x4;
+
+	/* four luminance blocks, cb and cr */
+	short blocks[0x6][0x40];
+
+	for(size_t super_block_y = first; super_block_y < last; ++super_block_y)
+	{
+		for(size_t super_block_x = 0; super_block_x < nsbw; ++super_block_x)
+		{
+			size_t super_block_id = super_block_y * nsbw + super_block_x;
+
+			this->convert_super_block(image, width, height, super_block_x, super_block_y, blocks[0x0], blocks[0x4], blocks[0x5]);
+
+			/* DCT and quantification, luminance first, then chrominance */
+#ifdef HOST_X86
+			if(this->m_host_avx2)
+			{
+				dct_quant_blocks_avx2(blocks[0x0], blocks[0x1], this->m_fdct_divisors[0], this->m_fdct_divisors[0]);
+				dct_quant_blocks_avx2(blocks[0x2], blocks[0x3], this->m_fdct_divisors[0], this->m_fdct_divisors[0]);
+				dct_quant_blocks_avx2(blocks[0x4], blocks[0x5], this->m_fdct_divisors[1], this->m_fdct_divisors[1]);
+			}
+			else
+#endif
+			for(size_t i = 0; i < 0x6; ++i)
+				dct_quant_block(blocks[i], this->m_fdct_divisors[i < 0x4 ? 0 : 1]);
+
+			/* Fill the blocks outside of the image, those on the right get the dc value from their left
+			 * neighbor, those on the bottom the one of the top right block */
+			short *y = &buffers.y_host[super_block_id << 0x8];
+			bool pad_right = (super_block_x << 0x1) + 1 >= nbw;
+			bool pad_bottom = (super_block_y << 0x1) + 1 >= nbh;
+			for(size_t i = 0; i < 0x4; ++i)
+			{
+				if(pad_bottom && i >= 0x2)
+				{
+					memset(&y[i << 0x6], 0, sizeof(short) * 0x40);
+					y[i << 0x6] = blocks[pad_right ? 0x0 : 0x1][0];
+				}
+				else if(pad_right && (i & 0x1))
+				{
+					memset(&y[i << 0x6], 0, sizeof(short) * 0x40);
+					y[i << 0x6] = blocks[i - 1][0];
+				}
+				else
+					memcpy(&y[i << 0x6], blocks[i], sizeof(short) * 0x40);
+			}
+			memcpy(&buffers.cb_host[super_block_id << 0x6], blocks[0x4], sizeof(short) * 0x40);
+			memcpy(&buffers.cr_host[super_block_id << 0x6], blocks[0x5], sizeof(short) * 0x40);
+		}
+	}
+}
+}
@@ -0,0 +1,540 @@
+#include "../include/file_writer.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define WRITER_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace jpeg
+{
+
+/**
+ * Create a writer. io_uring is used if the kernel supports it, otherwise the
+ * writes are done on a thread of their own.
+ *
+ * @param direct flag whether to open the files with O_DIRECT, bypassing the page cache
+ * @param blocks the number of blocks in flight, writing waits once all are in flight
+ */
+FileWriter::FileWriter(bool direct, size_t blocks) :
+		m_in_flight(0),
+		m_max_in_flight(blocks > 0 ? blocks : 1),
+		m_open_files(0),
+		m_failed(0),
+		m_direct(direct),
+		m_ring_fd(-1),
+		m_ring_failed(false),
+		m_stop(false)
+{
+	/* Allocate the blocks in flight up front, blocks being filled are added on demand */
+	for(size_t i = 0; i < this->m_max_in_flight; ++i)
+	{
+		writer_request_t *block = this->acquire_block();
+		if(block != NULL)
+			this->m_free_blocks.push_back(block);
+	}
+
+	if(this->setup_ring(this->m_max_in_flight))
+		this->m_worker = std::thread(&FileWriter::reap_completions, this);
+	else
+		this->m_worker = std::thread(&FileWriter::write_requests, this);
+}
+
+/**
+ * Wait for all files to be written
+ */
+FileWriter::~FileWriter()
+{
+	this->wait();
+
+	/* Nothing is in flight anymore, so the worker waits for the lock and not in the ring */
+	std::unique_lock<std::mutex> lock(this->m_lock);
+	this->m_stop = true;
+	this->m_changed.notify_all();
+	lock.unlock();
+	this->m_worker.join();
+
+#ifdef WRITER_IO_URING
+	if(this->m_ring_fd >= 0)
+	{
+		munmap(this->m_sqes, this->m_sqes_size);
+		if(this->m_cq_ring != this->m_sq_ring)
+			munmap(this->m_cq_ring, this->m_cq_ring_size);
+		munmap(this->m_sq_ring, this->m_sq_ring_size);
+		::close(this->m_ring_fd);
+	}
+#endif
+
+	for(size_t i = 0; i < this->m_blocks.size(); ++i)
+		free(this->m_blocks[i].data);
+}
+
+/**
+ * Set up the io_uring instance
+ *
+ * @param entries the number of submission queue entries
+ * @return true on success
+ */
+bool FileWriter::setup_ring(unsigned int entries)
+{
+#ifdef WRITER_IO_URING
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if(fd < 0)
+		return false;
+
+	/* Map the submission and completion rings, a single mapping holds both on newer kernels */
+	this->m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	this->m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(this->m_cq_ring_size > this->m_sq_ring_size)
+			this->m_sq_ring_size = this->m_cq_ring_size;
+		this->m_cq_ring_size = this->m_sq_ring_size;
+	}
+
+	this->m_sq_ring = mmap(NULL, this->m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(this->m_sq_ring == MAP_FAILED)
+	{
+		::close(fd);
+		return false;
+	}
+
+	this->m_cq_ring = this->m_sq_ring;
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		this->m_cq_ring = mmap(NULL, this->m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if(this->m_cq_ring == MAP_FAILED)
+		{
+			munmap(this->m_sq_ring, this->m_sq_ring_size);
+			::close(fd);
+			return false;
+		}
+	}
+
+	this->m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	this->m_sqes = mmap(NULL, this->m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(this->m_sqes == MAP_FAILED)
+	{
+		if(this->m_cq_ring != this->m_sq_ring)
+			munmap(this->m_cq_ring, this->m_cq_ring_size);
+		munmap(this->m_sq_ring, this->m_sq_ring_size);
+		::close(fd);
+		return false;
+	}
+
+	char *sq = (char*)this->m_sq_ring;
+	char *cq = (char*)this->m_cq_ring;
+	this->m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	this->m_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	this->m_sq_array = (unsigned*)(sq + params.sq_off.array);
+	this->m_cq_head = (unsigned*)(cq + params.cq_off.head);
+	this->m_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	this->m_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	this->m_cqes = cq + params.cq_off.cqes;
+	this->m_ring_fd = fd;
+	return true;
+#else
+	(void)entries;
+	return false;
+#endif
+}
+
+/**
+ * Submit the given request, the lock needs to be held. If the ring does not take
+ * the request, all requests are written by the thread backend from then on.
+ *
+ * @param request the request to submit
+ */
+void FileWriter::submit(writer_request_t *request)
+{
+#ifdef WRITER_IO_URING
+	if(this->m_ring_fd >= 0 && !this->m_ring_failed)
+	{
+		/* There are never more requests in flight than entries, so the queue can not be full */
+		unsigned tail = *this->m_sq_tail;
+		unsigned index = tail & *this->m_sq_mask;
+		struct io_uring_sqe *sqe = &((struct io_uring_sqe*)this->m_sqes)[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = request->file->fd;
+		sqe->addr = (uint64_t)(uintptr_t)&request->iov;
+		sqe->len = 1;
+		sqe->off = request->offset;
+		sqe->user_data = (uint64_t)(uintptr_t)request;
+
+		this->m_sq_array[index] = index;
+		__atomic_store_n(this->m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		long submitted;
+		while((submitted = syscall(__NR_io_uring_enter, this->m_ring_fd, 1, 0, 0, NULL, 0)) < 0 && errno == EINTR)
+			;
+		if(submitted == 1)
+		{
+			this->m_ring_requests.push_back(request);
+			this->m_changed.notify_all();
+			return;
+		}
+
+		/* The kernel did not take the entry (EAGAIN, ENOMEM, EBUSY), take it back and
+		 * write with the thread backend once the requests in the ring completed */
+		__atomic_store_n(this->m_sq_tail, tail, __ATOMIC_RELEASE);
+		this->m_ring_failed = true;
+	}
+#endif
+
+	this->m_queue.push_back(request);
+	this->m_changed.notify_all();
+}
+
+/**
+ * Reap the completions of the io_uring instance until the writer is destroyed,
+ * continues as the thread backend if the ring failed
+ */
+void FileWriter::reap_completions()
+{
+#ifdef WRITER_IO_URING
+	for(;;)
+	{
+		/* Only wait in the kernel while requests are in the ring */
+		std::unique_lock<std::mutex> lock(this->m_lock);
+		this->m_changed.wait(lock, [this] { return this->m_stop || this->m_ring_failed || !this->m_ring_requests.empty(); });
+		if(this->m_ring_requests.empty())
+			break;
+		lock.unlock();
+
+		unsigned head = *this->m_cq_head;
+		if(head == __atomic_load_n(this->m_cq_tail, __ATOMIC_ACQUIRE))
+		{
+			if(syscall(__NR_io_uring_enter, this->m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+				this->fail_ring(errno);
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &((struct io_uring_cqe*)this->m_cqes)[head & *this->m_cq_mask];
+		writer_request_t *request = (writer_request_t*)(uintptr_t)cqe->user_data;
+		ssize_t result = cqe->res;
+		__atomic_store_n(this->m_cq_head, head + 1, __ATOMIC_RELEASE);
+		this->complete(request, result);
+	}
+#endif
+
+	this->write_requests();
+}
+
+/**
+ * Fail all requests in the ring after waiting for their completions failed
+ *
+ * @param error the error
+ */
+void FileWriter::fail_ring(int error)
+{
+	std::lock_guard<std::mutex> guard(this->m_lock);
+	fprintf(stderr, "Waiting for the writes failed: %s\n", strerror(error));
+	this->m_ring_failed = true;
+
+	std::vector<writer_request_t*> requests;
+	requests.swap(this->m_ring_requests);
+	for(size_t i = 0; i < requests.size(); ++i)
+		this->release(requests[i], -error);
+}
+
+/**
+ * Do the writes queued for the thread backend until the writer is destroyed
+ */
+void FileWriter::write_requests()
+{
+	std::unique_lock<std::mutex> lock(this->m_lock);
+	for(;;)
+	{
+		this->m_changed.wait(lock, [this] { return this->m_stop || !this->m_queue.empty(); });
+		if(this->m_queue.empty())
+			return;
+
+		writer_request_t *request = this->m_queue.front();
+		this->m_queue.pop_front();
+		lock.unlock();
+
+		ssize_t result = pwrite(request->file->fd, request->iov.iov_base, request->iov.iov_len, request->offset);
+		if(result < 0)
+			result = -errno;
+		this->complete(request, result);
+
+		lock.lock();
+	}
+}
+
+/**
+ * Handle the completion of the given request
+ *
+ * @param request the request
+ * @param result the number of bytes written or the negated error
+ */
+void FileWriter::complete(writer_request_t *request, ssize_t result)
+{
+	std::lock_guard<std::mutex> guard(this->m_lock);
+
+	/* The request left the ring */
+	std::vector<writer_request_t*>::iterator it = std::find(this->m_ring_requests.begin(), this->m_ring_requests.end(), request);
+	if(it != this->m_ring_requests.end())
+		this->m_ring_requests.erase(it);
+
+	/* O_DIRECT needs aligned addresses and offsets, so only the aligned part of a short write
+	 * is skipped, the retry then reports the actual error such as ENOSPC */
+	if(request->file->direct && result > 0 && (size_t)result < request->iov.iov_len)
+	{
+		result &= ~(ssize_t)(WRITER_ALIGNMENT - 1);
+		if(result == 0)
+			result = -EIO;
+	}
+
+	/* Resubmit the rest of a short write */
+	if(result > 0 && (size_t)result < request->iov.iov_len)
+	{
+		request->iov.iov_base = (char*)request->iov.iov_base + result;
+		request->iov.iov_len -= result;
+		request->offset += result;
+		this->submit(request);
+		return;
+	}
+
+	if(result == -EINTR || result == -EAGAIN)
+	{
+		this->submit(request);
+		return;
+	}
+
+	this->release(request, result);
+}
+
+/**
+ * Return the block of the given finished request, the lock needs to be held
+ *
+ * @param request the request
+ * @param result the number of bytes written or the negated error
+ */
+void FileWriter::release(writer_request_t *request, ssize_t result)
+{
+	writer_file_t *file = request->file;
+
+	if(result <= 0 && file->error == 0)
+		file->error = result < 0 ? (int)-result : EIO;
+
+	this->m_free_blocks.push_back(request);
+	this->m_in_flight--;
+	file->pending--;
+	if(file->closed && file->pending == 0)
+		this->finish_file(file);
+	this->m_changed.notify_all();
+}
+
+/**
+ * Close the given file once all its blocks are written, the lock needs to be held
+ *
+ * @param file the file
+ */
+void FileWriter::finish_file(writer_file_t *file)
+{
+	/* Cut off the padding of the last block */
+	if(file->direct && file->error == 0 && ftruncate(file->fd, file->size) != 0)
+		file->error = errno;
+	if(::close(file->fd) != 0 && file->error == 0)
+		file->error = errno;
+
+	if(file->error != 0)
+	{
+		fprintf(stderr, "Writing the file \'%s\' failed: %s\n", file->name, strerror(file->error));
+		this->m_failed++;
+	}
+
+	free(file->name);
+	delete file;
+	this->m_open_files--;
+	this->m_changed.notify_all();
+}
+
+/**
+ * Open the given file for writing
+ *
+ * @param file the path of the file
+ * @return the file, NULL if it could not be opened
+ */
+writer_file_t *FileWriter::open(const char * const file)
+{
+	int fd = -1;
+	bool direct = false;
+
+#ifdef O_DIRECT
+	/* Not all file systems support O_DIRECT, fall back to the page cache then */
+	if(this->m_direct)
+	{
+		fd = ::open(file, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+		direct = fd >= 0;
+	}
+#endif
+	if(fd < 0)
+		fd = ::open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0)
+		return NULL;
+
+	writer_file_t *handle = new writer_file_t;
+	handle->fd = fd;
+	handle->name = strdup(file);
+	handle->direct = direct;
+	handle->block = NULL;
+	handle->fill = 0;
+	handle->size = 0;
+	handle->pending = 0;
+	handle->closed = false;
+	handle->error = 0;
+
+	std::lock_guard<std::mutex> guard(this->m_lock);
+	this->m_open_files++;
+	return handle;
+}
+
+/**
+ * Get a free block, a new one is allocated if none is free
+ *
+ * @return the block, NULL if no memory is left
+ */
+writer_request_t *FileWriter::acquire_block(void)
+{
+	if(!this->m_free_blocks.empty())
+	{
+		writer_request_t *block = this->m_free_blocks.back();
+		this->m_free_blocks.pop_back();
+		return block;
+	}
+
+	void *data = NULL;
+	if(posix_memalign(&data, WRITER_ALIGNMENT, WRITER_BLOCK_SIZE) != 0)
+		return NULL;
+	this->m_blocks.push_back(writer_request_t());
+	this->m_blocks.back().data = (char*)data;
+	return &this->m_blocks.back();
+}
+
+/**
+ * Submit the block currently filled of the given file
+ *
+ * @param file the file
+ * @param length the number of bytes to write
+ */
+void FileWriter::submit_block(writer_file_t *file, size_t length)
+{
+	writer_request_t *request = file->block;
+	request->file = file;
+	request->iov.iov_base = request->data;
+	request->iov.iov_len = length;
+	request->offset = file->size - file->fill;
+
+	file->block = NULL;
+	file->fill = 0;
+
+	/* Wait for a block to be written if all are in flight */
+	std::unique_lock<std::mutex> lock(this->m_lock);
+	this->m_changed.wait(lock, [this] { return this->m_in_flight < this->m_max_in_flight; });
+	this->m_in_flight++;
+	file->pending++;
+	this->submit(request);
+}
+
+/**
+ * Append to the given file, full blocks are submitted right away
+ *
+ * @param file the file
+ * @param data the bytes to append
+ * @param size the number of bytes
+ * @return 0 on success, the error of a previous write otherwise
+ */
+int FileWriter::write(writer_file_t *file, const char *data, size_t size)
+{
+	while(size > 0)
+	{
+		if(file->block == NULL)
+		{
+			std::lock_guard<std::mutex> guard(this->m_lock);
+			file->block = this->acquire_block();
+			if(file->block == NULL)
+				return ENOMEM;
+		}
+
+		size_t n = WRITER_BLOCK_SIZE - file->fill;
+		if(n > size)
+			n = size;
+		memcpy(file->block->data + file->fill, data, n);
+		file->fill += n;
+		file->size += n;
+		data += n;
+		size -= n;
+
+		if(file->fill == WRITER_BLOCK_SIZE)
+			this->submit_block(file, WRITER_BLOCK_SIZE);
+	}
+
+	std::lock_guard<std::mutex> guard(this->m_lock);
+	return file->error;
+}
+
+/**
+ * Submit the rest of the given file, it is closed once all blocks are written.
+ * The file must not be used afterwards.
+ *
+ * @param file the file
+ */
+void FileWriter::close(writer_file_t *file)
+{
+	/* O_DIRECT only writes whole aligned blocks, the padding is truncated afterwards */
+	if(file->block != NULL)
+	{
+		size_t length = file->fill;
+		if(file->direct)
+		{
+			length = (length + WRITER_ALIGNMENT - 1) & ~(size_t)(WRITER_ALIGNMENT - 1);
+			memset(file->block->data + file->fill, 0, length - file->fill);
+		}
+		this->submit_block(file, length);
+	}
+
+	std::lock_guard<std::mutex> guard(this->m_lock);
+	file->closed = true;
+	if(file->pending == 0)
+		this->finish_file(file);
+}
+
+/**
+ * Wait for all open files to be closed and written
+ *
+ * @return 0 if all files were written, 1 if a write failed
+ */
+int FileWriter::wait(void)
+{
+	std::unique_lock<std::mutex> lock(this->m_lock);
+	this->m_changed.wait(lock, [this] { return this->m_open_files == 0; });
+	int ret = this->m_failed > 0 ? 0x1 : 0x0;
+	this->m_failed = 0;
+	return ret;
+}
+
+/**
+ * Get whether io_uring is used
+ *
+ * @return true if io_uring is used, false for the thread backend
+ */
+bool FileWriter::uses_io_uring(void) const
+{
+	return this->m_ring_fd >= 0;
+}
+}
@@ -1,981 +1,3144 @@
-#include "../include/jpeg_encoder.hpp"
-
-namespace jpeg
-{
-
-#define SCALEBITS 0x10
-#define FIX(x)          ((unsigned int) ((x) * (1L<<SCALEBITS) + 0.5))
-#define ONE_HALF        ((unsigned int) 1 << (SCALEBITS-1))
-#define CBCR_OFFSET     ((unsigned int) 0x80 << SCALEBITS)
-
-/**
- * Push back the given the value to the output buffer (single byte only)
- *
- * @param output_buf the buffer
- * @param value the value
- */
-static void write_byte(std::vector<char>& output_buf, int value)
-{
-	output_buf.push_back((char)value);
-}
-
-/**
- * Write two bytes to the output buffer by splitting it and writing those two bytes
- * seperately
- *
- * @param output_buf the buffer
- * @param value the value
- */
-static void write_2byte(std::vector<char>& output_buf, int value)
-{
-	write_byte(output_buf, (value >> 0x8) & 0xFF);
-	write_byte(output_buf, value & 0xFF);
-}
-
-/**
- * Export a JPEG marker
- *
- * @param output_buf the buffer
- * @param value the marker
- */
-static void write_marker(std::vector<char>& output_buf, int value)
-{
-	write_byte(output_buf, 0xFF);
-	write_byte(output_buf, value);
-}
-
-/**
- * Compute the reciprocal for the divisor and save in the given table
- * the reciprocal, length and shift values
- * Taken from: https://github.com/libjpeg-turbo/libjpeg-turbo/
- *
- * @param divisor the divisor
- * @param dtbl table to store
- */
-static int compute_reciprocal (unsigned short divisor, short *dtbl)
-{
-	unsigned int fq, fr;
-	unsigned short c;
-	int b, r;
-
-	if (divisor == 1)
-	{
-		dtbl[0x40 * 0] = (short) 1;						/* reciprocal */
-		dtbl[0x40 * 1] = (short) 0;						/* correction */
-		dtbl[0x40 * 2] = (short) 1;						/* scale */
-		dtbl[0x40 * 3] = -(short) (sizeof(short) * 8);	/* shift */
-		return 0;
-	}
-
-	b = nbits_table[divisor] - 1;
-	r = sizeof(short) * 8 + b;
-
-	fq = ((unsigned int)1 << r) / divisor;
-	fr = ((unsigned int)1 << r) % divisor;
-
-	c = divisor >> 0x1;
-
-	if (fr == 0)
-	{
-		fq >>= 1;
-		r--;
-	}
-	else if (fr <= (divisor / 2U))
-	{
-		c++;
-	}
-	else
-	{
-		fq++;
-	}
-
-	dtbl[0x40 * 0] = (short) fq;
-	dtbl[0x40 * 1] = (short) c;
-	dtbl[0x40 * 2] = (short) (1 << (sizeof(short)*8*2 - r));
-	dtbl[0x40 * 3] = (short) r - sizeof(short)*8;
-
-	return r <= 16 ? 0 : 1;
-}
-
-/**
- * Build the program from the given file
- *
- * @param context the OpenCL context to build the program in
- * @param device the device to build for
- * @param file the kernel file
- * @return the created program
- */
-static cl::Program build_from_file(cl::Context &context, cl::Device &device, const char* const file)
-{
-	std::ifstream t(file);
-	std::string str;
-
-	t.seekg(0, std::ios::end);
-	str.reserve(t.tellg());
-	t.seekg(0, std::ios::beg);
-
-	str.assign((std::istreambuf_iterator<char>(t)),
-	            std::istreambuf_iterator<char>());
-	cl::Program ret(context, str);
-	ret.build({device});
-	return ret;
-}
-
-/**
- * Create a new encoder
- *
- * @param type the device type to use
- * @param quality the quality setting to use (clamped between 1 and 100)
- */
-JPEGEncoder::JPEGEncoder(cl_device_type type, unsigned char quality) :
-		m_context(type),
-		m_device(m_context.getInfo<CL_CONTEXT_DEVICES>()[0]),
-		m_queue(m_context, m_device, CL_QUEUE_PROFILING_ENABLE),
-		m_program(build_from_file(m_context, m_device, "kernel/jpeg-encoder.cl")),
-		md_color_conversion_table(m_context, CL_MEM_READ_ONLY, sizeof(color_conversion_table)),
-		md_fdct_divisors(m_context, CL_MEM_READ_ONLY, sizeof(m_fdct_divisors)),
-		md_fdct_multiplier(m_context, CL_MEM_READ_ONLY, sizeof(MULTIPLIER)),
-		md_fdct_sign(m_context, CL_MEM_READ_ONLY, sizeof(SIGN)),
-		md_fdct_indices(m_context, CL_MEM_READ_ONLY, sizeof(INDICES)),
-		md_fdct_descaler(m_context, CL_MEM_READ_ONLY, sizeof(DESCALER)),
-		md_fdct_descaler_offset(m_context, CL_MEM_READ_ONLY, sizeof(DESCALER_OFFSET))
-{
-	this->create_encoder(quality);
-	this->prepare_device();
-}
-
-/**
- * Prepare the device, create kernels and write conversion table and divisor table to device
- */
-void JPEGEncoder::prepare_device(void)
-{
-	/* copy tables to device */
-	this->m_queue.enqueueWriteBuffer(this->md_color_conversion_table, false, 0, sizeof(color_conversion_table), color_conversion_table);
-	this->m_queue.enqueueWriteBuffer(this->md_fdct_divisors, false, 0, sizeof(m_fdct_divisors), &this->m_fdct_divisors);
-	this->m_queue.enqueueWriteBuffer(this->md_fdct_multiplier, false, 0, sizeof(MULTIPLIER), &MULTIPLIER);
-	this->m_queue.enqueueWriteBuffer(this->md_fdct_sign, false, 0, sizeof(SIGN), &SIGN);
-	this->m_queue.enqueueWriteBuffer(this->md_fdct_indices, false, 0, sizeof(INDICES), &INDICES);
-	this->m_queue.enqueueWriteBuffer(this->md_fdct_descaler, false, 0, sizeof(DESCALER), &DESCALER);
-	this->m_queue.enqueueWriteBuffer(this->md_fdct_descaler_offset, false, 0, sizeof(DESCALER_OFFSET), &DESCALER_OFFSET);
-
-	/* create kernels */
-	this->m_transformation_kernel = cl::Kernel(this->m_program, "color_space_transform");
-	this->m_downsample_full_kernel = cl::Kernel(this->m_program, "downsample_full");
-	this->m_downsample_2v2_kernel = cl::Kernel(this->m_program, "downsample_2v2");
-	this->m_dct_quant = cl::Kernel(this->m_program, "dct_quant");
-	this->m_zero_out_right = cl::Kernel(this->m_program, "zero_out_right");
-	this->m_zero_out_bottom = cl::Kernel(this->m_program, "zero_out_bottom");
-}
-
-/**
- * Encode the given image
- *
- * @param image pointer to the image data in flat row major layout
- * @param width of the image
- * @param height of the image
- * @param file the output file to store the image at
- * @return 0 on success
- */
-int JPEGEncoder::encode_image(unsigned char *image, size_t width, size_t height, const char * const file)
-{
-	size_t wg;
-	std::vector<char> output_buffer;
-	FILE *fp;
-
-	/* Make sure the image pointer is valid */
-	if(image == NULL)
-	{
-		fprintf(stderr, "Image data needs to be provided\n");
-		return 0x2;
-	}
-
-	/* Validate file handler */
-	fp = fopen(file, "wb");
-	if(fp == NULL)
-	{
-		fprintf(stderr, "The file \'%s\' could not be opened, aborting compressing\n", file);
-		return 0x1;
-	}
-
-	/* Write the file, frame and scan header to the output buffer */
-	this->write_file_header(output_buffer);
-	this->write_frame_header(output_buffer, width, height);
-	this->write_scan_header(output_buffer);
-
-	//
-	// Color Space Transformation
-	//
-	/* Initialize image buffer */
-	cl::Buffer image_buffer(this->m_context, CL_MEM_READ_WRITE, sizeof(unsigned char) * 3 * width * height);
-	this->m_queue.enqueueWriteBuffer(image_buffer, true, 0, sizeof(unsigned char) * 3 * width * height, image);
-
-	/* Set arguments */
-	this->m_transformation_kernel.setArg<cl::Buffer>(0, this->md_color_conversion_table);
-	this->m_transformation_kernel.setArg<cl::Buffer>(1, image_buffer);
-	this->m_transformation_kernel.setArg<cl_uint>(2, (cl_uint)(width * height));
-
-	/* Compute work group size to be the closest bigger multiple of 64 to the number of pixels in the image */
-	wg = (((width * height) + 0x3F) >> 0x6) << 0x6;
-	this->m_queue.enqueueNDRangeKernel(this->m_transformation_kernel, 0, wg, 0x40);
-
-
-	//
-	// Downsampling
-	//
-	/* Do the downsampling for the y channel
-	 * This does a full downsample, which means keeping all the pixels we already have
-	 * For future processing the downsampling splits the image, which is currently in flat
-	 * row layout into super blocks containing of 4 sub blocks each which represent a full
-	 * MCU block
-	 *
-	 * Where each rx is a row and each ax/bx/.../zx is a super block
-	 * 										+---------
-	 *										| a1 a2 a3 ...
-	 *	[r1.....][r2.....]....[rn.....] =>	| b1 b2 b3 ...
-	 *										..............
-	 *										| z1 z2 z3 ...
-	 *										+---------			The super block is stored in
-	 *											|				in flat layout hierarchy
-	 *											v
-	 *						[a1 a2 a3...][b1 b2 b3...]...[z1 z2 z3...]
-	 *
-	 * [0][1][2][3]
-	 *	   ^
-	 *	   |
-	 *  +-----+		Each superblock contains 4 sub blocks which are
-	 *	| 0 1 |		are ordered as displayed, where each of the four
-	 *	| 2 3 |		sub blocks represents a full MCU block
-	 *	+-----+		the are stored in a flat layout in memory
-	 */
-
-	/* Compute the number of blocks in x and y direction */
-	cl_uint nbw = (width + 0x7) >> 0x3;
-	cl_uint nbh = (height + 0x7) >> 0x3;
-
-	/* Compute the number of super blocks in x and y direction */
-	cl_uint nsbw = (width + 0xF) >> 0x4;
-	cl_uint nsbh = (height + 0xF) >> 0x4;
-
-	/* Compute work group size */
-	wg = (nsbw * nsbh) << 0x8;
-
-	/* Initialize the block buffer */
-	cl::Buffer y_block_buffer(this->m_context, CL_MEM_READ_WRITE, wg * sizeof(cl_short));
-
-	/* Set the kernel arguments */
-	this->m_downsample_full_kernel.setArg<cl::Buffer>(0, y_block_buffer);
-	this->m_downsample_full_kernel.setArg<cl::Buffer>(1, image_buffer);
-	this->m_downsample_full_kernel.setArg<cl_uint>(2, nsbw);
-	this->m_downsample_full_kernel.setArg<cl_uint>(3, nbw);
-	this->m_downsample_full_kernel.setArg<cl_uint>(4, nbh);
-	this->m_downsample_full_kernel.setArg<cl_uint>(5, (cl_uint)width);
-	this->m_downsample_full_kernel.setArg<cl_uint>(6, (cl_uint)height);
-
-	/* Execute kernel */
-	this->m_queue.enqueueNDRangeKernel(this->m_downsample_full_kernel, 0, wg, 0x40);
-
-
-	/* Downsample Cb/Cr Channels */
-	/* The number of blocks and super blocks stays the same,
-	 * since we do a 2:2 downsample only a fourth of the number
-	 * of original items are stored. */
-	wg = (nsbw * nsbh) << 0x6;
-
-	/* Create buffer for the cb and cr channels */
-	cl::Buffer cb_block_buffer(this->m_context, CL_MEM_READ_WRITE, wg * sizeof(cl_short));
-	cl::Buffer cr_block_buffer(this->m_context, CL_MEM_READ_WRITE, wg * sizeof(cl_short));
-
-	/* Set the kernel arguments */
-	this->m_downsample_2v2_kernel.setArg<cl::Buffer>(0, cb_block_buffer);
-	this->m_downsample_2v2_kernel.setArg<cl::Buffer>(1, cr_block_buffer);
-	this->m_downsample_2v2_kernel.setArg<cl::Buffer>(2, image_buffer);
-	this->m_downsample_2v2_kernel.setArg<cl_uint>(3, nsbw);
-	this->m_downsample_2v2_kernel.setArg<cl_uint>(4, nbw);
-	this->m_downsample_2v2_kernel.setArg<cl_uint>(5, nbh);
-	this->m_downsample_2v2_kernel.setArg<cl_uint>(6, (cl_uint) width);
-	this->m_downsample_2v2_kernel.setArg<cl_uint>(7, (cl_uint) height);
-
-	/* Execute the kernel */
-	this->m_queue.enqueueNDRangeKernel(this->m_downsample_2v2_kernel, 0, wg, 0x40);
-
-	//
-	// DCT and Quantification
-	//
-	/* Prepare and execute kernel for y channel */
-	wg = (nsbw * nsbh) << 0x8;
-	this->m_dct_quant.setArg<cl::Buffer>(0, y_block_buffer);
-	this->m_dct_quant.setArg<cl::Buffer>(1, this->md_fdct_divisors);
-	this->m_dct_quant.setArg<cl_uint>(2, 0);
-	this->m_dct_quant.setArg<cl::Buffer>(3, this->md_fdct_multiplier);
-	this->m_dct_quant.setArg<cl::Buffer>(4, this->md_fdct_sign);
-	this->m_dct_quant.setArg<cl::Buffer>(5, this->md_fdct_indices);
-	this->m_dct_quant.setArg<cl::Buffer>(6, this->md_fdct_descaler);
-	this->m_dct_quant.setArg<cl::Buffer>(7, this->md_fdct_descaler_offset);
-	this->m_queue.enqueueNDRangeKernel(this->m_dct_quant, 0x0, wg, 0x40);
-
-	/* Prepare and execute kernel for cb channel */
-	wg = (nsbw * nsbh) << 0x6;
-	this->m_dct_quant.setArg<cl::Buffer>(0, cb_block_buffer);
-	this->m_dct_quant.setArg<cl::Buffer>(1, this->md_fdct_divisors);
-	this->m_dct_quant.setArg<cl_uint>(2, 0x100);
-	this->m_dct_quant.setArg<cl::Buffer>(3, this->md_fdct_multiplier);
-	this->m_dct_quant.setArg<cl::Buffer>(4, this->md_fdct_sign);
-	this->m_dct_quant.setArg<cl::Buffer>(5, this->md_fdct_indices);
-	this->m_dct_quant.setArg<cl::Buffer>(6, this->md_fdct_descaler);
-	this->m_dct_quant.setArg<cl::Buffer>(7, this->md_fdct_descaler_offset);
-	this->m_queue.enqueueNDRangeKernel(this->m_dct_quant, 0x0, wg, 0x40);
-
-	/* Prepare and execute kernel for cr channel */
-	this->m_dct_quant.setArg<cl::Buffer>(0, cr_block_buffer);
-	this->m_dct_quant.setArg<cl::Buffer>(1, this->md_fdct_divisors);
-	this->m_dct_quant.setArg<cl_uint>(2, 0x100);
-	this->m_dct_quant.setArg<cl::Buffer>(3, this->md_fdct_multiplier);
-	this->m_dct_quant.setArg<cl::Buffer>(4, this->md_fdct_sign);
-	this->m_dct_quant.setArg<cl::Buffer>(5, this->md_fdct_indices);
-	this->m_dct_quant.setArg<cl::Buffer>(6, this->md_fdct_descaler);
-	this->m_dct_quant.setArg<cl::Buffer>(7, this->md_fdct_descaler_offset);
-	this->m_queue.enqueueNDRangeKernel(this->m_dct_quant, 0x0, wg, 0x40);
-
-	/* Zero out unused blocks on the right side */
-	wg = (nbh << 0x6);
-	this->m_zero_out_right.setArg<cl::Buffer>(0, y_block_buffer);
-	this->m_zero_out_right.setArg<cl_uint>(1, (cl_uint)nsbw);
-	this->m_zero_out_right.setArg<cl_uint>(2, (cl_uint)nsbh);
-	this->m_zero_out_right.setArg<cl_uint>(3, (cl_uint)nbw);
-	this->m_queue.enqueueNDRangeKernel(this->m_zero_out_right, 0, wg, 0x40);
-
-	/* Zero out unsued blocks on the bottom of the image */
-	wg = (nsbw << 0x7);
-	this->m_zero_out_bottom.setArg<cl::Buffer>(0, y_block_buffer);
-	this->m_zero_out_bottom.setArg<cl_uint>(1, (cl_uint)nsbw);
-	this->m_zero_out_bottom.setArg<cl_uint>(2, (cl_uint)nsbh);
-	this->m_zero_out_bottom.setArg<cl_uint>(3, (cl_uint)nbh);
-	this->m_queue.enqueueNDRangeKernel(this->m_zero_out_bottom, 0, wg, 0x80);
-
-	/* Copy result back to host to perform entropy on host device */
-	short *y_buffer = (short*)malloc(sizeof(short) * (nsbw * nsbh) << 0x8);
-	short *cb_buffer = (short*)malloc(sizeof(short) * (nsbw * nsbh) << 0x6);
-	short *cr_buffer = (short*)malloc(sizeof(short) * (nsbw * nsbh) << 0x6);
-	this->m_queue.enqueueReadBuffer(y_block_buffer, true, 0, sizeof(short) * (nsbw * nsbh) << 0x8, y_buffer);
-	this->m_queue.enqueueReadBuffer(cb_block_buffer, true, 0, sizeof(short) * (nsbw * nsbh) << 0x6, cb_buffer);
-	this->m_queue.enqueueReadBuffer(cr_block_buffer, true, 0, sizeof(short) * (nsbw * nsbh) << 0x6, cr_buffer);
-
-	/* For convenient access, cast to 3D/2D arrays */
-	short (*y_blocks)[0x4][0x40] = (short (*)[0x4][0x40])y_buffer;
-	short (*cb_blocks)[0x40] = (short (*)[0x40])cb_buffer;
-	short (*cr_blocks)[0x40] = (short (*)[0x40])cr_buffer;
-
-	/* As mentioned in the kernel code we can not the field zero values in the kernel
-	 * since neighboring blocks are processed concurrently.
-	 * Since the entropy encoding is performed on the host the data needs to be copied
-	 * anyways, so setting these values on the host does not introduce an extra
-	 * copy operation */
-	size_t super_block_y = nsbh - 1;
-	size_t super_block_id_base = (super_block_y * nsbw);
-	for(size_t gx = 0; gx < nsbw; ++gx)
-	{
-		if ((super_block_y << 0x1) + 1 >= nbh) {
-			size_t super_block_x = gx;
-			size_t super_block_id = super_block_id_base + super_block_x;
-			short value = y_blocks[super_block_id][1][0];
-			y_blocks[super_block_id][2][0] = value;
-			y_blocks[super_block_id][3][0] = value;
-		}
-	}
-
-	//
-	// Entropy coding
-	//
-	wg = (nsbw * nsbh);		/* number of super blocks */
-	short *mcu_buffer[0x6];
-	entropy_state_t state;
-	memset(state.last_dc_val, 0, sizeof(state.last_dc_val));
-	state.bits = 0;
-	for(size_t i = 0; i < wg; ++i)
-	{
-		/* Perform entropy encoding on each block */
-		mcu_buffer[0] = y_blocks[i][0];
-		mcu_buffer[1] = y_blocks[i][1];
-		mcu_buffer[2] = y_blocks[i][2];
-		mcu_buffer[3] = y_blocks[i][3];
-		mcu_buffer[4] = cb_blocks[i];
-		mcu_buffer[5] = cr_blocks[i];
-		this->encode_entropy(mcu_buffer, output_buffer, state);
-	}
-
-
-	/* Flush Entropy */
-	size_t bits = state.bits;
-	size_t buffer = state.buffer;
-	bits += 7;
-	buffer = (buffer << 0x7) | 0x7F;
-	while(bits > 0x7)
-	{
-		bits -= 0x8;
-		unsigned char c = (unsigned char)(buffer >> bits);
-		output_buffer.push_back(c);
-		if(c == 0xFF)
-			output_buffer.push_back(c);
-	}
-
-	/* Write the file tailor to the output buffer */
-	write_marker(output_buffer, 0xD9);
-
-	/* write the content to file */
-	(void)fwrite(output_buffer.data(), sizeof(char),  output_buffer.size(), fp);
-	fclose(fp);
-
-	/* Release allocated memory */
-	free(y_buffer);
-	free(cb_buffer);
-	free(cr_buffer);
-
-	return 0x0;
-}
-
-/**
- * Write the file header
- *
- * @param output_buf the output buffer to use
- */
-void JPEGEncoder::write_file_header(std::vector<char>& output)
-{
-	static unsigned char headMagic[] = {0xFF, 0xD8, 0xFF, 0xE0};
-	static unsigned char jfifApp0[] = {0x00, 0x10, 'J', 'F', 'I', 'F', 0x0, 0x1, 0x1, 0x0, 0x0, 0x1, 0x0, 0x1, 0x0, 0x0};
-
-	/* Copy the head to the output buffer */
-	for(size_t i = 0; i < 0x4; ++i)
-	{
-		output.push_back(headMagic[i]);
-	}
-
-	/* Copy the jfif app0 marker to the output buffer */
-	for(size_t i = 0; i < 0x10; ++i)
-	{
-		output.push_back(jfifApp0[i]);
-	}
-}
-
-/**
- * Write the frame header containing the quantification tables used
- *
- * @param output_buf the output buffer
- * @param w the width of the image
- * @param h the height of the image
- */
-void JPEGEncoder::write_frame_header(std::vector<char>& output_buf, size_t w, size_t h)
-{
-	write_quant_table(output_buf, 0);	/* Y Channel */
-	write_quant_table(output_buf, 1);	/* Cb/Cr Channel */
-	write_sof(output_buf, w, h);
-}
-
-/**
- * Export the quantification table
- *
- * @param output_buf the output buffer
- * @param index the index of the quantification table
- */
-void JPEGEncoder::write_quant_table(std::vector<char>& output_buf, int index)
-{
-	quantification_table_t *qtblptr;
-	size_t i;
-	qtblptr = &this->m_quant_tbls[index];
-
-	write_marker(output_buf, 0xDB);
-	write_2byte(output_buf, 0x40 + 1 + 2);
-	write_byte(output_buf, index);
-	for(i = 0; i < 0x40; ++i)
-	{
-		unsigned int qval = qtblptr->value[jpeg_natural_order[i]];
-		write_byte(output_buf, (int)(qval & 0xFF));
-	}
-}
-
-
-/**
- * Export the huffman tables
- *
- * @param output_buf the output buffer
- * @param index the index of the quantification table
- * @param is_ac flag, true if ac table shall be exported, false if dc
- */
-void JPEGEncoder::write_huffman_table(std::vector<char>& output_buf, int index, unsigned char is_ac)
-{
-	huffman_table_t *htblptr;
-	size_t length, i;
-
-	if(is_ac) {
-		htblptr = &this->m_ac_huff_tbls[index];
-		index += 0x10;
-	} else {
-		htblptr = &this->m_dc_huff_tbls[index];
-	}
-
-	write_marker(output_buf, 0xC4);
-	length = 0;
-	for(i = 1; i < 0x11; ++i)
-		length += htblptr->bits[i];
-
-	/* Write section header containing number of bytes the secion contains */
-	write_2byte(output_buf, length + 2 + 1 + 0x10);
-
-	/* output the number of bytes consisting of the index, the bits and the values */
-	write_byte(output_buf, index);
-	for(i = 1; i < 0x11; ++i)
-		write_byte(output_buf, htblptr->bits[i]);
-	for(i = 0; i < length; ++i)
-		write_byte(output_buf, htblptr->value[i]);
-}
-
-
-/**
- * Write the sos marker
- *
- * @param output_buf the output buffer to use
- */
-void JPEGEncoder::write_sos(std::vector<char>& output_buf)
-{
-	write_marker(output_buf, 0xDA);
-	write_2byte(output_buf, 2 * 0x3 + 2 + 1 + 3);
-	write_byte(output_buf, 0x3);			/* number of components */
-
-	/* Y Channel */
-	write_byte(output_buf, 1);				/* component id */
-	write_byte(output_buf, (0 << 0x4) + 0);	/* ( dc_tbl_no << 0x4 ) + ac_tbl_no */
-
-	/* Cb Channel */
-	write_byte(output_buf, 2);				/* component id */
-	write_byte(output_buf, (1 << 0x4) + 1);	/* ( dc_tbl_no << 0x4 ) + ac_tbl_no */
-
-	/* Cr Channel */
-	write_byte(output_buf, 3);				/* component id */
-	write_byte(output_buf, (1 << 0x4) + 1);	/* ( dc_tbl_no << 0x4 ) + ac_tbl_no */
-
-	/* End of sos section */
-	write_byte(output_buf, 0);
-	write_byte(output_buf, 0x3F);
-	write_byte(output_buf, 0);
-}
-
-/**
- * Write the scan header containing the huffman tables
- *
- * @param output_buf the output buffer to use
- */
-void JPEGEncoder::write_scan_header(std::vector<char>& output_buf)
-{
-	/* Y Channel */
-	this->write_huffman_table(output_buf, 0, 0);
-	this->write_huffman_table(output_buf, 0, 1);
-
-	/* Cb / Cr Channel */
-	this->write_huffman_table(output_buf, 1, 0);
-	this->write_huffman_table(output_buf, 1, 1);
-
-	/* Write sos marker */
-	this->write_sos(output_buf);
-}
-
-/**
- * Write the SOF Part containing the sampling parameters and image size
- *
- * @param output_buf the output buffer to use
- * @param w image width
- * @param h image height
- */
-void JPEGEncoder::write_sof(std::vector<char>& output_buf, size_t w, size_t h)
-{
-	write_marker(output_buf, 0xC0);
-	write_2byte(output_buf, 3 * 0x3 + 2 + 5 + 1);
-	write_byte(output_buf, 0x8);
-	write_2byte(output_buf, h);
-	write_2byte(output_buf, w);
-	write_byte(output_buf, 0x3);
-
-	/* Y Channel */
-	write_byte(output_buf, 0x1);
-	write_byte(output_buf, (0x2 << 4) + 0x2);
-	write_byte(output_buf, 0);
-
-	/* Cb Channel */
-	write_byte(output_buf, 0x2);
-	write_byte(output_buf, (0x1 << 4) + 0x1);
-	write_byte(output_buf, 1);
-
-	/* Cr Channel */
-	write_byte(output_buf, 0x3);
-	write_byte(output_buf, (0x1 << 4) + 0x1);
-	write_byte(output_buf, 1);
-}
-
-/*
- *  NOTE: this algorithm is part of the libjpeg-turbo project
- *  https://github.com/libjpeg-turbo/libjpeg-turbo/
- */
-#define EMIT_BYTE() { \
-	unsigned char c; \
-	put_bits -= 8; \
-	c = (unsigned char)(put_buffer >> put_bits); \
-	outputbuf.push_back(c); \
-	if (c == 0xFF)  /* need to stuff a zero byte? */ \
-		outputbuf.push_back((char)0); \
- }
-#define CHECKBUF15() { \
-	if (put_bits > 0xF) { \
-		EMIT_BYTE() \
-		EMIT_BYTE() \
-	} \
-}
-#define PUT_BITS(code, size) { \
-	put_bits += size; \
-	put_buffer = (put_buffer << size) | code; \
-}
-#define EMIT_BITS(code, size) { \
-	PUT_BITS(code, size) \
-	CHECKBUF15() \
-}
-#define EMIT_CODE(code, size) { \
-	temp2 &= (((int) 1)<<nbits) - 1; \
-	PUT_BITS(code, size) \
-	CHECKBUF15() \
-	PUT_BITS(temp2, nbits) \
-	CHECKBUF15() \
- }
-
-/**
- * Encode the entropy of a single block
- *
- * @param block the block
- * @param table_index the table index for the huffman tables to use
- * @param last_dc_val the last dc value from the previous block
- * @param outputbuf the output buffer to use
- * @param state current bits to be exported from the entropy
- */
-void JPEGEncoder::encode_entropy_single_block(short *block, int table_index, int last_dc_val, std::vector<char>& outputbuf, entropy_state_t& state)
-{
-	int temp, temp2, temp3, r, code, size, put_bits, nbits, code_0xf0, size_0xf0;
-	size_t put_buffer;
-	derived_huffman_table_t *dcd;
-	derived_huffman_table_t *acd;
-
-	/* init values */
-	dcd = &this->m_dc_derived_tbls[table_index];
-	acd = &this->m_ac_derived_tbls[table_index];
-	code_0xf0 = acd->code[0xf0];
-	size_0xf0 = acd->length[0xf0];
-
-	put_buffer = state.buffer;
-	put_bits = state.bits;
-
-
-	temp = temp2 = block[0] - last_dc_val;
-	temp3 = temp >> (8 * sizeof(int) - 1);
-	temp ^= temp3;
-	temp -= temp3;
-
-	temp2 += temp3;
-	nbits = nbits_table[temp];
-
-	code = dcd->code[nbits];
-	size = dcd->length[nbits];
-	EMIT_BITS(code, size)
-
-	temp2 &= (((long) 1) << nbits) - 1;
-	EMIT_BITS(temp2, nbits)
-
-	/* run length encoding */
-	r = 0;
-
-	/* Run length encoding macro */
-	#define kloop(k) {  \
-		if ((temp = block[k]) == 0) { \
-			r++; \
-		} else { \
-			temp2 = temp; \
-			temp3 = temp >> (8 * sizeof(int) - 1); \
-			temp ^= temp3; \
-			temp -= temp3; \
-			temp2 += temp3; \
-			nbits = nbits_table[temp]; \
-			/* if run length > 15, must emit special run-length-16 codes (0xF0) */ \
-			while (r > 15) { \
-				EMIT_BITS(code_0xf0, size_0xf0) \
-				r -= 16; \
-			} \
-			/* Emit Huffman symbol for run length / number of bits */ \
-			temp3 = (r << 4) + nbits;  \
-			code = acd->code[temp3]; \
-			size = acd->length[temp3]; \
-			EMIT_CODE(code, size) \
-			r = 0;  \
-		} \
-	}
-
-	/* Do run length encoding in zig zag pattern */
-	kloop(1);   kloop(8);   kloop(16);  kloop(9);   kloop(2);   kloop(3);
-	kloop(10);  kloop(17);  kloop(24);  kloop(32);  kloop(25);  kloop(18);
-	kloop(11);  kloop(4);   kloop(5);   kloop(12);  kloop(19);  kloop(26);
-	kloop(33);  kloop(40);  kloop(48);  kloop(41);  kloop(34);  kloop(27);
-	kloop(20);  kloop(13);  kloop(6);   kloop(7);   kloop(14);  kloop(21);
-	kloop(28);  kloop(35);  kloop(42);  kloop(49);  kloop(56);  kloop(57);
-	kloop(50);  kloop(43);  kloop(36);  kloop(29);  kloop(22);  kloop(15);
-	kloop(23);  kloop(30);  kloop(37);  kloop(44);  kloop(51);  kloop(58);
-	kloop(59);  kloop(52);  kloop(45);  kloop(38);  kloop(31);  kloop(39);
-	kloop(46);  kloop(53);  kloop(60);  kloop(61);  kloop(54);  kloop(47);
-	kloop(55);  kloop(62);  kloop(63);
-
-	if(r > 0) {
-		code = acd->code[0];
-		size = acd->length[0];
-		EMIT_BITS(code, size);
-	}
-
-	/* Store the current state back in the global one */
-	state.bits = put_bits;
-	state.buffer = put_buffer;
-}
-
-/**
- * Do a entropy encoding for a super block containing of four luminance blocks and
- * for the cb/cr one chrominance block each
- *
- * @param mcu_buffer pointer to the blocks
- * @param outputbuf the output buffer
- * @param state the entropy state
- */
-void JPEGEncoder::encode_entropy(short *mcu_buffer[0x6], std::vector<char>& outputbuf, entropy_state_t& state)
-{
-	const static unsigned char mcu_membership[0x6] = {0x0, 0x0, 0x0, 0x0, 0x1, 0x2};
-	const static unsigned char table_index[0x6] = {0x0, 0x0, 0x0, 0x0, 0x1, 0x1};
-	size_t i, ci;
-
-	/* Perform encoding on each block */
-	for(i = 0; i < 0x6; ++i)
-	{
-		ci = mcu_membership[i];
-		this->encode_entropy_single_block(mcu_buffer[i], table_index[i], state.last_dc_val[ci], outputbuf, state);
-		state.last_dc_val[ci] = mcu_buffer[i][0];
-	}
-}
-
-
-
-
-
-// =========================================================================
-//
-// Setup routine for the encoder
-//
-// =========================================================================
-
-/**
- * Create the encoder
- *
- * @param quality the quality to use (clamped between 1 and 100)
- */
-void JPEGEncoder::create_encoder(unsigned char quality)
-{
-	this->set_quality_setting(quality);
-	this->create_huffman_tables();
-	this->create_dct_division_tables();
-	this->create_derived_huffman_tables();
-}
-
-/**
- * Set the quality in the quantification tables
- *
- * @param quality quality the quality to use (clamped between 1 and 100)
- */
-void JPEGEncoder::set_quality_setting(unsigned char quality)
-{
-	unsigned char q;
-	if(quality <= 0)
-	{
-		q = 1;
-	}
-	else if(quality > 100)
-	{
-		q = 100;
-	}
-	else if(quality < 50)
-	{
-		q = 5000 / quality;
-	}
-	else
-	{
-		q = 200 - (quality << 0x1);
-	}
-
-	/* Create quantification tables for luminance and chrominance */
-	this->create_quant_table(0, q, std_luminance_quant_tbl);
-	this->create_quant_table(1, q, std_chrominance_quant_tbl);
-}
-
-/**
- * Create the quantification tables for the encoder based on the given scale factor
- *
- * @param table_id the id of the quantification table in the encoder
- * @param scale the scale to use (quality setting)
- * @param base_table the base table to scale
- */
-void JPEGEncoder::create_quant_table(int table_idx, unsigned char scale, const unsigned int *base_table)
-{
-	quantification_table_t *tblptr;
-	size_t i;
-	long temp;
-
-	tblptr = &this->m_quant_tbls[table_idx];
-	for(i = 0; i < 0x40; ++i)
-	{
-		temp = ((long)base_table[i] * scale + 50) / 100;
-		if(temp <= 0)
-		{
-			temp = 1;
-		}
-		else if(temp > 0xFF)
-		{
-			temp = 0xFF;
-		}
-		tblptr->value[i] = (unsigned char)temp;
-	}
-}
-
-/**
- * Create the huffman tables for the given encoder
- */
-void JPEGEncoder::create_huffman_tables(void)
-{
-	/* Luminance huffman table */
-	this->add_huffman_table(&this->m_dc_huff_tbls[0], bits_dc_luminance, value_dc_luminance);
-	this->add_huffman_table(&this->m_ac_huff_tbls[0], bits_ac_luminance, value_ac_luminance);
-
-	/* Chrominance huffman table */
-	this->add_huffman_table(&this->m_dc_huff_tbls[1], bits_dc_chrominance, value_dc_chrominance);
-	this->add_huffman_table(&this->m_ac_huff_tbls[1], bits_ac_chrominance, value_ac_chrominance);
-}
-
-/**
- * Add the huffman table to the encoder, count the number of bits
- * and copy the number of values accordingly to the huffman table
- *
- * @param tblptr huffman table to use
- * @param bits length
- * @param values the values
- */
-void JPEGEncoder::add_huffman_table(huffman_table_t *tblptr, const unsigned char *bits, const unsigned char *values)
-{
-	size_t len;
-	int n = 0;
-
-	/* copy the bits */
-	memcpy(tblptr->bits, bits, sizeof(tblptr->bits));
-
-	/* count the length */
-	for(len = 0; len < 0x11; ++len)
-		n += bits[len];
-
-	/* set table to zero */
-	memset(tblptr->value, 0, sizeof(tblptr->value));
-
-	/* copy length many values */
-	memcpy(tblptr->value, values, n * sizeof(unsigned char));
-}
-
-/**
- * Create the dct divisor tables
- */
-void JPEGEncoder::create_dct_division_tables(void)
-{
-	size_t i;
-	quantification_table_t *qtblptr;
-	short *dtblptr;
-
-	/* Y Channel */
-	qtblptr = &this->m_quant_tbls[0];
-	dtblptr = this->m_fdct_divisors[0];
-	for(i = 0; i < 0x40; ++i)
-	{
-		compute_reciprocal(qtblptr->value[i] << 0x3, &dtblptr[i]);
-	}
-
-	/* Cb/Cr channel, since they share the table the computation
-	 * needs to be done only once */
-	qtblptr = &this->m_quant_tbls[1];
-	dtblptr = this->m_fdct_divisors[1];
-	for(i = 0; i < 0x40; ++i)
-	{
-		compute_reciprocal(qtblptr->value[i] << 0x3, &dtblptr[i]);
-	}
-}
-
-/**
- * Create the derived huffman tables
- */
-void JPEGEncoder::create_derived_huffman_tables(void)
-{
-	/* Y Channel */
-	this->derive_huffman_table(1, &this->m_dc_huff_tbls[0], &this->m_dc_derived_tbls[0]);
-	this->derive_huffman_table(0, &this->m_ac_huff_tbls[0], &this->m_ac_derived_tbls[0]);
-
-	/* Cb/Cr channel, since they share the table the computation
-	 * needs to be done only once */
-	this->derive_huffman_table(1, &this->m_dc_huff_tbls[1], &this->m_dc_derived_tbls[1]);
-	this->derive_huffman_table(0, &this->m_ac_huff_tbls[1], &this->m_ac_derived_tbls[1]);
-}
-
-/**
- * Derive the huffman tables
- *
- * @param is_dc flag whether current table is dc or ac
- * @param table_idx table index to use
- * @param pointer to the derived huffman table to be filled
- */
-void JPEGEncoder::derive_huffman_table(unsigned char is_dc, huffman_table_t *htblptr, derived_huffman_table_t *dhtblptr)
-{
-	int p, i, l, lastp, si;
-	char huffsize[0x101];
-	unsigned int huffcode[0x101];
-	unsigned int code;
-
-	/* Figure C.1: make table of Huffman code length for each symbol */
-	p = 0;
-	for (l = 1; l < 0x11; l++)
-	{
-		i = (int) htblptr->bits[l];
-		while (i--)
-		{
-			huffsize[p++] = (char) l;
-		}
-	}
-	huffsize[p] = 0;
-	lastp = p;
-
-	/* Figure C.2: generate the codes themselves */
-	code = 0;
-	si = huffsize[0];
-	p = 0;
-	while (huffsize[p])
-	{
-		while (((int) huffsize[p]) == si)
-		{
-			huffcode[p++] = code;
-			code++;
-		}
-		code <<= 1;
-		si++;
-	}
-
-	/* Figure C.3: generate encoding tables */
-	memset(dhtblptr->length, 0, sizeof(dhtblptr->length));
-
-	for (p = 0; p < lastp; ++p)
-	{
-		i = htblptr->value[p];
-		dhtblptr->code[i] = huffcode[p];
-		dhtblptr->length[i] = huffsize[p];
-	}
-}
-
-
-}	/* end of namespace jpeg */
+#include "../include/jpeg_encoder.hpp"
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define ENTROPY_X86
+#include <immintrin.h>
+#endif
+
+namespace jpeg
+{
+
+#define SCALEBITS 0x10
+#define FIX(x)          ((unsigned int) ((x) * (1L<<SCALEBITS) + 0.5))
+#define ONE_HALF        ((unsigned int) 1 << (SCALEBITS-1))
+#define CBCR_OFFSET     ((unsigned int) 0x80 << SCALEBITS)
+
+/* Kernel source, embedded at build time from kernel/jpeg-encoder.cl */
+static const char kernel_source[] =
+#include "../build/jpeg-encoder.cl.inc"
+;
+
+#ifdef KERNEL_SPIRV
+/* Kernels precompiled to SPIR-V, embedded when building with SPIRV=1 */
+static const unsigned char kernel_spirv[] = {
+#include "../build/jpeg-encoder.spv.inc"
+};
+#endif
+
+/**
+ * Make sure the arena can take the given number of bytes after the ones already written.
+ * The arena only grows, so the memory is reused by the following images. The bounds
+ * used are far above the actual output, but the pages are only committed when written.
+ *
+ * @param output_buf the buffer
+ * @param bytes the number of bytes to be written
+ */
+static void reserve_output(output_arena_t& output_buf, size_t bytes)
+{
+	size_t size = output_buf.next - output_buf.data.get();
+	if(size + bytes <= output_buf.capacity)
+		return;
+
+	std::unique_ptr<char[]> data(new char[size + bytes]);
+	if(size > 0)
+		memcpy(data.get(), output_buf.data.get(), size);
+	output_buf.data = std::move(data);
+	output_buf.capacity = size + bytes;
+	output_buf.next = output_buf.data.get() + size;
+}
+
+/**
+ * Get the number of bytes written to the arena
+ *
+ * @param output_buf the buffer
+ * @return the number of bytes
+ */
+static size_t output_size(const output_arena_t& output_buf)
+{
+	return output_buf.next - output_buf.data.get();
+}
+
+/**
+ * Pass the bytes written to the arena on to the sink and rewind the arena
+ *
+ * @param output_buf the buffer
+ * @param sink the sink, nothing is done if it is empty
+ * @return 0 on success, 6 if the sink aborted the encoding
+ */
+static int pass_output(output_arena_t& output_buf, const output_sink_t& sink)
+{
+	if(!sink)
+		return 0x0;
+
+	int ret = sink(output_buf.data.get(), output_size(output_buf));
+	output_buf.next = output_buf.data.get();
+	return ret == 0 ? 0x0 : 0x6;
+}
+
+/**
+ * Push back the given the value to the output buffer (single byte only)
+ *
+ * @param output_buf the buffer
+ * @param value the value
+ */
+static void write_byte(output_arena_t& output_buf, int value)
+{
+	*output_buf.next++ = (char)value;
+}
+
+/**
+ * Write two bytes to the output buffer by splitting it and writing those two bytes
+ * seperately
+ *
+ * @param output_buf the buffer
+ * @param value the value
+ */
+static void write_2byte(output_arena_t& output_buf, int value)
+{
+	write_byte(output_buf, (value >> 0x8) & 0xFF);
+	write_byte(output_buf, value & 0xFF);
+}
+
+/**
+ * Export a JPEG marker
+ *
+ * @param output_buf the buffer
+ * @param value the marker
+ */
+static void write_marker(output_arena_t& output_buf, int value)
+{
+	write_byte(output_buf, 0xFF);
+	write_byte(output_buf, value);
+}
+
+/**
+ * Compute the reciprocal for the divisor and save in the given table
+ * the reciprocal, length and shift values
+ * Taken from: https://github.com/libjpeg-turbo/libjpeg-turbo/
+ *
+ * @param divisor the divisor
+ * @param dtbl table to store
+ */
+static int compute_reciprocal (unsigned short divisor, short *dtbl)
+{
+	unsigned int fq, fr;
+	unsigned short c;
+	int b, r;
+
+	if (divisor == 1)
+	{
+		dtbl[0x40 * 0] = (short) 1;						/* reciprocal */
+		dtbl[0x40 * 1] = (short) 0;						/* correction */
+		dtbl[0x40 * 2] = (short) 1;						/* scale */
+		dtbl[0x40 * 3] = -(short) (sizeof(short) * 8);	/* shift */
+		return 0;
+	}
+
+	b = nbits_table[divisor] - 1;
+	r = sizeof(short) * 8 + b;
+
+	fq = ((unsigned int)1 << r) / divisor;
+	fr = ((unsigned int)1 << r) % divisor;
+
+	c = divisor >> 0x1;
+
+	if (fr == 0)
+	{
+		fq >>= 1;
+		r--;
+	}
+	else if (fr <= (divisor / 2U))
+	{
+		c++;
+	}
+	else
+	{
+		fq++;
+	}
+
+	dtbl[0x40 * 0] = (short) fq;
+	dtbl[0x40 * 1] = (short) c;
+	dtbl[0x40 * 2] = (short) (1 << (sizeof(short)*8*2 - r));
+	dtbl[0x40 * 3] = (short) r - sizeof(short)*8;
+
+	return r <= 16 ? 0 : 1;
+}
+
+/* Test whether any byte of the word is 0xFF */
+#define HAS_FF_BYTE(word) (((~(word) - 0x0101010101010101ULL) & (word) & 0x8080808080808080ULL) != 0)
+
+/**
+ * Write a full bit buffer word to the output, most significant byte first. If requested
+ * a zero byte is stuffed after each 0xFF byte, words without 0xFF bytes are written at once
+ *
+ * @param output_buf the buffer
+ * @param word the bit buffer
+ * @param stuffing flag whether to stuff 0xFF bytes
+ */
+static inline void flush_word(output_arena_t& output_buf, uint64_t word, bool stuffing)
+{
+	char bytes[0x8];
+	for(size_t i = 0; i < 0x8; ++i)
+		bytes[i] = (char)(word >> (0x38 - (i << 0x3)));
+
+	if(!stuffing || !HAS_FF_BYTE(word))
+	{
+		memcpy(output_buf.next, bytes, 0x8);
+		output_buf.next += 0x8;
+		return;
+	}
+
+	for(size_t i = 0; i < 0x8; ++i)
+	{
+		*output_buf.next++ = bytes[i];
+		if(bytes[i] == (char)0xFF)
+			*output_buf.next++ = 0;
+	}
+}
+
+/**
+ * Append bits to the entropy coded output, starting at the bit position of the state
+ *
+ * @param output_buf the buffer
+ * @param state the entropy state
+ * @param code the bits to append, right aligned
+ * @param size the number of bits, at most 32
+ */
+static void put_bits(output_arena_t& output_buf, entropy_state_t& state, uint64_t code, int size)
+{
+	code &= ((uint64_t)1 << size) - 1;
+	state.free_bits -= size;
+	if(state.free_bits < 0)
+	{
+		state.buffer = (state.buffer << (size + state.free_bits)) | (code >> -state.free_bits);
+		flush_word(output_buf, state.buffer, state.stuffing);
+		state.free_bits += 0x40;
+		state.buffer = code;
+	}
+	else
+		state.buffer = (state.buffer << size) | code;
+}
+
+/**
+ * Stuff a zero byte after each 0xFF byte of the output from the given position on.
+ * The 0xFF bytes are located with memchr, which is vectorized by the C library
+ *
+ * @param output_buf the buffer
+ * @param start the position of the first byte to stuff
+ */
+static void stuff_bytes(output_arena_t& output_buf, size_t start)
+{
+	const char *data = output_buf.data.get();
+	const char *end = output_buf.next;
+	size_t count = 0;
+	for(const char *ff = data + start; (ff = (const char*)memchr(ff, 0xFF, end - ff)) != NULL; ++ff)
+		++count;
+	if(count == 0)
+		return;
+
+	/* Move the runs between the 0xFF bytes back to their final position, starting at the end */
+	char *buf = output_buf.data.get();
+	size_t src = output_size(output_buf);
+	size_t dst = src + count;
+	output_buf.next += count;
+	while(count > 0)
+	{
+		size_t ff = (const char*)memrchr(buf + start, 0xFF, src - start) - buf;
+		size_t run = src - ff - 1;
+		dst -= run;
+		memmove(buf + dst, buf + ff + 1, run);
+		buf[--dst] = 0;
+		buf[--dst] = (char)0xFF;
+		src = ff;
+		--count;
+	}
+}
+
+/**
+ * Detect the instruction set the entropy coder can use on this cpu
+ *
+ * @return one of ENTROPY_SCALAR, ENTROPY_AVX2 and ENTROPY_AVX512
+ */
+static unsigned char detect_entropy_isa()
+{
+#ifdef ENTROPY_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("bmi") && __builtin_cpu_supports("lzcnt"))
+	{
+		if(__builtin_cpu_supports("avx512bw"))
+			return ENTROPY_AVX512;
+		if(__builtin_cpu_supports("avx2"))
+			return ENTROPY_AVX2;
+	}
+#endif
+	return ENTROPY_SCALAR;
+}
+
+/**
+ * Detect whether the host backend can use AVX2 on this cpu
+ *
+ * @return true if AVX2 is supported
+ */
+static bool detect_host_avx2()
+{
+#ifdef ENTROPY_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+struct program_cache_header
+{
+	char magic[0x8];
+	uint64_t key;
+	uint64_t size;
+};
+typedef struct program_cache_header program_cache_header_t;
+
+/**
+ * Hash the given bytes with 64 bit FNV-1a
+ *
+ * @param hash the hash of the previous bytes
+ * @param data the bytes
+ * @param size the number of bytes
+ * @return the hash
+ */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	for(size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Get the path the program for the given device is cached at. The key covers
+ * platform, device and driver version as well as the source and build options.
+ *
+ * @param device the device
+ * @param source the kernel source
+ * @param extension the extension of the file, the key is the same for all files of a device
+ * @param key the key of the cached program
+ * @return the path, empty if the cache is disabled
+ */
+static std::string program_cache_path(cl::Device &device, const std::string& source, const char *extension, uint64_t *key)
+{
+	std::string directory;
+	const char *env = getenv(PROGRAM_CACHE_ENV);
+	if(env != NULL)
+		directory = env;
+	else if((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != 0)
+		directory = std::string(env) + "/opencl-jpeg-encoder";
+	else if((env = getenv("HOME")) != NULL && env[0] != 0)
+	{
+		directory = std::string(env) + "/.cache";
+		mkdir(directory.c_str(), 0755);
+		directory += "/opencl-jpeg-encoder";
+	}
+	if(directory.empty())
+		return directory;
+	mkdir(directory.c_str(), 0755);
+
+	cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+	const std::string parts[] = {
+		platform.getInfo<CL_PLATFORM_NAME>(), platform.getInfo<CL_PLATFORM_VERSION>(),
+		device.getInfo<CL_DEVICE_NAME>(), device.getInfo<CL_DEVICE_VERSION>(),
+		device.getInfo<CL_DRIVER_VERSION>(), KERNEL_BUILD_OPTIONS, source
+	};
+	*key = 0xCBF29CE484222325ULL;
+	for(size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+		*key = fnv1a(*key, parts[i].c_str(), parts[i].size() + 1);
+
+	char name[0x20];
+	snprintf(name, sizeof(name), "/%016llx", (unsigned long long)*key);
+	return directory + name + extension;
+}
+
+/**
+ * Load the program from the given cache file and build it
+ *
+ * @param context the OpenCL context to build the program in
+ * @param device the device to build for
+ * @param path the cache file
+ * @param key the key the program is cached with
+ * @param program the program, only set on success
+ * @return true if a valid program was cached
+ */
+static bool load_cached_program(cl::Context &context, cl::Device &device, const std::string& path, uint64_t key, cl::Program& program)
+{
+	program_cache_header_t header;
+	std::vector<char> binary;
+	struct stat st;
+	cl_int err;
+
+	FILE *fp = fopen(path.c_str(), "rb");
+	if(fp == NULL)
+		return false;
+
+	/* A corrupt or foreign file must not claim more bytes than it holds */
+	bool valid = fstat(fileno(fp), &st) == 0 && (uint64_t)st.st_size >= sizeof(header) &&
+			fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, PROGRAM_CACHE_MAGIC, 0x8) == 0 &&
+			header.key == key && header.size > 0 && header.size <= (uint64_t)st.st_size - sizeof(header);
+	if(valid)
+	{
+		binary.resize(header.size);
+		valid = fread(binary.data(), 1, binary.size(), fp) == header.size;
+	}
+	fclose(fp);
+	if(!valid)
+		return false;
+
+	/* The driver may still refuse the binary, e.g. after an update not reflected in its version */
+	std::vector<cl_int> status;
+	cl::Program::Binaries binaries(1, std::make_pair((const void*)binary.data(), (size_t)header.size));
+	cl::Program cached(context, std::vector<cl::Device>(1, device), binaries, &status, &err);
+	if(err != CL_SUCCESS || status.empty() || status[0] != CL_SUCCESS)
+		return false;
+	if(cached.build({device}, KERNEL_BUILD_OPTIONS) != CL_SUCCESS)
+		return false;
+	program = cached;
+	return true;
+}
+
+/**
+ * Write the given two parts to a cache file. The file is written under a temporary
+ * name and renamed, so concurrent processes never see a partial file.
+ *
+ * @param path the cache file
+ * @param first the first part
+ * @param first_size the size of the first part
+ * @param second the second part
+ * @param second_size the size of the second part, may be 0
+ */
+static void write_cache_file(const std::string& path, const void *first, size_t first_size, const void *second, size_t second_size)
+{
+	std::string temp = path + "." + std::to_string(getpid());
+	FILE *fp = fopen(temp.c_str(), "wb");
+	if(fp == NULL)
+		return;
+	bool written = fwrite(first, 1, first_size, fp) == first_size
+				   && (second_size == 0 || fwrite(second, 1, second_size, fp) == second_size);
+	if(fclose(fp) == 0 && written && rename(temp.c_str(), path.c_str()) == 0)
+		return;
+	unlink(temp.c_str());
+}
+
+/**
+ * Describe the host CPU, the model and the number of hardware threads, for the
+ * key of the cached calibration
+ *
+ * @return the description
+ */
+static std::string host_description(void)
+{
+	std::string model;
+	char line[0x100];
+	FILE *fp = fopen("/proc/cpuinfo", "r");
+	if(fp != NULL)
+	{
+		while(fgets(line, sizeof(line), fp) != NULL)
+		{
+			if(strncmp(line, "model name", 0xA) == 0)
+			{
+				model = line;
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	return model + std::to_string(std::thread::hardware_concurrency());
+}
+
+/**
+ * Store the binary of the given program in the cache, see write_cache_file
+ *
+ * @param program the built program
+ * @param path the cache file
+ * @param key the key the program is cached with
+ */
+static void store_cached_program(cl::Program& program, const std::string& path, uint64_t key)
+{
+	program_cache_header_t header;
+
+	std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	if(sizes.size() != 1 || sizes[0] == 0)
+		return;
+	std::vector<unsigned char> binary(sizes[0]);
+	unsigned char *data = binary.data();
+	if(clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(data), &data, NULL) != CL_SUCCESS)
+		return;
+
+	memcpy(header.magic, PROGRAM_CACHE_MAGIC, 0x8);
+	header.key = key;
+	header.size = sizes[0];
+
+	write_cache_file(path, &header, sizeof(header), data, sizes[0]);
+}
+
+/**
+ * Create the program from the embedded SPIR-V module if the device takes it
+ *
+ * @param context the OpenCL context to create the program in
+ * @param device the device to build for
+ * @param program the program, only set on success
+ * @return true if the program was created
+ */
+static bool create_from_il(cl::Context &context, cl::Device &device, cl::Program& program)
+{
+#if defined(KERNEL_SPIRV) && defined(CL_VERSION_2_1)
+	cl_int err;
+
+	/* Devices before OpenCL 2.1 fail the query and leave the version empty */
+	if(device.getInfo<CL_DEVICE_IL_VERSION>().find("SPIR-V") == std::string::npos)
+		return false;
+	cl_program il = clCreateProgramWithIL(context(), kernel_spirv, sizeof(kernel_spirv), &err);
+	if(err != CL_SUCCESS)
+		return false;
+	program = cl::Program(il);
+	return true;
+#else
+	(void)context;
+	(void)device;
+	(void)program;
+	return false;
+#endif
+}
+
+/**
+ * Build the program from the embedded kernels. The compiled program is cached on
+ * disk and loaded from there by later encoders, if no valid binary is cached it is
+ * built from the SPIR-V module if embedded and supported, from source otherwise or
+ * if building the module fails.
+ *
+ * @param context the OpenCL context to build the program in
+ * @param device the device to build for
+ * @return the created program
+ */
+static cl::Program build_program(cl::Context &context, cl::Device &device)
+{
+	std::string str(kernel_source);
+	uint64_t key = 0;
+
+	std::string path = program_cache_path(device, str, ".bin", &key);
+	cl::Program ret;
+	if(!path.empty() && load_cached_program(context, device, path, key, ret))
+		return ret;
+
+	/* A driver may accept the module and still fail to build it, fall back to the source then */
+	cl_int err = CL_BUILD_PROGRAM_FAILURE;
+	if(create_from_il(context, device, ret))
+		err = ret.build({device}, KERNEL_BUILD_OPTIONS);
+	if(err != CL_SUCCESS)
+	{
+		ret = cl::Program(context, str);
+		err = ret.build({device}, KERNEL_BUILD_OPTIONS);
+	}
+	if(err == CL_SUCCESS && !path.empty())
+		store_cached_program(ret, path, key);
+	return ret;
+}
+
+/**
+ * Reset the given buffers to hold nothing
+ *
+ * @param buffers the buffers
+ */
+static void reset_buffers(encode_buffers_t& buffers)
+{
+	buffers.pixels = 0;
+	buffers.super_blocks = 0;
+	buffers.plane_bytes = 0;
+	buffers.output.capacity = 0;
+	buffers.output.next = NULL;
+	buffers.mapped = false;
+	buffers.device = NULL;
+	buffers.bottom_fixed = false;
+	buffers.busy = false;
+}
+
+/**
+ * Compute the number of bytes per row of the YCbCr planes, the width padded to whole
+ * super blocks and rounded up to the base address alignment of the device
+ *
+ * @param device the device the planes are used on
+ * @param width of the image
+ * @return the pitch of the planes
+ */
+static size_t plane_pitch(const device_context_t& device, size_t width)
+{
+	size_t pitch = (width + 0xF) & ~(size_t)0xF;
+	size_t alignment = std::max(device.host_ptr_alignment, (size_t)0x1);
+	return ((pitch + alignment - 1) / alignment) * alignment;
+}
+
+/**
+ * Create a new encoder, the kernels are built for all devices of the given type
+ *
+ * @param type the device type to use
+ * @param quality the quality setting to use (clamped between 1 and 100)
+ */
+JPEGEncoder::JPEGEncoder(cl_device_type type, unsigned char quality) :
+		m_context(type),
+		m_multi_device(true),
+		m_host_threshold(0),
+		m_host_threshold_measured(false),
+		m_host_threads(std::max(std::thread::hardware_concurrency(), 1u)),
+		m_host_avx2(detect_host_avx2()),
+		m_restart_interval(0),
+		m_entropy_threads(1),
+		m_entropy_isa(detect_entropy_isa()),
+		m_file_writer(NULL),
+		m_next_slot(0)
+{
+	this->m_stream.started = false;
+	this->m_stream.output.capacity = 0;
+	this->m_stream.output.next = NULL;
+	for(size_t i = 0; i < 0x2; ++i)
+		reset_buffers(this->m_stream.buffers[i]);
+	for(size_t i = 0; i < ENCODE_SLOTS; ++i)
+		reset_buffers(this->m_buffers[i]);
+
+	this->create_encoder(quality);
+
+	/* Devices the kernels can not be created for are left out. Without any device, e.g. if no
+	 * OpenCL platform is installed, all images are encoded on the host */
+	std::vector<cl::Device> devices = this->m_context.getInfo<CL_CONTEXT_DEVICES>();
+	for(size_t i = 0; i < devices.size(); ++i)
+	{
+		this->m_devices.emplace_back();
+		device_context_t& device = this->m_devices.back();
+		device.device = devices[i];
+		device.queue = cl::CommandQueue(this->m_context, device.device, CL_QUEUE_PROFILING_ENABLE);
+		device.program = build_program(this->m_context, device.device);
+		for(size_t j = 0; j < ENCODE_SLOTS; ++j)
+		{
+			reset_buffers(device.chunks[j][0]);
+			reset_buffers(device.chunks[j][1]);
+		}
+		if(!this->prepare_device(device))
+			this->m_devices.pop_back();
+	}
+
+	if(this->m_devices.empty())
+	{
+		fprintf(stderr, "No OpenCL device available, encoding on the host\n");
+		this->m_host_threshold = SIZE_MAX;
+	}
+	else
+		this->m_host_threshold = this->calibrate_host_threshold();
+}
+
+/**
+ * Wait for all images in flight before releasing the buffers
+ */
+JPEGEncoder::~JPEGEncoder()
+{
+	std::unique_lock<std::mutex> lock(this->m_lock);
+	for(size_t i = 0; i < ENCODE_SLOTS; ++i)
+	{
+		encode_buffers_t *buffers = &this->m_buffers[i];
+		this->m_slot_released.wait(lock, [buffers] { return !buffers->busy; });
+		if(this->m_workers[i].joinable())
+			this->m_workers[i].join();
+	}
+
+	/* Drop an unfinished streamed image */
+	if(this->m_stream.started)
+	{
+		if(this->m_stream.pending)
+		{
+			if(this->m_stream.pending_done() != NULL)
+				this->m_stream.pending_done.wait();
+			this->release_coefficients(this->m_stream.buffers[this->m_stream.slot ^ 0x1]);
+		}
+		this->close_stream(this->m_stream);
+	}
+}
+
+/**
+ * Prepare the given device, create kernels and write conversion table and divisor table to device
+ *
+ * @param device the device, its program needs to be built
+ * @return true if all kernels could be created
+ */
+bool JPEGEncoder::prepare_device(device_context_t& device)
+{
+	cl_int err[0x8];
+
+	/* copy tables to device */
+	device.color_conversion_table = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(color_conversion_table));
+	device.fdct_divisors = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(m_fdct_divisors));
+	device.fdct_multiplier = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(MULTIPLIER));
+	device.fdct_sign = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(SIGN));
+	device.fdct_indices = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(INDICES));
+	device.fdct_descaler = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(DESCALER));
+	device.fdct_descaler_offset = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(DESCALER_OFFSET));
+	device.queue.enqueueWriteBuffer(device.color_conversion_table, false, 0, sizeof(color_conversion_table), color_conversion_table);
+	device.queue.enqueueWriteBuffer(device.fdct_divisors, false, 0, sizeof(m_fdct_divisors), &this->m_fdct_divisors);
+	device.queue.enqueueWriteBuffer(device.fdct_multiplier, false, 0, sizeof(MULTIPLIER), &MULTIPLIER);
+	device.queue.enqueueWriteBuffer(device.fdct_sign, false, 0, sizeof(SIGN), &SIGN);
+	device.queue.enqueueWriteBuffer(device.fdct_indices, false, 0, sizeof(INDICES), &INDICES);
+	device.queue.enqueueWriteBuffer(device.fdct_descaler, false, 0, sizeof(DESCALER), &DESCALER);
+	device.queue.enqueueWriteBuffer(device.fdct_descaler_offset, false, 0, sizeof(DESCALER_OFFSET), &DESCALER_OFFSET);
+
+	/* create kernels */
+	device.transformation_kernel = cl::Kernel(device.program, "color_space_transform_planar", &err[0]);
+	device.downsample_full_kernel = cl::Kernel(device.program, "downsample_full", &err[1]);
+	device.downsample_2v2_kernel = cl::Kernel(device.program, "downsample_2v2", &err[2]);
+	device.dct_quant = cl::Kernel(device.program, "dct_quant", &err[3]);
+	device.zero_out_right = cl::Kernel(device.program, "zero_out_right", &err[4]);
+	device.zero_out_bottom = cl::Kernel(device.program, "zero_out_bottom", &err[5]);
+	device.color_dct_quant = cl::Kernel(device.program, "color_dct_quant", &err[6]);
+	device.dct_quant_subgroup = cl::Kernel(device.program, "dct_quant_subgroup", &err[7]);
+
+	/* Avoid copies between host and device if they share the memory, the alignment is given in bits */
+	device.zero_copy = device.device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+	device.host_ptr_alignment = device.device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() >> 0x3;
+
+	/* The sub-group DCT is only compiled if the device supports the shuffles */
+	std::string extensions = device.device.getInfo<CL_DEVICE_EXTENSIONS>();
+	device.use_subgroup_dct = err[7] == CL_SUCCESS && (extensions.find("cl_intel_subgroups") != std::string::npos
+							  || (extensions.find("cl_khr_subgroups") != std::string::npos && extensions.find("cl_khr_subgroup_shuffle") != std::string::npos));
+
+	/* The fused kernel processes one super block per work group of 256 work items. It exchanges
+	 * the values through local memory, so the separate kernels are preferred with the sub-group DCT */
+	device.use_fused_kernel = err[6] == CL_SUCCESS && !device.use_subgroup_dct
+							  && device.color_dct_quant.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device.device) >= 0x100;
+
+	for(size_t i = 0; i < 0x6; ++i)
+	{
+		if(err[i] != CL_SUCCESS)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Set the number of MCUs between two restart markers
+ *
+ * @param mcus the restart interval, 0 to disable restart markers (clamped to 65535)
+ */
+void JPEGEncoder::set_restart_interval(unsigned int mcus)
+{
+	this->m_restart_interval = mcus > 0xFFFF ? 0xFFFF : mcus;
+}
+
+/**
+ * Set the number of threads used for the entropy coding. With restart markers
+ * the restart intervals are coded in parallel, without the output of the threads
+ * is stitched together bitwise
+ *
+ * @param threads the number of threads, 0 to use one per hardware thread
+ */
+void JPEGEncoder::set_entropy_threads(unsigned int threads)
+{
+	if(threads == 0)
+		threads = std::thread::hardware_concurrency();
+	this->m_entropy_threads = threads > 0 ? threads : 1;
+}
+
+/**
+ * Write the files through the given writer instead of a blocking fwrite. The output
+ * is passed to the writer as it is produced and the next image is encoded while the
+ * writes complete, FileWriter::wait tells whether all of them succeeded. Passing NULL
+ * switches back to fwrite. Must not be changed while images are in flight.
+ *
+ * @param writer the writer, needs to outlive the images written through it
+ */
+void JPEGEncoder::set_file_writer(FileWriter *writer)
+{
+	this->m_file_writer = writer;
+}
+
+/**
+ * Set whether images taller than a chunk of DEVICE_CHUNK_MCU_ROWS are split across
+ * all devices, enabled by default
+ *
+ * @param enabled flag whether to use all devices
+ */
+void JPEGEncoder::set_multi_device(bool enabled)
+{
+	this->m_multi_device = enabled;
+}
+
+/**
+ * Get the number of devices the kernels were built for
+ *
+ * @return the number of devices
+ */
+size_t JPEGEncoder::device_count(void) const
+{
+	return this->m_devices.size();
+}
+
+/**
+ * Set the number of pixels below which images are encoded on the host instead of
+ * the device, overriding the measured one
+ *
+ * @param pixels the threshold, 0 to always use the device
+ */
+void JPEGEncoder::set_host_threshold(size_t pixels)
+{
+	this->m_host_threshold = pixels;
+	this->m_host_threshold_measured = false;
+}
+
+/**
+ * Get the number of pixels below which images are encoded on the host
+ *
+ * @return the threshold
+ */
+size_t JPEGEncoder::host_threshold(void) const
+{
+	return this->m_host_threshold;
+}
+
+/**
+ * Set the number of threads encoding an image on the host
+ *
+ * @param threads the number of threads, 0 to use one per hardware thread
+ */
+void JPEGEncoder::set_host_threads(unsigned int threads)
+{
+	if(threads == 0)
+		threads = std::thread::hardware_concurrency();
+	this->m_host_threads = threads > 0 ? threads : 1;
+	if(this->m_host_threshold_measured)
+		this->m_host_threshold = this->measured_host_threshold();
+}
+
+/**
+ * Time the host and the device path on a small and a large image and compute the
+ * number of pixels up to which the host is faster. The times are cached on disk
+ * next to the compiled program, keyed by the device and the host CPU.
+ *
+ * @return the number of pixels below which images are encoded on the host
+ */
+size_t JPEGEncoder::calibrate_host_threshold(void)
+{
+	device_context_t& device = this->m_devices[0];
+	encode_buffers_t& buffers = this->m_buffers[0];
+	const size_t sizes[0x2] = { CALIBRATION_SMALL_SIZE, CALIBRATION_LARGE_SIZE };
+	double device_time[0x2], host_time;
+	uint64_t key;
+
+	this->m_host_threshold_measured = true;
+	std::string path = program_cache_path(device.device, std::string(kernel_source) + host_description(), ".profile", &key);
+	FILE *fp = path.empty() ? NULL : fopen(path.c_str(), "r");
+	if(fp != NULL)
+	{
+		int found = fscanf(fp, "%lg %lg %lg", &this->m_calibration[0], &this->m_calibration[1], &this->m_calibration[2]);
+		fclose(fp);
+		if(found == 0x3)
+			return this->measured_host_threshold();
+	}
+
+	/* Any content does, the time does not depend on the pixel values */
+	std::vector<unsigned char> image(3 * CALIBRATION_LARGE_SIZE * CALIBRATION_LARGE_SIZE);
+	for(size_t i = 0; i < image.size(); ++i)
+		image[i] = (unsigned char)(i * 0x9D);
+
+	/* Best of two runs each, the first device run includes the allocations */
+	for(size_t i = 0; i < 0x2; ++i)
+	{
+		device_time[i] = 1e30;
+		for(size_t run = 0; run < 0x2; ++run)
+		{
+			cl::Event done;
+			auto start = std::chrono::steady_clock::now();
+			this->allocate_buffers(device, buffers, sizes[i], sizes[i]);
+			this->enqueue_image(device, buffers, image.data(), sizes[i], sizes[i], done);
+			done.wait();
+			this->release_coefficients(buffers);
+			device_time[i] = std::min(device_time[i], std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+	}
+	host_time = 1e30;
+	for(size_t run = 0; run < 0x2; ++run)
+	{
+		auto start = std::chrono::steady_clock::now();
+		this->allocate_host_buffers(buffers, CALIBRATION_LARGE_SIZE, CALIBRATION_LARGE_SIZE);
+		this->encode_on_host(buffers, image.data(), CALIBRATION_LARGE_SIZE, CALIBRATION_LARGE_SIZE);
+		host_time = std::min(host_time, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	/* Both paths grow linearly with the pixels, the device starting at a fixed cost */
+	double pixels[0x2] = { (double)(sizes[0] * sizes[0]), (double)(sizes[1] * sizes[1]) };
+	this->m_calibration[1] = std::max(0.0, (device_time[1] - device_time[0]) / (pixels[1] - pixels[0]));
+	this->m_calibration[0] = std::max(0.0, device_time[0] - this->m_calibration[1] * pixels[0]);
+	this->m_calibration[2] = host_time / pixels[1] * std::min(this->m_host_threads, std::max(std::thread::hardware_concurrency(), 1u));
+
+	if(!path.empty())
+	{
+		char profile[0x80];
+		int length = snprintf(profile, sizeof(profile), "%.9g %.9g %.9g\n", this->m_calibration[0], this->m_calibration[1], this->m_calibration[2]);
+		write_cache_file(path, profile, length, NULL, 0);
+	}
+	return this->measured_host_threshold();
+}
+
+/**
+ * Compute the threshold from the measured times for the number of host threads,
+ * assuming the host scales linearly up to one thread per hardware thread
+ *
+ * @return the number of pixels below which images are encoded on the host
+ */
+size_t JPEGEncoder::measured_host_threshold(void) const
+{
+	unsigned int threads = std::min(this->m_host_threads, std::max(std::thread::hardware_concurrency(), 1u));
+	double host_per_pixel = this->m_calibration[2] / threads;
+	if(host_per_pixel <= this->m_calibration[1])
+		return SIZE_MAX;
+	double threshold = this->m_calibration[0] / (host_per_pixel - this->m_calibration[1]);
+	return threshold < (double)SIZE_MAX ? (size_t)threshold : SIZE_MAX;
+}
+
+/**
+ * Allocate the device and host buffers for images up to the given size in advance,
+ * encoding images that fit into them does not allocate any memory. The buffers
+ * only grow, they are never shrunk.
+ *
+ * @param max_width the largest width expected
+ * @param max_height the largest height expected
+ */
+void JPEGEncoder::reserve(size_t max_width, size_t max_height)
+{
+	std::unique_lock<std::mutex> lock(this->m_lock);
+	for(size_t i = 0; i < ENCODE_SLOTS; ++i)
+	{
+		/* Buffers in use can not be replaced */
+		encode_buffers_t *buffers = &this->m_buffers[i];
+		this->m_slot_released.wait(lock, [buffers] { return !buffers->busy; });
+		if(!this->m_devices.empty())
+			this->allocate_buffers(this->m_devices[0], *buffers, max_width, max_height);
+
+		/* Images split across the devices are merged on the host, without a device all are encoded there */
+		if(this->m_devices.empty())
+			this->allocate_host_buffers(*buffers, max_width, max_height);
+		else if(this->m_multi_device && this->m_devices.size() > 1)
+		{
+			this->allocate_host_buffers(*buffers, max_width, max_height);
+			for(size_t j = 0; j < this->m_devices.size(); ++j)
+			{
+				this->allocate_buffers(this->m_devices[j], this->m_devices[j].chunks[i][0], max_width, DEVICE_CHUNK_MCU_ROWS << 0x4);
+				this->allocate_buffers(this->m_devices[j], this->m_devices[j].chunks[i][1], max_width, DEVICE_CHUNK_MCU_ROWS << 0x4);
+			}
+		}
+
+		/* Room for the output of an image written to a file or memory */
+		buffers->output.next = buffers->output.data.get();
+		reserve_output(buffers->output, output_bound(max_width, max_height));
+	}
+
+	/* Have the device allocations done before returning */
+	for(size_t i = 0; i < this->m_devices.size(); ++i)
+		this->m_devices[i].queue.finish();
+}
+
+/**
+ * Make sure the given buffers can hold an image of the given size.
+ * The buffers are only replaced if they are too small.
+ *
+ * @param device the device the buffers are used on
+ * @param buffers the buffers to grow
+ * @param width of the image
+ * @param height of the image
+ */
+void JPEGEncoder::allocate_buffers(device_context_t& device, encode_buffers_t& buffers, size_t width, size_t height)
+{
+	size_t pixels = width * height;
+	size_t super_blocks = ((width + 0xF) >> 0x4) * ((height + 0xF) >> 0x4);
+
+	if(pixels > buffers.pixels)
+	{
+		/* The kernels do not write back to the image */
+		buffers.image = cl::Buffer(this->m_context, CL_MEM_READ_ONLY, sizeof(unsigned char) * 3 * pixels);
+		device.queue.enqueueFillBuffer<cl_uchar>(buffers.image, 0, 0, sizeof(unsigned char) * 3 * pixels);
+		buffers.pixels = pixels;
+	}
+
+	/* The separate kernels store the YCbCr image as three planes padded to whole super blocks */
+	size_t plane_bytes = 3 * plane_pitch(device, width) * (((height + 0xF) >> 0x4) << 0x4);
+	if(!device.use_fused_kernel && plane_bytes > buffers.plane_bytes)
+	{
+		buffers.planes = cl::Buffer(this->m_context, CL_MEM_READ_WRITE, plane_bytes);
+		device.queue.enqueueFillBuffer<cl_uchar>(buffers.planes, 0, 0, plane_bytes);
+		buffers.plane_bytes = plane_bytes;
+	}
+
+	if(super_blocks > buffers.super_blocks)
+	{
+		/* With unified memory the coefficients are mapped instead of copied, so let the runtime
+		 * place them in host accessible memory */
+		cl_mem_flags flags = device.zero_copy ? CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR : CL_MEM_READ_WRITE;
+		buffers.y_blocks = cl::Buffer(this->m_context, flags, (super_blocks << 0x8) * sizeof(cl_short));
+		buffers.cb_blocks = cl::Buffer(this->m_context, flags, (super_blocks << 0x6) * sizeof(cl_short));
+		buffers.cr_blocks = cl::Buffer(this->m_context, flags, (super_blocks << 0x6) * sizeof(cl_short));
+
+		/* Force the allocation on the device instead of deferring it to the first kernel launch */
+		device.queue.enqueueFillBuffer<cl_short>(buffers.y_blocks, 0, 0, (super_blocks << 0x8) * sizeof(cl_short));
+		device.queue.enqueueFillBuffer<cl_short>(buffers.cb_blocks, 0, 0, (super_blocks << 0x6) * sizeof(cl_short));
+		device.queue.enqueueFillBuffer<cl_short>(buffers.cr_blocks, 0, 0, (super_blocks << 0x6) * sizeof(cl_short));
+
+		/* resize initializes the elements, so the pages are already mapped */
+		if(!device.zero_copy)
+		{
+			buffers.y.resize(super_blocks << 0x8);
+			buffers.cb.resize(super_blocks << 0x6);
+			buffers.cr.resize(super_blocks << 0x6);
+		}
+		buffers.super_blocks = super_blocks;
+	}
+}
+
+/**
+ * Make sure the host planes of the given buffers can hold the coefficients of an
+ * image of the given size, used to merge the chunks processed by the devices
+ *
+ * @param buffers the buffers to grow
+ * @param width of the image
+ * @param height of the image
+ */
+void JPEGEncoder::allocate_host_buffers(encode_buffers_t& buffers, size_t width, size_t height)
+{
+	size_t super_blocks = ((width + 0xF) >> 0x4) * ((height + 0xF) >> 0x4);
+
+	if(buffers.y.size() < (super_blocks << 0x8))
+	{
+		buffers.y.resize(super_blocks << 0x8);
+		buffers.cb.resize(super_blocks << 0x6);
+		buffers.cr.resize(super_blocks << 0x6);
+	}
+	buffers.y_host = buffers.y.data();
+	buffers.cb_host = buffers.cb.data();
+	buffers.cr_host = buffers.cr.data();
+	buffers.mapped = false;
+	buffers.bottom_fixed = false;
+}
+
+/**
+ * Enqueue the fused kernel performing color space transformation, downsampling,
+ * DCT and quantification with a single pass over the image
+ *
+ * @param device the device to run on
+ * @param image_buffer the device buffer containing the RGB image
+ * @param y_block_buffer the device buffer the luminance super blocks are stored at
+ * @param cb_block_buffer the device buffer the cb blocks are stored at
+ * @param cr_block_buffer the device buffer the cr blocks are stored at
+ * @param width of the image
+ * @param height of the image
+ */
+void JPEGEncoder::enqueue_fused_kernel(device_context_t& device, cl::Buffer& image_buffer, cl::Buffer& y_block_buffer, cl::Buffer& cb_block_buffer,
+									   cl::Buffer& cr_block_buffer, size_t width, size_t height)
+{
+	cl_uint nbw = (width + 0x7) >> 0x3;
+	cl_uint nbh = (height + 0x7) >> 0x3;
+	cl_uint nsbw = (width + 0xF) >> 0x4;
+	cl_uint nsbh = (height + 0xF) >> 0x4;
+
+	/* Set the kernel arguments */
+	device.color_dct_quant.setArg<cl::Buffer>(0, device.color_conversion_table);
+	device.color_dct_quant.setArg<cl::Buffer>(1, image_buffer);
+	device.color_dct_quant.setArg<cl::Buffer>(2, y_block_buffer);
+	device.color_dct_quant.setArg<cl::Buffer>(3, cb_block_buffer);
+	device.color_dct_quant.setArg<cl::Buffer>(4, cr_block_buffer);
+	device.color_dct_quant.setArg<cl::Buffer>(5, device.fdct_divisors);
+	device.color_dct_quant.setArg<cl::Buffer>(6, device.fdct_multiplier);
+	device.color_dct_quant.setArg<cl::Buffer>(7, device.fdct_sign);
+	device.color_dct_quant.setArg<cl::Buffer>(8, device.fdct_indices);
+	device.color_dct_quant.setArg<cl::Buffer>(9, device.fdct_descaler);
+	device.color_dct_quant.setArg<cl::Buffer>(10, device.fdct_descaler_offset);
+	device.color_dct_quant.setArg<cl_uint>(11, nsbw);
+	device.color_dct_quant.setArg<cl_uint>(12, nbw);
+	device.color_dct_quant.setArg<cl_uint>(13, nbh);
+	device.color_dct_quant.setArg<cl_uint>(14, (cl_uint)width);
+	device.color_dct_quant.setArg<cl_uint>(15, (cl_uint)height);
+
+	/* One work group per super block */
+	device.queue.enqueueNDRangeKernel(device.color_dct_quant, 0, (nsbw * nsbh) << 0x8, 0x100);
+}
+
+/**
+ * Enqueue the separate kernels for color space transformation, downsampling,
+ * DCT and quantification. The YCbCr image is stored as separate planes in between.
+ *
+ * @param device the device to run on
+ * @param image_buffer the device buffer containing the RGB image
+ * @param plane_buffer the device buffer the Y, Cb and Cr planes are stored at
+ * @param y_block_buffer the device buffer the luminance super blocks are stored at
+ * @param cb_block_buffer the device buffer the cb blocks are stored at
+ * @param cr_block_buffer the device buffer the cr blocks are stored at
+ * @param width of the image
+ * @param height of the image
+ */
+void JPEGEncoder::enqueue_separate_kernels(device_context_t& device, cl::Buffer& image_buffer, cl::Buffer& plane_buffer, cl::Buffer& y_block_buffer,
+										   cl::Buffer& cb_block_buffer, cl::Buffer& cr_block_buffer, size_t width, size_t height)
+{
+	size_t wg;
+
+	/* The planes are padded to whole super blocks, each row starting at an aligned address */
+	size_t pitch = plane_pitch(device, width);
+	size_t plane_width = (width + 0xF) & ~(size_t)0xF;
+	size_t plane_height = (height + 0xF) & ~(size_t)0xF;
+	cl_uint plane_size = (cl_uint)(pitch * plane_height);
+
+	//
+	// Color Space Transformation
+	//
+	/* Set arguments, the conversion is computed without the table */
+	device.transformation_kernel.setArg<cl::Buffer>(0, image_buffer);
+	device.transformation_kernel.setArg<cl::Buffer>(1, plane_buffer);
+	device.transformation_kernel.setArg<cl_uint>(2, (cl_uint)width);
+	device.transformation_kernel.setArg<cl_uint>(3, (cl_uint)height);
+	device.transformation_kernel.setArg<cl_uint>(4, (cl_uint)pitch);
+	device.transformation_kernel.setArg<cl_uint>(5, plane_size);
+
+	/* Each work item converts four pixels of the padded planes, compute work group size to be
+	 * the closest bigger multiple of 64 to the number of groups of four pixels */
+	wg = ((((plane_width * plane_height) >> 0x2) + 0x3F) >> 0x6) << 0x6;
+	device.queue.enqueueNDRangeKernel(device.transformation_kernel, 0, wg, 0x40);
+
+
+	//
+	// Downsampling
+	//
+	/* Do the downsampling for the y channel
+	 * This does a full downsample, which means keeping all the pixels we already have
+	 * and splitting the image into the super block layout */
+
+	/* Compute the number of blocks in x and y direction */
+	cl_uint nbw = (width + 0x7) >> 0x3;
+	cl_uint nbh = (height + 0x7) >> 0x3;
+
+	/* Compute the number of super blocks in x and y direction */
+	cl_uint nsbw = (width + 0xF) >> 0x4;
+	cl_uint nsbh = (height + 0xF) >> 0x4;
+
+	/* Compute work group size */
+	wg = (nsbw * nsbh) << 0x8;
+
+	/* Set the kernel arguments */
+	device.downsample_full_kernel.setArg<cl::Buffer>(0, y_block_buffer);
+	device.downsample_full_kernel.setArg<cl::Buffer>(1, plane_buffer);
+	device.downsample_full_kernel.setArg<cl_uint>(2, nsbw);
+	device.downsample_full_kernel.setArg<cl_uint>(3, (cl_uint)pitch);
+
+	/* Execute kernel */
+	device.queue.enqueueNDRangeKernel(device.downsample_full_kernel, 0, wg, 0x40);
+
+
+	/* Downsample Cb/Cr Channels */
+	/* The number of blocks and super blocks stays the same,
+	 * since we do a 2:2 downsample only a fourth of the number
+	 * of original items are stored. */
+	wg = (nsbw * nsbh) << 0x6;
+
+	/* Set the kernel arguments */
+	device.downsample_2v2_kernel.setArg<cl::Buffer>(0, cb_block_buffer);
+	device.downsample_2v2_kernel.setArg<cl::Buffer>(1, cr_block_buffer);
+	device.downsample_2v2_kernel.setArg<cl::Buffer>(2, plane_buffer);
+	device.downsample_2v2_kernel.setArg<cl_uint>(3, nsbw);
+	device.downsample_2v2_kernel.setArg<cl_uint>(4, (cl_uint)pitch);
+	device.downsample_2v2_kernel.setArg<cl_uint>(5, plane_size);
+
+	/* Execute the kernel */
+	device.queue.enqueueNDRangeKernel(device.downsample_2v2_kernel, 0, wg, 0x40);
+
+	//
+	// DCT and Quantification
+	//
+	/* Prepare and execute kernel for y channel */
+	this->enqueue_dct_quant(device, y_block_buffer, 0, (nsbw * nsbh) << 0x8);
+
+	/* Prepare and execute kernel for cb and cr channel */
+	this->enqueue_dct_quant(device, cb_block_buffer, 0x100, (nsbw * nsbh) << 0x6);
+	this->enqueue_dct_quant(device, cr_block_buffer, 0x100, (nsbw * nsbh) << 0x6);
+
+	/* Zero out unused blocks on the right side */
+	wg = (nbh << 0x6);
+	device.zero_out_right.setArg<cl::Buffer>(0, y_block_buffer);
+	device.zero_out_right.setArg<cl_uint>(1, (cl_uint)nsbw);
+	device.zero_out_right.setArg<cl_uint>(2, (cl_uint)nsbh);
+	device.zero_out_right.setArg<cl_uint>(3, (cl_uint)nbw);
+	device.queue.enqueueNDRangeKernel(device.zero_out_right, 0, wg, 0x40);
+
+	/* Zero out unsued blocks on the bottom of the image */
+	wg = (nsbw << 0x7);
+	device.zero_out_bottom.setArg<cl::Buffer>(0, y_block_buffer);
+	device.zero_out_bottom.setArg<cl_uint>(1, (cl_uint)nsbw);
+	device.zero_out_bottom.setArg<cl_uint>(2, (cl_uint)nsbh);
+	device.zero_out_bottom.setArg<cl_uint>(3, (cl_uint)nbh);
+	device.queue.enqueueNDRangeKernel(device.zero_out_bottom, 0, wg, 0x80);
+}
+
+/**
+ * Enqueue the DCT and quantification of the blocks of one plane, using the sub-group
+ * variant of the kernel if the device supports it
+ *
+ * @param device the device to run on
+ * @param block_buffer the device buffer containing the blocks
+ * @param divisor_offset the offset of the divisors of the plane
+ * @param coefficients the number of coefficients in the buffer
+ */
+void JPEGEncoder::enqueue_dct_quant(device_context_t& device, cl::Buffer& block_buffer, cl_uint divisor_offset, size_t coefficients)
+{
+	if(device.use_subgroup_dct)
+	{
+		/* One work item per row of a block, rounded up to whole work groups. The other
+		 * tables of the DCT are part of the kernel */
+		cl_uint rows = (cl_uint)(coefficients >> 0x3);
+		device.dct_quant_subgroup.setArg<cl::Buffer>(0, block_buffer);
+		device.dct_quant_subgroup.setArg<cl::Buffer>(1, device.fdct_divisors);
+		device.dct_quant_subgroup.setArg<cl_uint>(2, divisor_offset);
+		device.dct_quant_subgroup.setArg<cl::Buffer>(3, device.fdct_descaler);
+		device.dct_quant_subgroup.setArg<cl::Buffer>(4, device.fdct_descaler_offset);
+		device.dct_quant_subgroup.setArg<cl_uint>(5, rows);
+		device.queue.enqueueNDRangeKernel(device.dct_quant_subgroup, 0x0, ((rows + 0x3F) >> 0x6) << 0x6, 0x40);
+	}
+	else
+	{
+		/* One work item per coefficient */
+		device.dct_quant.setArg<cl::Buffer>(0, block_buffer);
+		device.dct_quant.setArg<cl::Buffer>(1, device.fdct_divisors);
+		device.dct_quant.setArg<cl_uint>(2, divisor_offset);
+		device.dct_quant.setArg<cl::Buffer>(3, device.fdct_multiplier);
+		device.dct_quant.setArg<cl::Buffer>(4, device.fdct_sign);
+		device.dct_quant.setArg<cl::Buffer>(5, device.fdct_indices);
+		device.dct_quant.setArg<cl::Buffer>(6, device.fdct_descaler);
+		device.dct_quant.setArg<cl::Buffer>(7, device.fdct_descaler_offset);
+		device.queue.enqueueNDRangeKernel(device.dct_quant, 0x0, coefficients, 0x40);
+	}
+}
+
+/**
+ * Create a future that is already satisfied with the given value
+ *
+ * @param value the value of the future
+ * @return the future
+ */
+static std::future<int> ready_future(int value)
+{
+	std::promise<int> promise;
+	promise.set_value(value);
+	return promise.get_future();
+}
+
+/**
+ * Encode the given image
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param file the output file to store the image at
+ * @return 0 on success
+ */
+int JPEGEncoder::encode_image(unsigned char *image, size_t width, size_t height, const char * const file)
+{
+	return this->encode_async(image, width, height, file).get();
+}
+
+/**
+ * Encode the given image on the device and, unless cpu is 0, compare the coefficients
+ * with those computed on the host before writing it
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param file the output file to store the image at
+ * @param cpu 0 iff cpu shall not be used to compare and validate
+ * @return 0 on success, 7 if the coefficients differ
+ */
+int JPEGEncoder::encode_image(unsigned char *image, size_t width, size_t height, const char * const file, int cpu)
+{
+	encode_target_t target = {NULL, NULL, 0, NULL, NULL};
+	target.validate = cpu != 0;
+
+	/* Make sure the image pointer is valid */
+	if(image == NULL)
+	{
+		fprintf(stderr, "Image data needs to be provided\n");
+		return 0x2;
+	}
+
+	if(this->open_file_target(file, target) != 0x0)
+		return 0x1;
+
+	return this->enqueue_encode(image, width, height, target).get();
+}
+
+/**
+ * Encode the given image into the given buffer. Passing no buffer with a capacity
+ * of 0 only determines the size.
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param output the buffer to store the image at
+ * @param capacity the size of the buffer in bytes
+ * @param size receives the size of the image in bytes, also if the buffer is too small, may be NULL
+ * @return 0 on success, 5 if the buffer is too small
+ */
+int JPEGEncoder::encode_image(unsigned char *image, size_t width, size_t height, char *output, size_t capacity, size_t *size)
+{
+	encode_target_t target = {NULL, output, capacity, NULL, size};
+
+	/* Make sure the output pointer is valid */
+	if(output == NULL && capacity > 0)
+	{
+		fprintf(stderr, "An output buffer needs to be provided\n");
+		return 0x2;
+	}
+
+	return this->enqueue_encode(image, width, height, target).get();
+}
+
+/**
+ * Encode the given image into the given vector, which is resized to the size of the image
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param output the vector to store the image in
+ * @return 0 on success
+ */
+int JPEGEncoder::encode_image(unsigned char *image, size_t width, size_t height, std::vector<char>& output)
+{
+	encode_target_t target = {NULL, NULL, 0, &output, NULL};
+	return this->enqueue_encode(image, width, height, target).get();
+}
+
+/**
+ * Encode the given image and pass the output to the sink as it is produced. The headers
+ * are passed at once, the entropy coded data after each row of super blocks, so only a
+ * single row of output is held. With multiple entropy threads the data is passed after
+ * each chunk coded in parallel, in order as the chunks are done. The chunks coded ahead
+ * are held until they are passed on, which can add up to the coded size of the image.
+ *
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param sink receives the output, called on the thread doing the entropy coding
+ * @return 0 on success, 6 if the sink aborted the encoding
+ */
+int JPEGEncoder::encode_image(unsigned char *image, size_t width, size_t height, const output_sink_t& sink)
+{
+	return this->encode_async(image, width, height, sink).get();
+}
+
+/**
+ * Start encoding the given image, the output is passed to the sink as it is produced.
+ * See encode_image and encode_async.
+ *
+ * @param image pointer to the image data in flat row major layout, needs to stay valid until the future is ready
+ * @param width of the image
+ * @param height of the image
+ * @param sink receives the output, called on the thread doing the entropy coding
+ * @return future holding 0 on success, 6 if the sink aborted the encoding
+ */
+std::future<int> JPEGEncoder::encode_async(unsigned char *image, size_t width, size_t height, const output_sink_t& sink)
+{
+	encode_target_t target = {NULL, NULL, 0, NULL, NULL, sink};
+
+	/* Make sure there is a sink */
+	if(!sink)
+	{
+		fprintf(stderr, "A sink needs to be provided\n");
+		return ready_future(0x2);
+	}
+
+	return this->enqueue_encode(image, width, height, target);
+}
+
+/**
+ * Get the largest size an image of the given size can be encoded to,
+ * a buffer of this size is never too small
+ *
+ * @param width of the image
+ * @param height of the image
+ * @return the size in bytes
+ */
+size_t JPEGEncoder::output_bound(size_t width, size_t height)
+{
+	return HEADER_OUTPUT_BOUND + ((width + 0xF) >> 0x4) * ((height + 0xF) >> 0x4) * MCU_OUTPUT_BOUND;
+}
+
+/**
+ * Start encoding the given image. Uploading and running the kernels is enqueued
+ * to the device, the entropy coding runs on its own thread as soon as the
+ * coefficients are read back. Up to ENCODE_SLOTS images are in flight, further
+ * calls block until the oldest image is done. The returned future does not block
+ * when it is destroyed, the encoder waits for all images to be done on destruction.
+ *
+ * @param image pointer to the image data in flat row major layout, needs to stay valid until the future is ready
+ * @param width of the image
+ * @param height of the image
+ * @param file the output file to store the image at
+ * @return future holding 0 on success
+ */
+std::future<int> JPEGEncoder::encode_async(unsigned char *image, size_t width, size_t height, const char * const file)
+{
+	encode_target_t target = {NULL, NULL, 0, NULL, NULL};
+
+	/* Make sure the image pointer is valid */
+	if(image == NULL)
+	{
+		fprintf(stderr, "Image data needs to be provided\n");
+		return ready_future(0x2);
+	}
+
+	if(this->open_file_target(file, target) != 0x0)
+		return ready_future(0x1);
+
+	return this->enqueue_encode(image, width, height, target);
+}
+
+/**
+ * Open the given file as the target of an image, files opened through the file
+ * writer are passed on as they are produced
+ *
+ * @param file the output file
+ * @param target the target receiving the file
+ * @return 0 on success, 1 if the file could not be opened
+ */
+int JPEGEncoder::open_file_target(const char * const file, encode_target_t& target)
+{
+	if(this->m_file_writer != NULL)
+	{
+		FileWriter *writer = this->m_file_writer;
+		writer_file_t *wfile = writer->open(file);
+		target.writer = writer;
+		target.wfile = wfile;
+		target.sink = [writer, wfile](const char *data, size_t size) { return writer->write(wfile, data, size); };
+	}
+	else
+		target.fp = fopen(file, "wb");
+	if(target.fp == NULL && target.wfile == NULL)
+	{
+		fprintf(stderr, "The file \'%s\' could not be opened, aborting compressing\n", file);
+		return 0x1;
+	}
+	return 0x0;
+}
+
+/**
+ * Enqueue the device part of encoding the given image and start the entropy coding
+ * on its own thread once the coefficients are read back
+ *
+ * @param image pointer to the image data in flat row major layout, needs to stay valid until the future is ready
+ * @param width of the image
+ * @param height of the image
+ * @param target where to write the image to
+ * @return future holding 0 on success
+ */
+std::future<int> JPEGEncoder::enqueue_encode(unsigned char *image, size_t width, size_t height, encode_target_t target)
+{
+	cl::Event done;
+
+	/* Make sure the image pointer is valid */
+	if(image == NULL)
+	{
+		fprintf(stderr, "Image data needs to be provided\n");
+		return ready_future(0x2);
+	}
+
+	/* Wait until the slot used by the oldest image is released */
+	std::unique_lock<std::mutex> lock(this->m_lock);
+	size_t slot = this->m_next_slot;
+	encode_buffers_t *buffers = &this->m_buffers[slot];
+	this->m_slot_released.wait(lock, [buffers] { return !buffers->busy; });
+	this->m_next_slot = (this->m_next_slot + 1) % ENCODE_SLOTS;
+	buffers->busy = true;
+
+	/* The previous thread of the slot released it as its last step */
+	if(this->m_workers[slot].joinable())
+		this->m_workers[slot].join();
+
+	/* Small images are encoded on the host and images taller than a chunk are split across
+	 * the devices, both on the entropy thread. The others are enqueued to the first device right away.
+	 * Images validated against the host are always processed on the device, if there is one */
+	bool host = this->m_devices.empty() || (!target.validate && width * height < this->m_host_threshold);
+	bool split = !host && this->m_multi_device && this->m_devices.size() > 1 && height > (DEVICE_CHUNK_MCU_ROWS << 0x4);
+	if(host || split)
+		this->allocate_host_buffers(*buffers, width, height);
+	else
+	{
+		this->allocate_buffers(this->m_devices[0], *buffers, width, height);
+		this->enqueue_image(this->m_devices[0], *buffers, image, width, height, done);
+	}
+
+	/* Room for the worst case output, so the entropy coder never has to check. A sink
+	 * is passed the output as it is produced, so a single row of super blocks is held */
+	size_t nsbw = (width + 0xF) >> 0x4;
+	size_t output_mcus = target.sink ? nsbw : nsbw * ((height + 0xF) >> 0x4);
+	buffers->output.next = buffers->output.data.get();
+	reserve_output(buffers->output, HEADER_OUTPUT_BOUND + output_mcus * MCU_OUTPUT_BOUND);
+	lock.unlock();
+
+	/* Entropy code once the coefficients arrived on the host. The thread is owned by the slot
+	 * instead of the future, so dropping the future does not wait for the image */
+	std::promise<int> promise;
+	std::future<int> result = promise.get_future();
+	this->m_workers[slot] = std::thread([this, buffers, done, host, split, image, width, height, target](std::promise<int> promise)
+	{
+		if(host)
+			this->encode_on_host(*buffers, image, width, height);
+		else if(split)
+			this->encode_on_devices(*buffers, image, width, height);
+		else
+			done.wait();
+		size_t mismatches = target.validate && !host ? this->validate_coefficients(*buffers, image, width, height) : 0;
+		int ret = this->write_image(*buffers, width, height, target);
+		if(target.wfile != NULL)
+			target.writer->close(target.wfile);
+		if(ret == 0x0 && mismatches > 0)
+			ret = 0x7;
+		promise.set_value(ret);
+
+		std::lock_guard<std::mutex> guard(this->m_lock);
+		buffers->busy = false;
+		this->m_slot_released.notify_all();
+	}, std::move(promise));
+	return result;
+}
+
+/**
+ * Enqueue uploading the image, the kernels and reading back the coefficients.
+ * Nothing is waited for.
+ *
+ * @param device the device to run on
+ * @param buffers the buffers to use, large enough for the image
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ * @param done event set when the coefficients are on the host
+ */
+void JPEGEncoder::enqueue_image(device_context_t& device, encode_buffers_t& buffers, unsigned char *image, size_t width, size_t height, cl::Event& done)
+{
+	cl::Buffer image_buffer = buffers.image;
+	size_t image_size = sizeof(unsigned char) * 3 * width * height;
+
+	/* With unified memory the kernels read the image right from the host memory. The runtime
+	 * copies anyways if the pointer does not satisfy the alignment of the device. */
+	if(device.zero_copy && ((size_t)image % device.host_ptr_alignment) == 0)
+		image_buffer = cl::Buffer(this->m_context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, image_size, image);
+	else
+		device.queue.enqueueWriteBuffer(image_buffer, false, 0, image_size, image);
+
+	/* For future processing the image, which is currently in flat row layout, is split
+	 * into super blocks containing of 4 sub blocks each which represent a full
+	 * MCU block
+	 *
+	 * Where each rx is a row and each ax/bx/.../zx is a super block
+	 * 										+---------
+	 *										| a1 a2 a3 ...
+	 *	[r1.....][r2.....]....[rn.....] =>	| b1 b2 b3 ...
+	 *										..............
+	 *										| z1 z2 z3 ...
+	 *										+---------			The super block is stored in
+	 *											|				in flat layout hierarchy
+	 *											v
+	 *						[a1 a2 a3...][b1 b2 b3...]...[z1 z2 z3...]
+	 *
+	 * [0][1][2][3]
+	 *	   ^
+	 *	   |
+	 *  +-----+		Each superblock contains 4 sub blocks which are
+	 *	| 0 1 |		are ordered as displayed, where each of the four
+	 *	| 2 3 |		sub blocks represents a full MCU block
+	 *	+-----+		the are stored in a flat layout in memory
+	 *
+	 * The Cb/Cr channels are downsampled 2:2, therefore each super block contains
+	 * only a single block for each of them.
+	 */
+	size_t super_blocks = ((width + 0xF) >> 0x4) * ((height + 0xF) >> 0x4);
+
+	/* Run color space transformation, downsampling, DCT and quantification,
+	 * kernel arguments are shared so this is done while holding the lock */
+	{
+		std::lock_guard<std::mutex> guard(device.lock);
+		if(device.use_fused_kernel)
+			this->enqueue_fused_kernel(device, image_buffer, buffers.y_blocks, buffers.cb_blocks, buffers.cr_blocks, width, height);
+		else
+			this->enqueue_separate_kernels(device, image_buffer, buffers.planes, buffers.y_blocks, buffers.cb_blocks, buffers.cr_blocks, width, height);
+	}
+	buffers.device = &device;
+	buffers.mapped = device.zero_copy;
+	buffers.bottom_fixed = device.use_fused_kernel;
+
+	if(device.zero_copy)
+	{
+		/* Map the coefficients into the host address space, the separate kernels need the
+		 * luminance to be writable to fix up the blocks on the bottom */
+		cl_map_flags y_flags = device.use_fused_kernel ? CL_MAP_READ : CL_MAP_READ | CL_MAP_WRITE;
+		buffers.y_host = (short*)device.queue.enqueueMapBuffer(buffers.y_blocks, false, y_flags, 0, sizeof(short) * super_blocks << 0x8);
+		buffers.cb_host = (short*)device.queue.enqueueMapBuffer(buffers.cb_blocks, false, CL_MAP_READ, 0, sizeof(short) * super_blocks << 0x6);
+		buffers.cr_host = (short*)device.queue.enqueueMapBuffer(buffers.cr_blocks, false, CL_MAP_READ, 0, sizeof(short) * super_blocks << 0x6, NULL, &done);
+	}
+	else
+	{
+		/* Copy result back to host to perform entropy on host device */
+		buffers.y_host = buffers.y.data();
+		buffers.cb_host = buffers.cb.data();
+		buffers.cr_host = buffers.cr.data();
+		device.queue.enqueueReadBuffer(buffers.y_blocks, false, 0, sizeof(short) * super_blocks << 0x8, buffers.y_host);
+		device.queue.enqueueReadBuffer(buffers.cb_blocks, false, 0, sizeof(short) * super_blocks << 0x6, buffers.cb_host);
+		device.queue.enqueueReadBuffer(buffers.cr_blocks, false, 0, sizeof(short) * super_blocks << 0x6, buffers.cr_host, NULL, &done);
+	}
+	device.queue.flush();
+}
+
+/**
+ * Hand the coefficient planes back to the device after the entropy coding,
+ * only needed if they are mapped
+ *
+ * @param buffers the buffers holding the coefficients
+ */
+void JPEGEncoder::release_coefficients(encode_buffers_t& buffers)
+{
+	if(buffers.mapped)
+	{
+		cl::CommandQueue& queue = buffers.device->queue;
+		queue.enqueueUnmapMemObject(buffers.y_blocks, buffers.y_host);
+		queue.enqueueUnmapMemObject(buffers.cb_blocks, buffers.cb_host);
+		queue.enqueueUnmapMemObject(buffers.cr_blocks, buffers.cr_host);
+		queue.flush();
+		buffers.mapped = false;
+	}
+}
+
+/**
+ * Take the next chunk for the given device, from its own range if any is left,
+ * otherwise the last one of the device with the most chunks left is stolen
+ *
+ * @param schedule the chunks left per device
+ * @param index the index of the device
+ * @param chunk the chunk taken
+ * @return false if no chunks are left
+ */
+static bool take_chunk(chunk_schedule_t& schedule, size_t index, size_t *chunk)
+{
+	std::lock_guard<std::mutex> guard(schedule.lock);
+	chunk_range_t& own = schedule.ranges[index];
+	if(own.next < own.end)
+	{
+		*chunk = own.next++;
+		return true;
+	}
+
+	size_t victim = index;
+	for(size_t i = 0; i < schedule.ranges.size(); ++i)
+	{
+		if(schedule.ranges[i].end - schedule.ranges[i].next > schedule.ranges[victim].end - schedule.ranges[victim].next)
+			victim = i;
+	}
+	if(victim == index)
+		return false;
+	*chunk = --schedule.ranges[victim].end;
+	return true;
+}
+
+/**
+ * Process the given image in chunks of MCU rows on all devices and merge the
+ * coefficients into the host planes of the given buffers. Each device starts on
+ * an even share of the chunks and steals from the others once it is done.
+ *
+ * @param buffers the buffers of the image, the host planes need to fit the image
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ */
+void JPEGEncoder::encode_on_devices(encode_buffers_t& buffers, unsigned char *image, size_t width, size_t height)
+{
+	size_t nsbh = (height + 0xF) >> 0x4;
+	size_t chunks = (nsbh + DEVICE_CHUNK_MCU_ROWS - 1) / DEVICE_CHUNK_MCU_ROWS;
+	size_t devices = this->m_devices.size();
+	chunk_schedule_t schedule;
+
+	/* Contiguous shares keep the rows a device reads and writes together */
+	schedule.ranges.resize(devices);
+	for(size_t i = 0; i < devices; ++i)
+	{
+		schedule.ranges[i].next = chunks * i / devices;
+		schedule.ranges[i].end = chunks * (i + 1) / devices;
+	}
+
+	/* One thread per device feeds its queue, the first device is fed by this thread */
+	std::vector<std::thread> workers;
+	for(size_t i = 1; i < devices; ++i)
+		workers.emplace_back(&JPEGEncoder::encode_chunks, this, i, std::ref(schedule), std::ref(buffers), image, width, height);
+	this->encode_chunks(0, schedule, buffers, image, width, height);
+	for(size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+/**
+ * Process chunks on the given device until none are left, the next chunk is
+ * enqueued before the previous one is merged
+ *
+ * @param index the index of the device
+ * @param schedule the chunks left per device
+ * @param buffers the buffers of the image
+ * @param image pointer to the image data in flat row major layout
+ * @param width of the image
+ * @param height of the image
+ */
+void JPEGEncoder::encode_chunks(size_t index, chunk_schedule_t& schedule, encode_buffers_t& buffers, unsigned char *image, size_t width, size_t height)
+{
+	device_context_t& device = this->m_devices[index];
+	encode_buffers_t *chunk_buffers = device.chunks[&buffers - this->m_buffers];
+	size_t nsbw = (width + 0xF) >> 0x4;
+	size_t chunk_height = DEVICE_CHUNK_MCU_ROWS << 0x4;
+	size_t chunk[0x2];
+	bool pending[0x2] = {false, false};
+	cl::Event done[0x2];
+	size_t slot = 0;
+
+	for(;;)
+	{
+		bool taken = take_chunk(schedule, index, &chunk[slot]);
+		if(taken)
+		{
+			size_t first_row = chunk[slot] * chunk_height;
+			size_t rows = height - first_row < chunk_height ? height - first_row : chunk_height;
+			this->allocate_buffers(device, chunk_buffers[slot], width, chunk_height);
+			this->enqueue_image(device, chunk_buffers[slot], image + 3 * width * first_row, width, rows, done[slot]);
+			pending[slot] = true;
+		}
+
+		/* Merge the previous chunk while the device works on this one */
+		slot ^= 0x1;
+		if(pending[slot])
+		{
+			encode_buffers_t& source = chunk_buffers[slot];
+			size_t first_row = chunk[slot] * chunk_height;
+			size_t rows = height - first_row < chunk_height ? height - first_row : chunk_height;
+			size_t first = chunk[slot] * DEVICE_CHUNK_MCU_ROWS * nsbw;
+			size_t super_blocks = ((rows + 0xF) >> 0x4) * nsbw;
+
+			done[slot].wait();
+			memcpy(buffers.y_host + (first << 0x8), source.y_host, sizeof(short) * (super_blocks << 0x8));
+			memcpy(buffers.cb_host + (first << 0x6), source.cb_host, sizeof(short) * (super_blocks << 0x6));
+			memcpy(buffers.cr_host + (first << 0x6), source.cr_host, sizeof(short) * (super_blocks << 0x6));
+			this->release_coefficients(source);
+			pending[slot] = false;
+		}
+		else if(!taken)
+			break;
+	}
+}
+
+/**
+ * Entropy code the coefficients in the host buffers and write the
+ * image to the target. A target file is closed afterwards.
+ *
+ * @param buffers the buffers holding the coefficients
+ * @param width of the image
+ * @param height of the image
+ * @param target where to write the image to
+ * @return 0 on success, 5 if the target buffer is too small
+ */
+int JPEGEncoder::write_image(encode_buffers_t& buffers, size_t width, size_t height, const encode_target_t& target)
+{
+	output_arena_t& output_buffer = buffers.output;
+	entropy_state_t state;
+	int ret;
+
+	/* Write the file, frame and scan header to the output buffer */
+	output_buffer.next = output_buffer.data.get();
+	this->write_file_header(output_buffer);
+	this->write_frame_header(output_buffer, width, height);
+	this->write_scan_header(output_buffer);
+	ret = pass_output(output_buffer, target.sink);
+
+	/* Entropy coding */
+	this->reset_entropy_state(state);
+	if(ret == 0x0)
+	{
+		if(this->m_restart_interval > 0 && this->m_entropy_threads > 1)
+			ret = this->encode_restart_intervals(buffers, width, height, output_buffer, target.sink);
+		else if(this->m_entropy_threads > 1)
+			ret = this->encode_stitched(buffers, width, height, output_buffer, state, target.sink);
+		else if(target.sink)
+		{
+			/* Pass the output on after each row of super blocks, so only a single row is held */
+			size_t nsbw = (width + 0xF) >> 0x4;
+			size_t nsbh = (height + 0xF) >> 0x4;
+			this->fix_bottom_blocks(buffers, width, height);
+			for(size_t row = 0; row < nsbh && ret == 0x0; ++row)
+			{
+				this->encode_mcus(buffers, row * nsbw, (row + 1) * nsbw, output_buffer, state);
+				ret = pass_output(output_buffer, target.sink);
+			}
+		}
+		else
+			this->encode_coefficients(buffers, width, height, output_buffer, state);
+	}
+	this->release_coefficients(buffers);
+	if(ret != 0x0)
+		return ret;
+
+	this->flush_entropy(output_buffer, state);
+
+	/* Write the file tailor to the output buffer */
+	write_marker(output_buffer, 0xD9);
+	if(target.sink)
+		return pass_output(output_buffer, target.sink);
+
+	/* write the content to the file or memory */
+	size_t size = output_size(output_buffer);
+	if(target.size != NULL)
+		*target.size = size;
+
+	if(target.fp != NULL)
+	{
+		(void)fwrite(output_buffer.data.get(), sizeof(char), size, target.fp);
+		fclose(target.fp);
+	}
+	else if(target.owned != NULL)
+		target.owned->assign(output_buffer.data.get(), output_buffer.next);
+	else if(size > target.capacity)
+	{
+		/* Passing no buffer only queries the size */
+		if(target.buffer != NULL || target.capacity > 0)
+			fprintf(stderr, "The output buffer holds %zu bytes, the image requires %zu bytes\n", target.capacity, size);
+		return 0x5;
+	}
+	else
+		memcpy(target.buffer, output_buffer.data.get(), size);
+
+	return 0x0;
+}
+
+/**
+ * Entropy code all super blocks in the host buffers
+ *
+ * @param buffers the buffers holding the coefficients
+ * @param width of the image (or strip)
+ * @param height of the image (or strip)
+ * @param output_buffer the output buffer
+ * @param state the entropy state, carried on from previous strips
+ */
+void JPEGEncoder::encode_coefficients(encode_buffers_t& buffers, size_t width, size_t height, output_arena_t& output_buffer, entropy_state_t& state)
+{
+	size_t mcus = ((width + 0xF) >> 0x4) * ((height + 0xF) >> 0x4);
+
+	this->fix_bottom_blocks(buffers, width, height);
+	this->encode_mcus(buffers, 0, mcus, output_buffer, state);
+}
+
+/**
+ * Set the dc values of the blocks below the image, which are zeroed by the separate kernels
+ *
+ * @param buffers the buffers holding the coefficients
+ * @param width of the image (or strip)
+ * @param height of the image (or strip)
+ */
+void JPEGEncoder::fix_bottom_blocks(encode_buffers_t& buffers, size_t width, size_t height)
+{
+	/* Compute the number of blocks in y direction */
+	cl_uint nbh = (height + 0x7) >> 0x3;
+
+	/* Compute the number of super blocks in x and y direction */
+	cl_uint nsbw = (width + 0xF) >> 0x4;
+	cl_uint nsbh = (height + 0xF) >> 0x4;
+
+	/* For convenient access, cast to 3D array */
+	short (*y_blocks)[0x4][0x40] = (short (*)[0x4][0x40])buffers.y_host;
+
+	/* As mentioned in the kernel code we can not the field zero values in the kernel
+	 * since neighboring blocks are processed concurrently.
+	 * Since the entropy encoding is performed on the host the data needs to be copied
+	 * anyways, so setting these values on the host does not introduce an extra
+	 * copy operation. The fused kernel already did this on its own. */
+	size_t super_block_y = nsbh - 1;
+	size_t super_block_id_base = (super_block_y * nsbw);
+	for(size_t gx = 0; gx < nsbw && !buffers.bottom_fixed; ++gx)
+	{
+		if ((super_block_y << 0x1) + 1 >= nbh) {
+			size_t super_block_x = gx;
+			size_t super_block_id = super_block_id_base + super_block_x;
+			short value = y_blocks[super_block_id][1][0];
+			y_blocks[super_block_id][2][0] = value;
+			y_blocks[super_block_id][3][0] = value;
+		}
+	}
+}
+
+/**
+ * Entropy code the given range of super blocks, emitting restart markers if enabled
+ *
+ * @param buffers the buffers holding the coefficients
+ * @param first the first super block
+ * @param last the super block after the last one to code
+ * @param output_buffer the output buffer
+ * @param state the entropy state
+ */
+void JPEGEncoder::encode_mcus(encode_buffers_t& buffers, size_t first, size_t last, output_arena_t& output_buffer, entropy_state_t& state)
+{
+	/* For convenient access, cast to 3D/2D arrays */
+	short (*y_blocks)[0x4][0x40] = (short (*)[0x4][0x40])buffers.y_host;
+	short (*cb_blocks)[0x40] = (short (*)[0x40])buffers.cb_host;
+	short (*cr_blocks)[0x40] = (short (*)[0x40])buffers.cr_host;
+
+	/* A no-op unless the arena was not sized for the image */
+	reserve_output(output_buffer, (last - first) * MCU_OUTPUT_BOUND + HEADER_OUTPUT_BOUND);
+
+	short *mcu_buffer[0x6];
+	for(size_t i = first; i < last; ++i)
+	{
+		if(this->m_restart_interval && state.restarts_to_go == 0)
+			this->emit_restart(output_buffer, state);
+
+		/* Perform entropy encoding on each block */
+		mcu_buffer[0] = y_blocks[i][0];
+		mcu_buffer[1] = y_blocks[i][1];
+		mcu_buffer[2] = y_blocks[i][2];
+		mcu_buffer[3] = y_blocks[i][3];
+		mcu_buffer[4] = cb_blocks[i];
+		mcu_buffer[5] = cr_blocks[i];
+		this->encode_entropy(mcu_buffer, output_buffer, state);
+
+		if(this->m_restart_interval)
+		{
+			if(state.restarts_to_go == 0)
+			{
+				state.restarts_to_go = this->m_restart_interval;
+				state.next_restart_num = (state.next_restart_num + 1) & 0x7;
+			}
+			state.restarts_to_go--;
+		}
+	}
+}
+
+/**
+ * Code the given number of chunks on multiple threads and pass them on in order.
+ * The calling thread codes chunks as well and passes on each chunk as soon as it
+ * and all chunks before it are coded. Once passing a chunk on fails no further
+ * chunks are coded.
+ *
+ * @param chunks the number of chunks
+ * @param threads the number of threads, including the calling one
+ * @param code codes the chunk of the given index
+ * @param pass passes on the chunk of the given index, returning non-zero on failure
+ * @return 0 on success, the result of pass otherwise
+ */
+int JPEGEncoder::code_chunks(size_t chunks, size_t threads, const std::function<void(size_t)>& code, const std::function<int(size_t)>& pass)
+{
+	std::mutex lock;
+	std::condition_variable finished;
+	std::vector<char> done(chunks, 0);
+	std::atomic<size_t> next_chunk(0);
+
+	auto code_chunk = [&](size_t chunk)
+	{
+		code(chunk);
+		std::lock_guard<std::mutex> guard(lock);
+		done[chunk] = 1;
+		finished.notify_all();
+	};
+	auto worker = [&]()
+	{
+		for(size_t chunk = next_chunk++; chunk < chunks; chunk = next_chunk++)
+			code_chunk(chunk);
+	};
+
+	std::vector<std::thread> pool;
+	for(size_t i = 1; i < threads; ++i)
+		pool.emplace_back(worker);
+
+	/* Pass on the chunks done after each chunk coded here, waiting for them once none are left */
+	int ret = 0x0;
+	size_t passed = 0;
+	while(passed < chunks && ret == 0x0)
+	{
+		size_t chunk = next_chunk++;
+		if(chunk < chunks)
+			code_chunk(chunk);
+
+		std::unique_lock<std::mutex> guard(lock);
+		if(chunk >= chunks)
+			finished.wait(guard, [&] { return done[passed] != 0; });
+		while(passed < chunks && done[passed] && ret == 0x0)
+		{
+			guard.unlock();
+			ret = pass(passed++);
+			guard.lock();
+		}
+	}
+
+	/* Have the other threads stop after their current chunk */
+	if(ret != 0x0)
+		next_chunk = chunks;
+	for(size_t i = 0; i < pool.size(); ++i)
+		pool[i].join();
+	return ret;
+}
+
+/**
+ * Entropy code the super blocks with restart markers enabled, the restart intervals
+ * are independent and are therefore distributed over multiple threads. Each thread
+ * codes consecutive intervals into a buffer of its own, which are concatenated in
+ * order as they are done, so the output does not depend on the number of threads.
+ *
+ * @param buffers the buffers holding the coefficients
+ * @param width of the image
+ * @param height of the image
+ * @param output_buffer the output buffer
+ * @param sink receives the output after each chunk of intervals, if not empty
+ * @return 0 on success, 6 if the sink aborted the encoding
+ */
+int JPEGEncoder::encode_restart_intervals(encode_buffers_t& buffers, size_t width, size_t height, output_arena_t& output_buffer, const output_sink_t& sink)
+{
+	size_t mcus = ((width + 0xF) >> 0x4) * ((height + 0xF) >> 0x4);
+	size_t intervals = (mcus + this->m_restart_interval - 1) / this->m_restart_interval;
+	size_t threads = this->m_entropy_threads < intervals ? this->m_entropy_threads : intervals;
+
+	/* A few chunks per thread even out intervals that take longer to code */
+	size_t chunks = threads << 0x2 < intervals ? threads << 0x2 : intervals;
+	size_t chunk_intervals = (intervals + chunks - 1) / chunks;
+	chunks = (intervals + chunk_intervals - 1) / chunk_intervals;
+
+	this->fix_bottom_blocks(buffers, width, height);
+
+	if(buffers.chunks.size() < chunks)
+		buffers.chunks.resize(chunks);
+
+	auto code = [&](size_t chunk)
+	{
+		size_t first_interval = chunk * chunk_intervals;
+		size_t first = first_interval * this->m_restart_interval;
+		size_t last = first + chunk_intervals * this->m_restart_interval;
+		if(last > mcus)
+			last = mcus;
+
+		/* Start with the restart marker ending the previous interval */
+		entropy_state_t state;
+		this->reset_entropy_state(state);
+		if(first_interval > 0)
+		{
+			state.restarts_to_go = 0;
+			state.next_restart_num = (first_interval - 1) & 0x7;
+		}
+
+		buffers.chunks[chunk].next = buffers.chunks[chunk].data.get();
+		this->encode_mcus(buffers, first, last, buffers.chunks[chunk], state);
+		this->flush_entropy(buffers.chunks[chunk], state);
+	};
+	auto pass = [&](size_t chunk)
+	{
+		size_t size = output_size(buffers.chunks[chunk]);
+		reserve_output(output_buffer, size);
+		memcpy(output_buffer.next, buffers.chunks[chunk].data.get(), size);
+		output_buffer.next += size;
+		return pass_output(output_buffer, sink);
+	};
+	return this->code_chunks(chunks, threads, code, pass);
+}
+
+/**
+ * Entropy code the super blocks on multiple threads without restart markers.
+ * The super blocks are split into chunks, each starting with the dc values of the
+ * super block before it. The chunks are coded into separate buffers without byte
+ * stuffing, shifted into place in the output and stuffed as they are done.
+ * The output is identical to coding all super blocks on a single thread.
+ *
+ * @param buffers the buffers holding the coefficients
+ * @param width of the image
+ * @param height of the image
+ * @param output_buffer the output buffer
+ * @param state the entropy state, the remaining bits are left in it
+ * @param sink receives the output after each chunk, if not empty
+ * @return 0 on success, 6 if the sink aborted the encoding
+ */
+int JPEGEncoder::encode_stitched(encode_buffers_t& buffers, size_t width, size_t height, output_arena_t& output_buffer, entropy_state_t& state,
+								 const output_sink_t& sink)
+{
+	size_t mcus = ((width + 0xF) >> 0x4) * ((height + 0xF) >> 0x4);
+	size_t threads = this->m_entropy_threads < mcus ? this->m_entropy_threads : mcus;
+
+	/* A few chunks per thread even out super blocks that take longer to code */
+	size_t chunks = threads << 0x2 < mcus ? threads << 0x2 : mcus;
+	size_t chunk_mcus = (mcus + chunks - 1) / chunks;
+	chunks = (mcus + chunk_mcus - 1) / chunk_mcus;
+
+	this->fix_bottom_blocks(buffers, width, height);
+
+	short (*y_blocks)[0x4][0x40] = (short (*)[0x4][0x40])buffers.y_host;
+	short (*cb_blocks)[0x40] = (short (*)[0x40])buffers.cb_host;
+	short (*cr_blocks)[0x40] = (short (*)[0x40])buffers.cr_host;
+
+	if(buffers.chunks.size() < chunks)
+		buffers.chunks.resize(chunks);
+	std::vector<entropy_state_t> chunk_states(chunks);
+
+	auto code = [&](size_t chunk)
+	{
+		size_t first = chunk * chunk_mcus;
+		size_t last = first + chunk_mcus < mcus ? first + chunk_mcus : mcus;
+		entropy_state_t& chunk_state = chunk_states[chunk];
+
+		/* The dc values are predicted from the last blocks of the previous super block */
+		this->reset_entropy_state(chunk_state);
+		chunk_state.stuffing = false;
+		if(first > 0)
+		{
+			chunk_state.last_dc_val[0] = y_blocks[first - 1][3][0];
+			chunk_state.last_dc_val[1] = cb_blocks[first - 1][0];
+			chunk_state.last_dc_val[2] = cr_blocks[first - 1][0];
+		}
+
+		buffers.chunks[chunk].next = buffers.chunks[chunk].data.get();
+		this->encode_mcus(buffers, first, last, buffers.chunks[chunk], chunk_state);
+	};
+
+	/* Stitch the chunks together, including the bits not yet emitted, and stuff the bytes emitted.
+	 * The room reserved covers every byte of the chunk and of the bits carried over being stuffed */
+	auto pass = [&](size_t chunk)
+	{
+		const unsigned char *data = (const unsigned char*)buffers.chunks[chunk].data.get();
+		size_t length = output_size(buffers.chunks[chunk]), j = 0;
+		size_t start = output_size(output_buffer);
+		reserve_output(output_buffer, (length + 0x10) << 0x1);
+		for(; j + 0x4 <= length; j += 0x4)
+			put_bits(output_buffer, state, ((uint64_t)data[j] << 0x18) | (data[j + 1] << 0x10) | (data[j + 2] << 0x8) | data[j + 3], 0x20);
+		for(; j < length; ++j)
+			put_bits(output_buffer, state, data[j], 0x8);
+
+		int bits = 0x40 - chunk_states[chunk].free_bits;
+		if(bits > 0x20)
+		{
+			put_bits(output_buffer, state, chunk_states[chunk].buffer >> 0x20, bits - 0x20);
+			bits = 0x20;
+		}
+		put_bits(output_buffer, state, chunk_states[chunk].buffer, bits);
+		stuff_bytes(output_buffer, start);
+		return pass_output(output_buffer, sink);
+	};
+
+	state.stuffing = false;
+	int ret = this->code_chunks(chunks, threads, code, pass);
+	state.stuffing = true;
+	return ret;
+}
+
+/**
+ * Terminate the current restart interval, write the restart marker
+ * and reset the dc prediction
+ *
+ * @param output_buffer the output buffer
+ * @param state the entropy state
+ */
+void JPEGEncoder::emit_restart(output_arena_t& output_buffer, entropy_state_t& state)
+{
+	this->flush_entropy(output_buffer, state);
+	write_marker(output_buffer, 0xD0 + state.next_restart_num);
+	memset(state.last_dc_val, 0, sizeof(state.last_dc_val));
+}
+
+/**
+ * Reset the entropy state to the beginning of the scan
+ *
+ * @param state the entropy state
+ */
+void JPEGEncoder::reset_entropy_state(entropy_state_t& state)
+{
+	memset(state.last_dc_val, 0, sizeof(state.last_dc_val));
+	state.buffer = 0;
+	state.free_bits = 0x40;
+	state.restarts_to_go = this->m_restart_interval;
+	state.next_restart_num = 0;
+	state.stuffing = true;
+}
+
+/**
+ * Flush the bits remaining in the entropy state, filling up the last byte with ones
+ *
+ * @param output_buffer the output buffer
+ * @param state the entropy state
+ */
+void JPEGEncoder::flush_entropy(output_arena_t& output_buffer, entropy_state_t& state)
+{
+	int bits = 0x40 - state.free_bits;
+	int padding = (0x8 - (bits & 0x7)) & 0x7;
+	uint64_t buffer = (state.buffer << padding) | ((1 << padding) - 1);
+	bits += padding;
+	while(bits > 0)
+	{
+		bits -= 0x8;
+		unsigned char c = (unsigned char)(buffer >> bits);
+		*output_buffer.next++ = (char)c;
+		if(c == 0xFF && state.stuffing)
+			*output_buffer.next++ = 0;
+	}
+	state.buffer = 0;
+	state.free_bits = 0x40;
+}
+
+/**
+ * Start encoding an image that is passed in row by row. The rows are collected
+ * in strips of the given number of MCU rows, which are processed on the device
+ * and entropy coded while the next strip is filled. Two strips are kept on the
+ * device and on the host, independent of the image height. The file is written
+ * through the file writer if one is set.
+ *
+ * @param width of the image
+ * @param height of the image
+ * @param file the output file to store the image at
+ * @param strip_mcu_rows number of MCU rows (16 pixel rows) per strip, 0 to derive it from the device limits
+ * @return 0 on success
+ */
+int JPEGEncoder::start_stream(size_t width, size_t height, const char * const file, size_t strip_mcu_rows)
+{
+	encode_stream_t& stream = this->m_stream;
+
+	if(stream.started)
+	{
+		fprintf(stderr, "An image is already being encoded\n");
+		return 0x3;
+	}
+
+	/* Validate file handler, the file writer is used if one is set */
+	stream.target = {NULL, NULL, 0, NULL, NULL};
+	if(this->open_file_target(file, stream.target) != 0x0)
+		return 0x1;
+	stream.started = true;
+	stream.error = 0x0;
+
+	/* Use as many rows as fit into a quarter of the largest allocation on the device,
+	 * without a device the strip only bounds the memory held on the host */
+	if(strip_mcu_rows == 0 && this->m_devices.empty())
+		strip_mcu_rows = DEVICE_CHUNK_MCU_ROWS;
+	else if(strip_mcu_rows == 0)
+	{
+		size_t max_alloc = this->m_devices[0].device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+		strip_mcu_rows = max_alloc / (4 * sizeof(unsigned char) * 3 * (width << 0x4));
+		if(strip_mcu_rows == 0)
+			strip_mcu_rows = 1;
+	}
+
+	stream.width = width;
+	stream.height = height;
+	stream.strip_height = strip_mcu_rows << 0x4;
+	if(stream.strip_height > height)
+		stream.strip_height = ((height + 0xF) >> 0x4) << 0x4;
+	stream.rows = 0;
+	stream.strip_rows = 0;
+	stream.slot = 0;
+	stream.pending = false;
+
+	/* Allocate both strips up front */
+	for(size_t i = 0; i < 0x2; ++i)
+	{
+		if(this->m_devices.empty())
+			this->allocate_host_buffers(stream.buffers[i], width, stream.strip_height);
+		else
+			this->allocate_buffers(this->m_devices[0], stream.buffers[i], width, stream.strip_height);
+		stream.staging[i].resize(3 * width * stream.strip_height);
+	}
+
+	/* Write the file, frame and scan header to the output buffer */
+	stream.output.next = stream.output.data.get();
+	reserve_output(stream.output, HEADER_OUTPUT_BOUND + ((width + 0xF) >> 0x4) * (stream.strip_height >> 0x4) * MCU_OUTPUT_BOUND);
+	this->write_file_header(stream.output);
+	this->write_frame_header(stream.output, width, height);
+	this->write_scan_header(stream.output);
+
+	this->reset_entropy_state(stream.state);
+	return 0x0;
+}
+
+/**
+ * Pass the next rows of the image started with start_stream
+ *
+ * @param rows pointer to the RGB rows in flat row major layout, can be reused after returning
+ * @param count the number of rows
+ * @return 0 on success, 6 if writing the file failed
+ */
+int JPEGEncoder::write_scanlines(const unsigned char *rows, size_t count)
+{
+	encode_stream_t& stream = this->m_stream;
+	size_t row_size = 3 * stream.width;
+
+	if(!stream.started)
+	{
+		fprintf(stderr, "No image has been started\n");
+		return 0x3;
+	}
+	if(stream.rows + count > stream.height)
+	{
+		fprintf(stderr, "The image only contains %zu rows\n", stream.height);
+		return 0x4;
+	}
+
+	while(count > 0)
+	{
+		/* Copy as many rows as fit into the current strip */
+		size_t n = stream.strip_height - stream.strip_rows;
+		if(n > count)
+			n = count;
+		memcpy(&stream.staging[stream.slot][stream.strip_rows * row_size], rows, n * row_size);
+		stream.strip_rows += n;
+		stream.rows += n;
+		rows += n * row_size;
+		count -= n;
+
+		if(stream.strip_rows == stream.strip_height)
+			this->submit_strip(stream);
+	}
+	return stream.error;
+}
+
+/**
+ * Finish the image started with start_stream, all rows need to be passed before.
+ * The file is closed in any case.
+ *
+ * @return 0 on success, 6 if writing the file failed
+ */
+int JPEGEncoder::finish_stream(void)
+{
+	encode_stream_t& stream = this->m_stream;
+	int ret = 0x0;
+
+	if(!stream.started)
+	{
+		fprintf(stderr, "No image has been started\n");
+		return 0x3;
+	}
+	if(stream.rows != stream.height)
+	{
+		fprintf(stderr, "Only %zu of %zu rows have been passed\n", stream.rows, stream.height);
+		ret = 0x4;
+	}
+
+	/* Process the last partial strip and wait for the outstanding one */
+	if(ret == 0x0 && stream.strip_rows > 0)
+		this->submit_strip(stream);
+	if(stream.pending)
+	{
+		if(stream.pending_done() != NULL)
+			stream.pending_done.wait();
+		if(ret == 0x0)
+			this->encode_coefficients(stream.buffers[stream.slot ^ 0x1], stream.width, stream.pending_height, stream.output, stream.state);
+		this->release_coefficients(stream.buffers[stream.slot ^ 0x1]);
+		stream.pending = false;
+	}
+
+	if(ret == 0x0)
+	{
+		this->flush_entropy(stream.output, stream.state);
+		write_marker(stream.output, 0xD9);
+		ret = this->write_stream_output(stream);
+	}
+	stream.output.next = stream.output.data.get();
+	int closed = this->close_stream(stream);
+	return ret != 0x0 ? ret : closed;
+}
+
+/**
+ * Pass the output of the stream produced so far on to its file. After a write
+ * failed nothing is written anymore.
+ *
+ * @param stream the stream
+ * @return 0 on success, 6 if writing the file failed now or before
+ */
+int JPEGEncoder::write_stream_output(encode_stream_t& stream)
+{
+	if(stream.error == 0x0)
+	{
+		size_t size = output_size(stream.output);
+		if(stream.target.sink)
+			stream.error = pass_output(stream.output, stream.target.sink);
+		else if(fwrite(stream.output.data.get(), sizeof(char), size, stream.target.fp) != size)
+			stream.error = 0x6;
+		if(stream.error != 0x0)
+			fprintf(stderr, "Writing the streamed image failed\n");
+	}
+	stream.output.next = stream.output.data.get();
+	return stream.error;
+}
+
+/**
+ * Close the file of the stream, a file of the file writer is closed once
+ * its blocks are written, FileWriter::wait reports whether that succeeded
+ *
+ * @param stream the stream
+ * @return 0 on success, 6 if writing the file failed
+ */
+int JPEGEncoder::close_stream(encode_stream_t& stream)
+{
+	int ret = stream.error;
+	if(stream.target.wfile != NULL)
+		stream.target.writer->close(stream.target.wfile);
+	else if(fclose(stream.target.fp) != 0 && ret == 0x0)
+	{
+		fprintf(stderr, "Writing the streamed image failed\n");
+		ret = 0x6;
+	}
+	stream.target = {NULL, NULL, 0, NULL, NULL};
+	stream.started = false;
+	return ret;
+}
+
+/**
+ * Enqueue the strip currently filled to the device and entropy code the previous
+ * strip while the device works on this one. The output is written to the file
+ * after each strip.
+ *
+ * @param stream the stream the strip belongs to
+ */
+void JPEGEncoder::submit_strip(encode_stream_t& stream)
+{
+	cl::Event done;
+
+	/* Without a device the strip is encoded on the host right away and has no event */
+	if(this->m_devices.empty())
+	{
+		this->encode_on_host(stream.buffers[stream.slot], stream.staging[stream.slot].data(), stream.width, stream.strip_rows);
+	}
+	else
+		this->enqueue_image(this->m_devices[0], stream.buffers[stream.slot], stream.staging[stream.slot].data(), stream.width, stream.strip_rows, done);
+
+	/* Entropy code the previous strip */
+	if(stream.pending)
+	{
+		if(stream.pending_done() != NULL)
+			stream.pending_done.wait();
+		this->encode_coefficients(stream.buffers[stream.slot ^ 0x1], stream.width, stream.pending_height, stream.output, stream.state);
+		this->release_coefficients(stream.buffers[stream.slot ^ 0x1]);
+		(void)this->write_stream_output(stream);
+	}
+
+	stream.pending = true;
+	stream.pending_done = done;
+	stream.pending_height = stream.strip_rows;
+	stream.slot ^= 0x1;
+	stream.strip_rows = 0;
+}
+
+/**
+ * Write the file header
+ *
+ * @param output_buf the output buffer to use
+ */
+void JPEGEncoder::write_file_header(output_arena_t& output)
+{
+	static unsigned char headMagic[] = {0xFF, 0xD8, 0xFF, 0xE0};
+	static unsigned char jfifApp0[] = {0x00, 0x10, 'J', 'F', 'I', 'F', 0x0, 0x1, 0x1, 0x0, 0x0, 0x1, 0x0, 0x1, 0x0, 0x0};
+
+	/* Copy the head to the output buffer */
+	memcpy(output.next, headMagic, 0x4);
+	output.next += 0x4;
+
+	/* Copy the jfif app0 marker to the output buffer */
+	memcpy(output.next, jfifApp0, 0x10);
+	output.next += 0x10;
+}
+
+/**
+ * Write the frame header containing the quantification tables used
+ *
+ * @param output_buf the output buffer
+ * @param w the width of the image
+ * @param h the height of the image
+ */
+void JPEGEncoder::write_frame_header(output_arena_t& output_buf, size_t w, size_t h)
+{
+	write_quant_table(output_buf, 0);	/* Y Channel */
+	write_quant_table(output_buf, 1);	/* Cb/Cr Channel */
+	write_sof(output_buf, w, h);
+}
+
+/**
+ * Export the quantification table
+ *
+ * @param output_buf the output buffer
+ * @param index the index of the quantification table
+ */
+void JPEGEncoder::write_quant_table(output_arena_t& output_buf, int index)
+{
+	quantification_table_t *qtblptr;
+	size_t i;
+	qtblptr = &this->m_quant_tbls[index];
+
+	write_marker(output_buf, 0xDB);
+	write_2byte(output_buf, 0x40 + 1 + 2);
+	write_byte(output_buf, index);
+	for(i = 0; i < 0x40; ++i)
+	{
+		unsigned int qval = qtblptr->value[jpeg_natural_order[i]];
+		write_byte(output_buf, (int)(qval & 0xFF));
+	}
+}
+
+
+/**
+ * Export the huffman tables
+ *
+ * @param output_buf the output buffer
+ * @param index the index of the quantification table
+ * @param is_ac flag, true if ac table shall be exported, false if dc
+ */
+void JPEGEncoder::write_huffman_table(output_arena_t& output_buf, int index, unsigned char is_ac)
+{
+	huffman_table_t *htblptr;
+	size_t length, i;
+
+	if(is_ac) {
+		htblptr = &this->m_ac_huff_tbls[index];
+		index += 0x10;
+	} else {
+		htblptr = &this->m_dc_huff_tbls[index];
+	}
+
+	write_marker(output_buf, 0xC4);
+	length = 0;
+	for(i = 1; i < 0x11; ++i)
+		length += htblptr->bits[i];
+
+	/* Write section header containing number of bytes the secion contains */
+	write_2byte(output_buf, length + 2 + 1 + 0x10);
+
+	/* output the number of bytes consisting of the index, the bits and the values */
+	write_byte(output_buf, index);
+	for(i = 1; i < 0x11; ++i)
+		write_byte(output_buf, htblptr->bits[i]);
+	for(i = 0; i < length; ++i)
+		write_byte(output_buf, htblptr->value[i]);
+}
+
+
+/**
+ * Write the sos marker
+ *
+ * @param output_buf the output buffer to use
+ */
+void JPEGEncoder::write_sos(output_arena_t& output_buf)
+{
+	write_marker(output_buf, 0xDA);
+	write_2byte(output_buf, 2 * 0x3 + 2 + 1 + 3);
+	write_byte(output_buf, 0x3);			/* number of components */
+
+	/* Y Channel */
+	write_byte(output_buf, 1);				/* component id */
+	write_byte(output_buf, (0 << 0x4) + 0);	/* ( dc_tbl_no << 0x4 ) + ac_tbl_no */
+
+	/* Cb Channel */
+	write_byte(output_buf, 2);				/* component id */
+	write_byte(output_buf, (1 << 0x4) + 1);	/* ( dc_tbl_no << 0x4 ) + ac_tbl_no */
+
+	/* Cr Channel */
+	write_byte(output_buf, 3);				/* component id */
+	write_byte(output_buf, (1 << 0x4) + 1);	/* ( dc_tbl_no << 0x4 ) + ac_tbl_no */
+
+	/* End of sos section */
+	write_byte(output_buf, 0);
+	write_byte(output_buf, 0x3F);
+	write_byte(output_buf, 0);
+}
+
+/**
+ * Write the scan header containing the huffman tables
+ *
+ * @param output_buf the output buffer to use
+ */
+void JPEGEncoder::write_scan_header(output_arena_t& output_buf)
+{
+	/* Y Channel */
+	this->write_huffman_table(output_buf, 0, 0);
+	this->write_huffman_table(output_buf, 0, 1);
+
+	/* Cb / Cr Channel */
+	this->write_huffman_table(output_buf, 1, 0);
+	this->write_huffman_table(output_buf, 1, 1);
+
+	/* Restart interval, if enabled */
+	if(this->m_restart_interval > 0)
+		this->write_dri(output_buf);
+
+	/* Write sos marker */
+	this->write_sos(output_buf);
+}
+
+/**
+ * Write the dri marker defining the restart interval
+ *
+ * @param output_buf the output buffer to use
+ */
+void JPEGEncoder::write_dri(output_arena_t& output_buf)
+{
+	write_marker(output_buf, 0xDD);
+	write_2byte(output_buf, 0x4);
+	write_2byte(output_buf, this->m_restart_interval);
+}
+
+/**
+ * Write the SOF Part containing the sampling parameters and image size
+ *
+ * @param output_buf the output buffer to use
+ * @param w image width
+ * @param h image height
+ */
+void JPEGEncoder::write_sof(output_arena_t& output_buf, size_t w, size_t h)
+{
+	write_marker(output_buf, 0xC0);
+	write_2byte(output_buf, 3 * 0x3 + 2 + 5 + 1);
+	write_byte(output_buf, 0x8);
+	write_2byte(output_buf, h);
+	write_2byte(output_buf, w);
+	write_byte(output_buf, 0x3);
+
+	/* Y Channel */
+	write_byte(output_buf, 0x1);
+	write_byte(output_buf, (0x2 << 4) + 0x2);
+	write_byte(output_buf, 0);
+
+	/* Cb Channel */
+	write_byte(output_buf, 0x2);
+	write_byte(output_buf, (0x1 << 4) + 0x1);
+	write_byte(output_buf, 1);
+
+	/* Cr Channel */
+	write_byte(output_buf, 0x3);
+	write_byte(output_buf, (0x1 << 4) + 0x1);
+	write_byte(output_buf, 1);
+}
+
+/*
+ *  NOTE: this algorithm is part of the libjpeg-turbo project
+ *  https://github.com/libjpeg-turbo/libjpeg-turbo/
+ */
+#define PUT_BITS(code, size) { \
+	free_bits -= (size); \
+	if (free_bits < 0) { \
+		put_buffer = (put_buffer << ((size) + free_bits)) | ((uint64_t)(code) >> -free_bits); \
+		flush_word(outputbuf, put_buffer, state.stuffing); \
+		free_bits += 0x40; \
+		put_buffer = (uint64_t)(code); \
+	} else { \
+		put_buffer = (put_buffer << (size)) | (uint64_t)(code); \
+	} \
+}
+#define EMIT_BITS(code, size) { \
+	PUT_BITS(code, size) \
+}
+#define EMIT_CODE(code, size) { \
+	temp2 &= (((int) 1)<<nbits) - 1; \
+	PUT_BITS(((uint64_t)(code) << nbits) | temp2, (size) + nbits) \
+ }
+
+#ifdef ENTROPY_X86
+/*
+ * Byte shuffles gathering the zig zag order from the rows of a block. For each pair
+ * of zig zag ordered rows and each row of the block the two 128 bit lanes hold the
+ * shuffle for the first and the second zig zag row, 0x80 zeroes the elements that
+ * come from other rows of the block.
+ */
+struct zigzag_shuffle
+{
+	alignas(0x20) unsigned char mask[0x4][0x8][0x20];
+
+	zigzag_shuffle()
+	{
+		for(size_t i = 0; i < 0x40; ++i)
+		{
+			unsigned char natural = jpeg_natural_order[i];
+			for(size_t row = 0; row < 0x8; ++row)
+			{
+				unsigned char *m = &this->mask[i >> 0x4][row][(i & 0xF) << 0x1];
+				m[0] = (natural >> 0x3) == row ? (natural & 0x7) << 0x1 : 0x80;
+				m[1] = (natural >> 0x3) == row ? ((natural & 0x7) << 0x1) + 0x1 : 0x80;
+			}
+		}
+	}
+};
+
+/**
+ * Reorder a block into zig zag order using AVX2
+ *
+ * @param block the block in natural order
+ * @param zigzag the 64 coefficients in zig zag order
+ * @return mask with a bit set for each nonzero coefficient in zig zag order
+ */
+__attribute__((target("avx2")))
+static uint64_t zigzag_avx2(const short *block, short *zigzag)
+{
+	static const zigzag_shuffle shuffle;
+	__m256i rows[0x8], pairs[0x4];
+	const __m256i zero = _mm256_setzero_si256();
+
+	for(size_t row = 0; row < 0x8; ++row)
+		rows[row] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(block + (row << 0x3))));
+
+	for(size_t pair = 0; pair < 0x4; ++pair)
+	{
+		pairs[pair] = zero;
+		for(size_t row = 0; row < 0x8; ++row)
+			pairs[pair] = _mm256_or_si256(pairs[pair], _mm256_shuffle_epi8(rows[row], _mm256_load_si256((const __m256i*)shuffle.mask[pair][row])));
+		_mm256_storeu_si256((__m256i*)(zigzag + (pair << 0x4)), pairs[pair]);
+	}
+
+	/* Packing saturates, so nonzero coefficients stay nonzero bytes */
+	__m256i low = _mm256_permute4x64_epi64(_mm256_packs_epi16(pairs[0], pairs[1]), 0xD8);
+	__m256i high = _mm256_permute4x64_epi64(_mm256_packs_epi16(pairs[2], pairs[3]), 0xD8);
+	uint64_t zeros = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, zero)) |
+			((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, zero)) << 0x20);
+	return ~zeros;
+}
+
+/**
+ * Reorder a block into zig zag order using AVX-512
+ *
+ * @param block the block in natural order
+ * @param zigzag the 64 coefficients in zig zag order
+ * @return mask with a bit set for each nonzero coefficient in zig zag order
+ */
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t zigzag_avx512(const short *block, short *zigzag)
+{
+	__m512i low = _mm512_loadu_si512(block);
+	__m512i high = _mm512_loadu_si512(block + 0x20);
+
+	/* The natural index selects from both halves of the block, bit 5 picks the upper one */
+	__m512i order_low = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)jpeg_natural_order));
+	__m512i order_high = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(jpeg_natural_order + 0x20)));
+	__m512i zz_low = _mm512_permutex2var_epi16(low, order_low, high);
+	__m512i zz_high = _mm512_permutex2var_epi16(low, order_high, high);
+
+	_mm512_storeu_si512(zigzag, zz_low);
+	_mm512_storeu_si512(zigzag + 0x20, zz_high);
+	return (uint64_t)_mm512_test_epi16_mask(zz_low, zz_low) |
+			((uint64_t)_mm512_test_epi16_mask(zz_high, zz_high) << 0x20);
+}
+
+/**
+ * Encode the entropy of a single block in zig zag order, only visiting the
+ * nonzero coefficients. Produces the same output as encode_entropy_single_block
+ *
+ * @param zigzag the coefficients in zig zag order
+ * @param nonzero mask with a bit set for each nonzero coefficient
+ * @param last_dc_val the last dc value from the previous block
+ * @param dcd the derived dc huffman table
+ * @param acd the derived ac huffman table
+ * @param outputbuf the output buffer to use
+ * @param state current bits to be exported from the entropy
+ */
+__attribute__((target("bmi,lzcnt")))
+static void encode_zigzag_block(const short *zigzag, uint64_t nonzero, int last_dc_val, const derived_huffman_table_t *dcd, const derived_huffman_table_t *acd, output_arena_t& outputbuf, entropy_state_t& state)
+{
+	int temp, temp2, temp3, r, k, last, code, size, free_bits, nbits;
+	uint64_t put_buffer = state.buffer;
+	free_bits = state.free_bits;
+
+	temp = temp2 = zigzag[0] - last_dc_val;
+	temp3 = temp >> (8 * sizeof(int) - 1);
+	temp ^= temp3;
+	temp -= temp3;
+
+	temp2 += temp3;
+	nbits = 0x20 - _lzcnt_u32(temp);
+
+	code = dcd->code[nbits];
+	size = dcd->length[nbits];
+	EMIT_BITS(code, size)
+
+	temp2 &= (((long) 1) << nbits) - 1;
+	EMIT_BITS(temp2, nbits)
+
+	/* run length encoding over the nonzero ac coefficients */
+	nonzero &= ~(uint64_t)1;
+	last = 0;
+	while(nonzero)
+	{
+		k = (int)_tzcnt_u64(nonzero);
+		r = k - last - 1;
+
+		temp = temp2 = zigzag[k];
+		temp3 = temp >> (8 * sizeof(int) - 1);
+		temp ^= temp3;
+		temp -= temp3;
+		temp2 += temp3;
+		nbits = 0x20 - _lzcnt_u32(temp);
+
+		/* if run length > 15, must emit special run-length-16 codes (0xF0) */
+		while(r > 15) {
+			EMIT_BITS(acd->code[0xf0], acd->length[0xf0])
+			r -= 16;
+		}
+
+		/* Emit Huffman symbol for run length / number of bits */
+		temp3 = (r << 4) + nbits;
+		code = acd->code[temp3];
+		size = acd->length[temp3];
+		EMIT_CODE(code, size)
+
+		last = k;
+		nonzero = _blsr_u64(nonzero);
+	}
+
+	if(last < 0x3F) {
+		code = acd->code[0];
+		size = acd->length[0];
+		EMIT_BITS(code, size);
+	}
+
+	/* Store the current state back in the global one */
+	state.free_bits = free_bits;
+	state.buffer = put_buffer;
+}
+#endif
+
+/**
+ * Encode the entropy of a single block
+ *
+ * @param block the block
+ * @param table_index the table index for the huffman tables to use
+ * @param last_dc_val the last dc value from the previous block
+ * @param outputbuf the output buffer to use
+ * @param state current bits to be exported from the entropy
+ */
+void JPEGEncoder::encode_entropy_single_block(short *block, int table_index, int last_dc_val, output_arena_t& outputbuf, entropy_state_t& state)
+{
+	int temp, temp2, temp3, r, code, size, free_bits, nbits, code_0xf0, size_0xf0;
+	uint64_t put_buffer;
+	derived_huffman_table_t *dcd;
+	derived_huffman_table_t *acd;
+
+	/* init values */
+	dcd = &this->m_dc_derived_tbls[table_index];
+	acd = &this->m_ac_derived_tbls[table_index];
+	code_0xf0 = acd->code[0xf0];
+	size_0xf0 = acd->length[0xf0];
+
+	put_buffer = state.buffer;
+	free_bits = state.free_bits;
+
+
+	temp = temp2 = block[0] - last_dc_val;
+	temp3 = temp >> (8 * sizeof(int) - 1);
+	temp ^= temp3;
+	temp -= temp3;
+
+	temp2 += temp3;
+	nbits = nbits_table[temp];
+
+	code = dcd->code[nbits];
+	size = dcd->length[nbits];
+	EMIT_BITS(code, size)
+
+	temp2 &= (((long) 1) << nbits) - 1;
+	EMIT_BITS(temp2, nbits)
+
+	/* run length encoding */
+	r = 0;
+
+	/* Run length encoding macro */
+	#define kloop(k) {  \
+		if ((temp = block[k]) == 0) { \
+			r++; \
+		} else { \
+			temp2 = temp; \
+			temp3 = temp >> (8 * sizeof(int) - 1); \
+			temp ^= temp3; \
+			temp -= temp3; \
+			temp2 += temp3; \
+			nbits = nbits_table[temp]; \
+			/* if run length > 15, must emit special run-length-16 codes (0xF0) */ \
+			while (r > 15) { \
+				EMIT_BITS(code_0xf0, size_0xf0) \
+				r -= 16; \
+			} \
+			/* Emit Huffman symbol for run length / number of bits */ \
+			temp3 = (r << 4) + nbits;  \
+			code = acd->code[temp3]; \
+			size = acd->length[temp3]; \
+			EMIT_CODE(code, size) \
+			r = 0;  \
+		} \
+	}
+
+	/* Do run length encoding in zig zag pattern */
+	kloop(1);   kloop(8);   kloop(16);  kloop(9);   kloop(2);   kloop(3);
+	kloop(10);  kloop(17);  kloop(24);  kloop(32);  kloop(25);  kloop(18);
+	kloop(11);  kloop(4);   kloop(5);   kloop(12);  kloop(19);  kloop(26);
+	kloop(33);  kloop(40);  kloop(48);  kloop(41);  kloop(34);  kloop(27);
+	kloop(20);  kloop(13);  kloop(6);   kloop(7);   kloop(14);  kloop(21);
+	kloop(28);  kloop(35);  kloop(42);  kloop(49);  kloop(56);  kloop(57);
+	kloop(50);  kloop(43);  kloop(36);  kloop(29);  kloop(22);  kloop(15);
+	kloop(23);  kloop(30);  kloop(37);  kloop(44);  kloop(51);  kloop(58);
+	kloop(59);  kloop(52);  kloop(45);  kloop(38);  kloop(31);  kloop(39);
+	kloop(46);  kloop(53);  kloop(60);  kloop(61);  kloop(54);  kloop(47);
+	kloop(55);  kloop(62);  kloop(63);
+
+	if(r > 0) {
+		code = acd->code[0];
+		size = acd->length[0];
+		EMIT_BITS(code, size);
+	}
+
+	/* Store the current state back in the global one */
+	state.free_bits = free_bits;
+	state.buffer = put_buffer;
+}
+
+/**
+ * Do a entropy encoding for a super block containing of four luminance blocks and
+ * for the cb/cr one chrominance block each
+ *
+ * @param mcu_buffer pointer to the blocks
+ * @param outputbuf the output buffer
+ * @param state the entropy state
+ */
+void JPEGEncoder::encode_entropy(short *mcu_buffer[0x6], output_arena_t& outputbuf, entropy_state_t& state)
+{
+	const static unsigned char mcu_membership[0x6] = {0x0, 0x0, 0x0, 0x0, 0x1, 0x2};
+	const static unsigned char table_index[0x6] = {0x0, 0x0, 0x0, 0x0, 0x1, 0x1};
+	size_t i, ci;
+
+	/* Perform encoding on each block */
+	for(i = 0; i < 0x6; ++i)
+	{
+		ci = mcu_membership[i];
+#ifdef ENTROPY_X86
+		if(this->m_entropy_isa != ENTROPY_SCALAR)
+		{
+			short zigzag[0x40];
+			uint64_t nonzero = this->m_entropy_isa == ENTROPY_AVX512 ? zigzag_avx512(mcu_buffer[i], zigzag) : zigzag_avx2(mcu_buffer[i], zigzag);
+			encode_zigzag_block(zigzag, nonzero, state.last_dc_val[ci], &this->m_dc_derived_tbls[table_index[i]], &this->m_ac_derived_tbls[table_index[i]], outputbuf, state);
+		}
+		else
+#endif
+		this->encode_entropy_single_block(mcu_buffer[i], table_index[i], state.last_dc_val[ci], outputbuf, state);
+		state.last_dc_val[ci] = mcu_buffer[i][0];
+	}
+}
+
+
+
+
+
+// =========================================================================
+//
+// Setup routine for the encoder
+//
+// =========================================================================
+
+/**
+ * Create the encoder
+ *
+ * @param quality the quality to use (clamped between 1 and 100)
+ */
+void JPEGEncoder::create_encoder(unsigned char quality)
+{
+	this->set_quality_setting(quality);
+	this->create_huffman_tables();
+	this->create_dct_division_tables();
+	this->create_derived_huffman_tables();
+}
+
+/**
+ * Set the quality in the quantification tables
+ *
+ * @param quality quality the quality to use (clamped between 1 and 100)
+ */
+void JPEGEncoder::set_quality_setting(unsigned char quality)
+{
+	unsigned char q;
+	if(quality <= 0)
+	{
+		q = 1;
+	}
+	else if(quality > 100)
+	{
+		q = 100;
+	}
+	else if(quality < 50)
+	{
+		q = 5000 / quality;
+	}
+	else
+	{
+		q = 200 - (quality << 0x1);
+	}
+
+	/* Create quantification tables for luminance and chrominance */
+	this->create_quant_table(0, q, std_luminance_quant_tbl);
+	this->create_quant_table(1, q, std_chrominance_quant_tbl);
+}
+
+/**
+ * Create the quantification tables for the encoder based on the given scale factor
+ *
+ * @param table_id the id of the quantification table in the encoder
+ * @param scale the scale to use (quality setting)
+ * @param base_table the base table to scale
+ */
+void JPEGEncoder::create_quant_table(int table_idx, unsigned char scale, const unsigned int *base_table)
+{
+	quantification_table_t *tblptr;
+	size_t i;
+	long temp;
+
+	tblptr = &this->m_quant_tbls[table_idx];
+	for(i = 0; i < 0x40; ++i)
+	{
+		temp = ((long)base_table[i] * scale + 50) / 100;
+		if(temp <= 0)
+		{
+			temp = 1;
+		}
+		else if(temp > 0xFF)
+		{
+			temp = 0xFF;
+		}
+		tblptr->value[i] = (unsigned char)temp;
+	}
+}
+
+/**
+ * Create the huffman tables for the given encoder
+ */
+void JPEGEncoder::create_huffman_tables(void)
+{
+	/* Luminance huffman table */
+	this->add_huffman_table(&this->m_dc_huff_tbls[0], bits_dc_luminance, value_dc_luminance);
+	this->add_huffman_table(&this->m_ac_huff_tbls[0], bits_ac_luminance, value_ac_luminance);
+
+	/* Chrominance huffman table */
+	this->add_huffman_table(&this->m_dc_huff_tbls[1], bits_dc_chrominance, value_dc_chrominance);
+	this->add_huffman_table(&this->m_ac_huff_tbls[1], bits_ac_chrominance, value_ac_chrominance);
+}
+
+/**
+ * Add the huffman table to the encoder, count the number of bits
+ * and copy the number of values accordingly to the huffman table
+ *
+ * @param tblptr huffman table to use
+ * @param bits length
+ * @param values the values
+ */
+void JPEGEncoder::add_huffman_table(huffman_table_t *tblptr, const unsigned char *bits, const unsigned char *values)
+{
+	size_t len;
+	int n = 0;
+
+	/* copy the bits */
+	memcpy(tblptr->bits, bits, sizeof(tblptr->bits));
+
+	/* count the length */
+	for(len = 0; len < 0x11; ++len)
+		n += bits[len];
+
+	/* set table to zero */
+	memset(tblptr->value, 0, sizeof(tblptr->value));
+
+	/* copy length many values */
+	memcpy(tblptr->value, values, n * sizeof(unsigned char));
+}
+
+/**
+ * Create the dct divisor tables
+ */
+void JPEGEncoder::create_dct_division_tables(void)
+{
+	size_t i;
+	quantification_table_t *qtblptr;
+	short *dtblptr;
+
+	/* Y Channel */
+	qtblptr = &this->m_quant_tbls[0];
+	dtblptr = this->m_fdct_divisors[0];
+	for(i = 0; i < 0x40; ++i)
+	{
+		compute_reciprocal(qtblptr->value[i] << 0x3, &dtblptr[i]);
+	}
+
+	/* Cb/Cr channel, since they share the table the computation
+	 * needs to be done only once */
+	qtblptr = &this->m_quant_tbls[1];
+	dtblptr = this->m_fdct_divisors[1];
+	for(i = 0; i < 0x40; ++i)
+	{
+		compute_reciprocal(qtblptr->value[i] << 0x3, &dtblptr[i]);
+	}
+}
+
+/**
+ * Create the derived huffman tables
+ */
+void JPEGEncoder::create_derived_huffman_tables(void)
+{
+	/* Y Channel */
+	this->derive_huffman_table(1, &this->m_dc_huff_tbls[0], &this->m_dc_derived_tbls[0]);
+	this->derive_huffman_table(0, &this->m_ac_huff_tbls[0], &this->m_ac_derived_tbls[0]);
+
+	/* Cb/Cr channel, since they share the table the computation
+	 * needs to be done only once */
+	this->derive_huffman_table(1, &this->m_dc_huff_tbls[1], &this->m_dc_derived_tbls[1]);
+	this->derive_huffman_table(0, &this->m_ac_huff_tbls[1], &this->m_ac_derived_tbls[1]);
+}
+
+/**
+ * Derive the huffman tables
+ *
+ * @param is_dc flag whether current table is dc or ac
+ * @param table_idx table index to use
+ * @param pointer to the derived huffman table to be filled
+ */
+void JPEGEncoder::derive_huffman_table(unsigned char is_dc, huffman_table_t *htblptr, derived_huffman_table_t *dhtblptr)
+{
+	int p, i, l, lastp, si;
+	char huffsize[0x101];
+	unsigned int huffcode[0x101];
+	unsigned int code;
+
+	/* Figure C.1: make table of Huffman code length for each symbol */
+	p = 0;
+	for (l = 1; l < 0x11; l++)
+	{
+		i = (int) htblptr->bits[l];
+		while (i--)
+		{
+			huffsize[p++] = (char) l;
+		}
+	}
+	huffsize[p] = 0;
+	lastp = p;
+
+	/* Figure C.2: generate the codes themselves */
+	code = 0;
+	si = huffsize[0];
+	p = 0;
+	while (huffsize[p])
+	{
+		while (((int) huffsize[p]) == si)
+		{
+			huffcode[p++] = code;
+			code++;
+		}
+		code <<= 1;
+		si++;
+	}
+
+	/* Figure C.3: generate encoding tables */
+	memset(dhtblptr->length, 0, sizeof(dhtblptr->length));
+
+	for (p = 0; p < lastp; ++p)
+	{
+		i = htblptr->value[p];
+		dhtblptr->code[i] = huffcode[p];
+		dhtblptr->length[i] = huffsize[p];
+	}
+}
+
+
+}	/* end of namespace jpeg */
@@ -6,8 +6,23 @@
 #include <sstream>
 #include <iostream>
 #include <cmath>
+#include <cctype>
+#include <cstdint>
 #include <iomanip>
 #include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "../include/jpeg_encoder.hpp"
 
 struct rgb {
@@ -20,10 +35,38 @@ typedef struct rgb rgb_t;
 struct PPMimage {
 	size_t w, h;
 	rgb_t *pixel;
+
+	/* Mapping of the whole file if the pixels are read from it in place, NULL otherwise */
+	void *mapping;
+	size_t mapping_length;
 };
 typedef struct PPMimage ppm_t;
 
+/* Number of images read ahead of the encoder in batch mode */
+#define BATCH_READ_AHEAD 0x4
+
+struct batch_job {
+	std::string input;
+	std::string output;
+	ppm_t image;
+
+	/* Error reading the image, 0 if it was read */
+	int error;
+};
+typedef struct batch_job batch_job_t;
+
+struct batch_queue {
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<batch_job_t*> jobs;
+
+	/* Flag whether all images were read */
+	bool done;
+};
+typedef struct batch_queue batch_queue_t;
+
 int readPPMImage(const char * const file, size_t *width, size_t *height, rgb_t **buffer);
+int mapPPMImage(const char * const file, ppm_t *image);
 
 int readPPMImage(const char * const file, size_t *width, size_t *height, rgb_t **buffer)
 {
@@ -73,37 +116,360 @@ int readPPMImage(const char * const file, size_t *width, size_t *height, rgb_t *
 		goto end;
 	}
 
-	(void)fread(*buffer, sizeof(rgb_t), *width * *height, fp);
+	if(fread(*buffer, sizeof(rgb_t), *width * *height, fp) != *width * *height) {
+		//fprintf(stderr, "Illegal file format");
+		free(*buffer);
+		*buffer = NULL;
+		ret = 0x3;
+	}
 
 	end:
 	fclose(fp);
 	return ret;
 }
 
+/**
+ * Skip the whitespace and comments in the header of a mapped PPM file and parse the next number
+ *
+ * @param data the mapped file
+ * @param length the length of the file
+ * @param pos the position in the file, moved behind the number
+ * @param value the number parsed
+ * @return 0 on success
+ */
+static int parsePPMNumber(const char *data, size_t length, size_t *pos, size_t *value)
+{
+	while(*pos < length && (isspace((unsigned char)data[*pos]) || data[*pos] == '#')) {
+		if(data[*pos] == '#') {
+			while(*pos < length && data[*pos] != '\n')
+				(*pos)++;
+		}
+		else
+			(*pos)++;
+	}
+
+	if(*pos >= length || !isdigit((unsigned char)data[*pos]))
+		return 0x1;
+	*value = 0;
+	while(*pos < length && isdigit((unsigned char)data[*pos])) {
+		/* Reject numbers that would wrap around */
+		if(*value > (SIZE_MAX - 9) / 10)
+			return 0x1;
+		*value = *value * 10 + (data[(*pos)++] - '0');
+	}
+	return 0x0;
+}
+
+/**
+ * Map the given PPM file into memory and parse its header in place, the pixels
+ * are read right from the mapping. The pages are read ahead while the encoder
+ * is set up and uploaded without copying them to an own buffer first.
+ *
+ * @param file the file
+ * @param image the image, the mapping needs to be released with munmap
+ * @return 0 on success, 3 if the file is no valid PPM image, otherwise the file could not be mapped
+ */
+int mapPPMImage(const char * const file, ppm_t *image)
+{
+	struct stat st;
+	size_t pos, maxval;
+	const char *data;
+	int ret;
+
+	ret = 0;
+	int fd = open(file, O_RDONLY);
+	if(fd < 0) {
+		//fprintf(stderr, "Could not open file");
+		return 0x1;
+	}
+
+	/* Pipes and other files that can not be mapped are read into memory instead */
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		//fprintf(stderr, "Could not get content from file");
+		ret = 0x2;
+		goto end;
+	}
+
+	if(st.st_size < 2) {
+		//fprintf(stderr, "Illegal file format");
+		ret = 0x3;
+		goto end;
+	}
+
+	image->mapping_length = st.st_size;
+	image->mapping = mmap(NULL, image->mapping_length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(image->mapping == MAP_FAILED) {
+		//fprintf(stderr, "Could not map file");
+		image->mapping = NULL;
+		ret = 0x4;
+		goto end;
+	}
+
+	/* The file is read front to back once, start reading it in right away */
+	(void)madvise(image->mapping, image->mapping_length, MADV_SEQUENTIAL);
+	(void)madvise(image->mapping, image->mapping_length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	(void)madvise(image->mapping, image->mapping_length, MADV_HUGEPAGE);
+#endif
+
+	data = (const char*)image->mapping;
+	if(data[0] != 'P' || data[1] != '6') {
+		//fprintf(stderr, "Illegal file format");
+		ret = 0x3;
+		goto end;
+	}
+
+	/* Width, height and maximum value are followed by a single whitespace, the pixels need
+	 * to fit into the rest of the file, checked without multiplying to avoid an overflow */
+	pos = 2;
+	if(parsePPMNumber(data, image->mapping_length, &pos, &image->w) ||
+			parsePPMNumber(data, image->mapping_length, &pos, &image->h) ||
+			parsePPMNumber(data, image->mapping_length, &pos, &maxval) ||
+			maxval > 0xFF || image->w == 0 || pos + 1 > image->mapping_length ||
+			image->h > (image->mapping_length - pos - 1) / sizeof(rgb_t) / image->w) {
+		//fprintf(stderr, "Illegal file format");
+		ret = 0x3;
+		goto end;
+	}
+	image->pixel = (rgb_t*)(data + pos + 1);
+
+	end:
+	if(ret != 0 && image->mapping != NULL) {
+		munmap(image->mapping, image->mapping_length);
+		image->mapping = NULL;
+	}
+	close(fd);
+	return ret;
+}
+
+/**
+ * Read the given image, mapping it if possible. The file is only read into a buffer
+ * if it cannot be mapped, images with an invalid format are rejected.
+ *
+ * @param file the file
+ * @param image the image, released with releasePPMImage
+ * @return 0 on success
+ */
+int loadPPMImage(const char * const file, ppm_t *image)
+{
+	int ret;
+
+	image->mapping = NULL;
+	ret = mapPPMImage(file, image);
+	if(ret == 0x0 || ret == 0x3)
+		return ret;
+	return readPPMImage(file, &image->w, &image->h, &image->pixel);
+}
+
+/**
+ * Release the given image
+ *
+ * @param image the image
+ */
+void releasePPMImage(ppm_t *image)
+{
+	if(image->mapping != NULL)
+		munmap(image->mapping, image->mapping_length);
+	else
+		free(image->pixel);
+}
+
+/**
+ * Get the output file for the given input file, the extension is replaced by .jpg
+ *
+ * @param input the input file
+ * @param directory the output directory
+ * @return the output file
+ */
+static std::string outputFile(const std::string& input, const std::string& directory)
+{
+	size_t slash = input.find_last_of('/');
+	std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+	size_t dot = name.find_last_of('.');
+	if(dot != std::string::npos && dot != 0)
+		name.erase(dot);
+	return directory + "/" + name + ".jpg";
+}
+
+/**
+ * Collect the images to encode in batch mode. A directory yields all .ppm files in it,
+ * sorted by name, otherwise the file is a manifest listing one input file per line,
+ * optionally followed by the output file. Empty lines and lines starting with # are skipped.
+ *
+ * @param source the directory or manifest
+ * @param directory the output directory for images without an output file
+ * @param jobs the images found
+ * @return 0 on success
+ */
+int listBatchJobs(const char * const source, const char * const directory, std::vector<batch_job_t*>& jobs)
+{
+	std::vector<std::pair<std::string, std::string> > files;
+	struct dirent *entry;
+	std::string line;
+
+	DIR *dir = opendir(source);
+	if(dir != NULL) {
+		while((entry = readdir(dir)) != NULL) {
+			std::string name = entry->d_name;
+			if(name.size() > 4 && name.compare(name.size() - 4, 4, ".ppm") == 0)
+				files.push_back(std::make_pair(std::string(source) + "/" + name, std::string()));
+		}
+		closedir(dir);
+		std::sort(files.begin(), files.end());
+	}
+	else {
+		std::ifstream manifest(source);
+		if(!manifest) {
+			//fprintf(stderr, "Could not open file");
+			return 0x1;
+		}
+		while(std::getline(manifest, line)) {
+			std::istringstream fields(line);
+			std::string input, output;
+			if(!(fields >> input) || input[0] == '#')
+				continue;
+			fields >> output;
+			files.push_back(std::make_pair(input, output));
+		}
+	}
+
+	for(size_t i = 0; i < files.size(); ++i) {
+		batch_job_t *job = new batch_job_t();
+		job->input = files[i].first;
+		job->output = files[i].second.empty() ? outputFile(files[i].first, directory) : files[i].second;
+		jobs.push_back(job);
+	}
+	return 0x0;
+}
+
+/**
+ * Read the images of the given jobs in order, at most BATCH_READ_AHEAD are queued
+ *
+ * @param jobs the jobs
+ * @param queue the queue to pass the read images to
+ */
+void readBatchImages(const std::vector<batch_job_t*>& jobs, batch_queue_t *queue)
+{
+	for(size_t i = 0; i < jobs.size(); ++i) {
+		jobs[i]->error = loadPPMImage(jobs[i]->input.c_str(), &jobs[i]->image);
+
+		std::unique_lock<std::mutex> lock(queue->lock);
+		queue->changed.wait(lock, [queue] { return queue->jobs.size() < BATCH_READ_AHEAD; });
+		queue->jobs.push_back(jobs[i]);
+		queue->changed.notify_all();
+	}
+
+	std::lock_guard<std::mutex> guard(queue->lock);
+	queue->done = true;
+	queue->changed.notify_all();
+}
+
+/**
+ * Encode all images listed in the given manifest or directory with a single encoder.
+ * Reading, encoding and writing are pipelined: the images are read on a thread of
+ * their own, the device part of the next image runs while the previous one is
+ * entropy coded and the files are written asynchronously.
+ *
+ * @param source the directory or manifest
+ * @param directory the output directory
+ * @param quality the quality setting
+ * @return 0 if all images were encoded
+ */
+int encodeBatch(const char * const source, const char * const directory, unsigned char quality)
+{
+	std::vector<batch_job_t*> jobs;
+	std::deque<std::pair<batch_job_t*, std::future<int> > > pending;
+	batch_queue_t queue;
+	int ret;
+
+	if(listBatchJobs(source, directory, jobs)) {
+		fprintf(stderr, "Error Reading batch '%s'\naborting...\n", source);
+		return 0x2;
+	}
+
+	/* Start reading the images while the encoder is created */
+	ret = 0;
+	queue.done = false;
+	std::thread reader(readBatchImages, std::cref(jobs), &queue);
+
+	jpeg::JPEGEncoder encoder(CL_DEVICE_TYPE_ALL, quality);
+	jpeg::FileWriter writer;
+	encoder.set_file_writer(&writer);
+
+	for(;;) {
+		std::unique_lock<std::mutex> lock(queue.lock);
+		queue.changed.wait(lock, [&queue] { return !queue.jobs.empty() || queue.done; });
+		if(queue.jobs.empty())
+			break;
+		batch_job_t *job = queue.jobs.front();
+		queue.jobs.pop_front();
+		queue.changed.notify_all();
+		lock.unlock();
+
+		if(job->error) {
+			fprintf(stderr, "Error Reading input file '%s'\n", job->input.c_str());
+			ret = 0x3;
+			continue;
+		}
+
+		/* The image needs to stay valid until its entropy coding is done */
+		pending.push_back(std::make_pair(job, encoder.encode_async((unsigned char*)job->image.pixel,
+				job->image.w, job->image.h, job->output.c_str())));
+		while(pending.size() > ENCODE_SLOTS) {
+			if(pending.front().second.get() != 0) {
+				fprintf(stderr, "Error Encoding '%s'\n", pending.front().first->input.c_str());
+				ret = 0x3;
+			}
+			releasePPMImage(&pending.front().first->image);
+			pending.pop_front();
+		}
+	}
+
+	for(; !pending.empty(); pending.pop_front()) {
+		if(pending.front().second.get() != 0) {
+			fprintf(stderr, "Error Encoding '%s'\n", pending.front().first->input.c_str());
+			ret = 0x3;
+		}
+		releasePPMImage(&pending.front().first->image);
+	}
+
+	reader.join();
+	if(writer.wait())
+		ret = 0x3;
+	for(size_t i = 0; i < jobs.size(); ++i)
+		delete jobs[i];
+	return ret;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Main function
 //////////////////////////////////////////////////////////////////////////////
 int main(int argc, char** argv) {
 	ppm_t image;
 
+	/* jpeg_enc -b <manifest | directory> <output directory> <quality> */
+	if(argc == 5 && strcmp(argv[1], "-b") == 0)
+		return encodeBatch(argv[2], argv[3], atoi(argv[4]));
+
 	if(argc != 4)
 		return 1;
 
-	/* Create the encoder */
-	jpeg::JPEGEncoder encoder(CL_DEVICE_TYPE_ALL, atoi(argv[3]));
-
-	/* Read input image */
-	if(readPPMImage(argv[1], &image.w, &image.h, &image.pixel))
+	/* Map the input image before creating the encoder, so it is read in while the
+	 * program is built. Files that can not be mapped are read into memory instead */
+	if(loadPPMImage(argv[1], &image))
 	{
 		fprintf(stderr, "Error Reading input file\naborting...\n");
 		return 0x2;
 	}
 
+	/* Create the encoder */
+	jpeg::JPEGEncoder encoder(CL_DEVICE_TYPE_ALL, atoi(argv[3]));
+
 	/* Encode the image */
 	encoder.encode_image((unsigned char*)image.pixel, image.w, image.h, argv[2]);
 
 	/* Free image memory */
-	free(image.pixel);
+	releasePPMImage(&image);
 
 	return 0;
 }